@@ -0,0 +1,132 @@
+///////////////////////////////////////////////////////////////////////////////
+// Replacement operator new/delete for allocation tracking.
+//
+// Link this file in to turn tracking on. Each block carries a 16 byte header
+// in front of the user pointer holding its size, tag and birth timestamp so
+// frees can be charged back to the tag that allocated them.
+///////////////////////////////////////////////////////////////////////////////
+
+#include <cstddef>
+#include <new>
+
+#include "alloctrack.h"
+
+struct AllocHeader {
+	uint64_t sizeAndTag;
+	uint64_t birth;
+};
+
+static_assert(sizeof(AllocHeader) == 16, "header must preserve 16 byte alignment");
+
+static const int TagShift = 48;
+static const uint64_t SizeMask = (1ull << TagShift) - 1;
+
+static struct AllocTrackerLink {
+	AllocTrackerLink() {
+		AllocTracker::MarkLinked();
+	}
+} allocTrackerLink;
+
+// The header sits immediately before the user pointer; for over-aligned
+// blocks the allocation is padded so that the user pointer stays aligned.
+static void* TrackedAlloc(size_t size, size_t alignment) {
+	size_t offset = alignment > sizeof(AllocHeader) ? alignment : sizeof(AllocHeader);
+	void* base;
+	if (alignment > alignof(std::max_align_t)) {
+		size_t total = (offset + size + alignment - 1) / alignment * alignment;
+		base = aligned_alloc(alignment, total);
+	} else {
+		base = malloc(offset + size);
+	}
+	if (base == nullptr) {
+		return nullptr;
+	}
+	uint8_t* user = (uint8_t*)base + offset;
+	AllocHeader* header = (AllocHeader*)user - 1;
+	uint16_t tag = AllocTracker::CurrentTag();
+	header->sizeAndTag = (uint64_t)size | ((uint64_t)tag << TagShift);
+	header->birth = ReadTimestamp();
+	AllocTracker::RecordAlloc(tag, size);
+	return user;
+}
+
+static void TrackedFree(void* ptr, size_t alignment) {
+	if (ptr == nullptr) {
+		return;
+	}
+	AllocHeader* header = (AllocHeader*)ptr - 1;
+	uint16_t tag = (uint16_t)(header->sizeAndTag >> TagShift);
+	AllocTracker::RecordFree(tag, header->sizeAndTag & SizeMask, ReadTimestamp() - header->birth);
+	size_t offset = alignment > sizeof(AllocHeader) ? alignment : sizeof(AllocHeader);
+	free((uint8_t*)ptr - offset);
+}
+
+static void* TrackedNew(size_t size, size_t alignment) {
+	for (;;) {
+		void* ptr = TrackedAlloc(size, alignment);
+		if (ptr != nullptr) {
+			return ptr;
+		}
+		std::new_handler handler = std::get_new_handler();
+		if (handler == nullptr) {
+			throw std::bad_alloc();
+		}
+		handler();
+	}
+}
+
+void* operator new(size_t size) {
+	return TrackedNew(size, alignof(std::max_align_t));
+}
+
+void* operator new[](size_t size) {
+	return TrackedNew(size, alignof(std::max_align_t));
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+	return TrackedAlloc(size, alignof(std::max_align_t));
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+	return TrackedAlloc(size, alignof(std::max_align_t));
+}
+
+void* operator new(size_t size, std::align_val_t alignment) {
+	return TrackedNew(size, (size_t)alignment);
+}
+
+void* operator new[](size_t size, std::align_val_t alignment) {
+	return TrackedNew(size, (size_t)alignment);
+}
+
+void operator delete(void* ptr) noexcept {
+	TrackedFree(ptr, alignof(std::max_align_t));
+}
+
+void operator delete[](void* ptr) noexcept {
+	TrackedFree(ptr, alignof(std::max_align_t));
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+	TrackedFree(ptr, alignof(std::max_align_t));
+}
+
+void operator delete[](void* ptr, size_t) noexcept {
+	TrackedFree(ptr, alignof(std::max_align_t));
+}
+
+void operator delete(void* ptr, std::align_val_t alignment) noexcept {
+	TrackedFree(ptr, (size_t)alignment);
+}
+
+void operator delete[](void* ptr, std::align_val_t alignment) noexcept {
+	TrackedFree(ptr, (size_t)alignment);
+}
+
+void operator delete(void* ptr, size_t, std::align_val_t alignment) noexcept {
+	TrackedFree(ptr, (size_t)alignment);
+}
+
+void operator delete[](void* ptr, size_t, std::align_val_t alignment) noexcept {
+	TrackedFree(ptr, (size_t)alignment);
+}
@@ -0,0 +1,201 @@
+#pragma once
+
+///////////////////////////////////////////////////////////////////////////////
+// Allocation Tracking.
+//
+// Every allocation is charged to the innermost active tag on the allocating
+// thread. Counters live in per-thread blocks so the hot path never takes a
+// lock; the blocks are only summed when a report is requested.
+//
+// Tracking is opt-in. The replacement operator new/delete lives in
+// alloctrack.cpp and only takes effect when that file is linked in (see the
+// geometric-alloc target). Without it tags compile down to a thread-local
+// store and the report says tracking is not linked.
+///////////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+#include "profiler.h"
+
+struct AllocThreadCounters {
+	static const int MaxTags = 64;
+	uint64_t allocs[MaxTags];
+	uint64_t bytes[MaxTags];
+	uint64_t frees[MaxTags];
+	uint64_t freedBytes[MaxTags];
+	uint64_t lifetimeTicks[MaxTags];
+	AllocThreadCounters* next;
+};
+
+class AllocTracker {
+public:
+	static const int MaxTags = AllocThreadCounters::MaxTags;
+protected:
+	// Everything here has to be usable from operator new before any dynamic
+	// initializer has run, so only constant initialized state is allowed.
+	static inline std::mutex _tagMutex;
+	static inline const char* _tagNames[MaxTags] = { "untagged" };
+	static inline std::atomic<int> _tagCount { 1 };
+	static inline std::atomic<AllocThreadCounters*> _threads { nullptr };
+	static inline std::atomic<bool> _linked { false };
+	static inline thread_local AllocThreadCounters* _counters = nullptr;
+	static inline thread_local uint16_t _tag = 0;
+	// Frame bookkeeping is only touched from Report/FrameMark.
+	static inline uint64_t _frameAllocs = 0;
+	static inline uint64_t _frameBytes = 0;
+	static inline std::vector<uint64_t> _framesAllocs;
+	static inline std::vector<uint64_t> _framesBytes;
+	static inline uint64_t _originTicks = 0;
+	static inline std::chrono::steady_clock::time_point _originTime;
+
+	static AllocThreadCounters& ThreadCounters() {
+		if (_counters == nullptr) {
+			// calloc rather than new; we are usually inside operator new here.
+			AllocThreadCounters* counters = (AllocThreadCounters*)calloc(1, sizeof(AllocThreadCounters));
+			counters->next = _threads.load(std::memory_order_relaxed);
+			while (!_threads.compare_exchange_weak(counters->next, counters, std::memory_order_release, std::memory_order_relaxed)) {
+			}
+			_counters = counters;
+		}
+		return *_counters;
+	}
+	static uint64_t Total(uint64_t (AllocThreadCounters::*field)[MaxTags], int tag) {
+		uint64_t total = 0;
+		for (AllocThreadCounters* c = _threads.load(std::memory_order_acquire); c != nullptr; c = c->next) {
+			total += (c->*field)[tag];
+		}
+		return total;
+	}
+	static uint64_t TotalAll(uint64_t (AllocThreadCounters::*field)[MaxTags]) {
+		uint64_t total = 0;
+		int tags = _tagCount.load(std::memory_order_acquire);
+		for (int tag = 0; tag < tags; ++tag) {
+			total += Total(field, tag);
+		}
+		return total;
+	}
+public:
+	static void MarkLinked() {
+		_linked.store(true);
+		_originTicks = ReadTimestamp();
+		_originTime = std::chrono::steady_clock::now();
+	}
+	static bool Linked() {
+		return _linked.load();
+	}
+	// Tags are registered once by name; ALLOC_TAG caches the id per site.
+	// Running out of tags folds the remainder into "untagged".
+	static uint16_t RegisterTag(const char* name) {
+		std::lock_guard<std::mutex> lock(_tagMutex);
+		int count = _tagCount.load(std::memory_order_relaxed);
+		for (int i = 0; i < count; ++i) {
+			if (_tagNames[i] == name || strcmp(_tagNames[i], name) == 0) {
+				return (uint16_t)i;
+			}
+		}
+		if (count == MaxTags) {
+			return 0;
+		}
+		_tagNames[count] = name;
+		_tagCount.store(count + 1, std::memory_order_release);
+		return (uint16_t)count;
+	}
+	static uint16_t CurrentTag() {
+		return _tag;
+	}
+	static uint16_t SwapTag(uint16_t tag) {
+		uint16_t previous = _tag;
+		_tag = tag;
+		return previous;
+	}
+	static void RecordAlloc(uint16_t tag, size_t bytes) {
+		AllocThreadCounters& counters = ThreadCounters();
+		++counters.allocs[tag];
+		counters.bytes[tag] += bytes;
+	}
+	static void RecordFree(uint16_t tag, size_t bytes, uint64_t lifetimeTicks) {
+		AllocThreadCounters& counters = ThreadCounters();
+		++counters.frees[tag];
+		counters.freedBytes[tag] += bytes;
+		counters.lifetimeTicks[tag] += lifetimeTicks;
+	}
+	// Call once per frame (or per unit of work) to get allocation rates.
+	static void FrameMark() {
+		uint64_t allocs = TotalAll(&AllocThreadCounters::allocs);
+		uint64_t bytes = TotalAll(&AllocThreadCounters::bytes);
+		_framesAllocs.push_back(allocs - _frameAllocs);
+		_framesBytes.push_back(bytes - _frameBytes);
+		_frameAllocs = allocs;
+		_frameBytes = bytes;
+	}
+	static void Report(std::ostream& os, size_t top = 8) {
+		if (!Linked()) {
+			os << "[Allocation tracking not linked; build geometric-alloc]" << std::endl;
+			return;
+		}
+		struct Row {
+			int tag;
+			uint64_t allocs, bytes, frees, freedBytes, lifetime;
+		};
+		std::vector<Row> rows;
+		int tags = _tagCount.load(std::memory_order_acquire);
+		for (int tag = 0; tag < tags; ++tag) {
+			Row row = { tag,
+				Total(&AllocThreadCounters::allocs, tag),
+				Total(&AllocThreadCounters::bytes, tag),
+				Total(&AllocThreadCounters::frees, tag),
+				Total(&AllocThreadCounters::freedBytes, tag),
+				Total(&AllocThreadCounters::lifetimeTicks, tag) };
+			if (row.allocs > 0) {
+				rows.push_back(row);
+			}
+		}
+		std::sort(rows.begin(), rows.end(), [](const Row& a, const Row& b) {
+			return a.bytes > b.bytes;
+		});
+		double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - _originTime).count();
+		double ticksPerUs = us > 0.0 ? (ReadTimestamp() - _originTicks) / us : 1.0;
+		os << "[Top allocators by bytes]" << std::endl;
+		for (size_t i = 0; i < rows.size() && i < top; ++i) {
+			const Row& row = rows[i];
+			os << "  " << _tagNames[row.tag] << ": allocs=" << row.allocs << " bytes=" << row.bytes;
+			os << " live=" << row.allocs - row.frees << " (" << row.bytes - row.freedBytes << " bytes)";
+			if (row.frees > 0) {
+				os << " avg-lifetime=" << row.lifetime / ticksPerUs / row.frees << "us";
+			}
+			os << std::endl;
+		}
+		if (!_framesAllocs.empty()) {
+			os << "[Allocations per frame]";
+			for (size_t i = 0; i < _framesAllocs.size(); ++i) {
+				os << " " << _framesAllocs[i] << " (" << _framesBytes[i] << " bytes)";
+			}
+			os << std::endl;
+		}
+	}
+};
+
+// Charges allocations on this thread to a tag for the lifetime of the scope.
+class AllocScope {
+protected:
+	uint16_t _previous;
+public:
+	AllocScope(uint16_t tag) : _previous(AllocTracker::SwapTag(tag)) {}
+	~AllocScope() {
+		AllocTracker::SwapTag(_previous);
+	}
+	AllocScope(const AllocScope&) = delete;
+	AllocScope& operator=(const AllocScope&) = delete;
+};
+
+#define ALLOC_TAG(name) \
+	static const uint16_t PROFILE_CONCAT(_allocTagId, __LINE__) = AllocTracker::RegisterTag(name); \
+	AllocScope PROFILE_CONCAT(_allocTag, __LINE__)(PROFILE_CONCAT(_allocTagId, __LINE__))
@@ -0,0 +1,652 @@
+#pragma once
+
+///////////////////////////////////////////////////////////////////////////////
+// Asynchronous File Streams.
+//
+// Every other stream here blocks in a read or write call, so a single thread
+// can never have more than one request outstanding against the device. An
+// NVMe drive needs dozens in flight before it gets anywhere near its
+// bandwidth. AsyncIo is an engine that queues block reads and writes without
+// waiting for them; AsyncStreamOut and AsyncStreamIn sit on top of one and
+// look like any other stream to the serializer.
+//
+// The engine owns a fixed pool of aligned blocks. Streams borrow a block,
+// fill it (or have it filled) and hand it to the engine, which returns it to
+// the pool once the request completes. Any number of streams can share one
+// engine, so one thread can save or load many snapshot shards at once, with
+// every shard's blocks in the same queue. A writer holds one block while it
+// fills it and a reader holds its read ahead, so the pool has to be at least
+// that big across all the streams on it; Acquire throws rather than
+// deadlocking when it isn't.
+//
+// There are two engines behind the same interface:
+//
+//   UringIo  Linux io_uring, driven with raw syscalls. The block pool is
+//            registered with the kernel once, so requests use the fixed
+//            buffer opcodes and skip the per request page pinning. Queued
+//            requests are published in batches of BatchSize, one
+//            io_uring_enter per batch instead of one syscall per block.
+//   PoolIo   The fallback where io_uring is missing or forbidden: the same
+//            batches go to a small pool of threads doing pread and pwrite.
+//
+// CreateAsyncIo picks io_uring when it can. Engines and the streams on them
+// belong to one thread; completions are only ever delivered on that thread,
+// from inside Wait or Acquire.
+///////////////////////////////////////////////////////////////////////////////
+
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "directio.h"
+#include "geometric.h"
+#include "threadpool.h"
+
+class IAsyncOwner;
+
+// One block of the engine's pool. bytes, result and done describe the last
+// request made with it.
+struct AsyncBlock {
+	uint8_t* data;
+	uint32_t index;
+	size_t bytes;
+	// Bytes transferred, or -errno.
+	int64_t result;
+	bool done;
+	IAsyncOwner* owner;
+};
+
+// Told about each of its blocks as the request on it completes.
+class IAsyncOwner {
+public:
+	virtual ~IAsyncOwner() {}
+	virtual void Completed(AsyncBlock* block) = 0;
+};
+
+class AsyncIo {
+public:
+	// Requests queued before the engine submits them on its own.
+	static constexpr uint32_t BatchSize = 8;
+	struct Stats {
+		size_t requests = 0;
+		// io_uring_enter calls, or hand offs to the pool.
+		size_t submissions = 0;
+	};
+protected:
+	size_t _blockSize;
+	std::unique_ptr<uint8_t[], AlignedFree> _memory;
+	std::vector<AsyncBlock> _blocks;
+	std::vector<AsyncBlock*> _free;
+	size_t _inFlight;
+	Stats _stats;
+
+	virtual void Queue(bool write, int fd, AsyncBlock* block, uint64_t offset) = 0;
+	// Delivers whatever has completed; with wait, blocks until something has.
+	virtual void Reap(bool wait) = 0;
+	void Complete(AsyncBlock* block, int64_t result) {
+		block->result = result;
+		block->done = true;
+		--_inFlight;
+		block->owner->Completed(block);
+	}
+	void Start(bool write, int fd, AsyncBlock* block, size_t bytes, uint64_t offset) {
+		block->bytes = bytes;
+		block->result = 0;
+		block->done = false;
+		++_inFlight;
+		++_stats.requests;
+		Queue(write, fd, block, offset);
+	}
+public:
+	// blockSize is rounded up to whole O_DIRECT blocks.
+	AsyncIo(size_t blocks, size_t blockSize) : _blockSize((blockSize + DirectAlignment - 1) / DirectAlignment * DirectAlignment), _blocks(blocks), _inFlight(0) {
+		_memory = AllocateAligned(_blockSize * blocks);
+		for (size_t i = 0; i < blocks; ++i) {
+			_blocks[i] = { _memory.get() + i * _blockSize, (uint32_t)i, 0, 0, true, nullptr };
+			_free.push_back(&_blocks[blocks - 1 - i]);
+		}
+	}
+	AsyncIo(const AsyncIo&) = delete;
+	AsyncIo& operator=(const AsyncIo&) = delete;
+	virtual ~AsyncIo() {}
+	virtual const char* Backend() const = 0;
+	// Hands every queued request to the kernel or the pool.
+	virtual void Submit() = 0;
+	size_t BlockSize() const {
+		return _blockSize;
+	}
+	bool HasFree() const {
+		return !_free.empty();
+	}
+	// A free block, waiting for requests to complete if there are none.
+	AsyncBlock* Acquire(IAsyncOwner* owner) {
+		while (_free.empty()) {
+			if (_inFlight == 0) {
+				throw StreamException("Every async block is held");
+			}
+			Wait();
+		}
+		AsyncBlock* block = _free.back();
+		_free.pop_back();
+		block->owner = owner;
+		return block;
+	}
+	void Release(AsyncBlock* block) {
+		block->owner = nullptr;
+		_free.push_back(block);
+	}
+	void Write(int fd, AsyncBlock* block, size_t bytes, uint64_t offset) {
+		Start(true, fd, block, bytes, offset);
+	}
+	void Read(int fd, AsyncBlock* block, size_t bytes, uint64_t offset) {
+		Start(false, fd, block, bytes, offset);
+	}
+	// Submits, then delivers at least one completion if anything is in
+	// flight.
+	void Wait() {
+		Submit();
+		if (_inFlight > 0) {
+			Reap(true);
+		}
+	}
+	void Drain() {
+		while (_inFlight > 0) {
+			Wait();
+		}
+	}
+	Stats GetStats() const {
+		return _stats;
+	}
+};
+
+class UringIo : public AsyncIo {
+protected:
+	int _ring;
+	io_uring_params _params;
+	void* _sqMap;
+	size_t _sqMapSize;
+	void* _cqMap;
+	size_t _cqMapSize;
+	io_uring_sqe* _sqes;
+	uint32_t* _sqHead;
+	uint32_t* _sqTail;
+	uint32_t* _sqArray;
+	uint32_t _sqMask;
+	uint32_t* _cqHead;
+	uint32_t* _cqTail;
+	io_uring_cqe* _cqes;
+	uint32_t _cqMask;
+	// Entries written but not yet published to the kernel, and published
+	// but not yet consumed by an io_uring_enter.
+	uint32_t _localTail;
+	uint32_t _unsubmitted;
+	bool _fixed;
+
+	int Enter(uint32_t submit, uint32_t complete, uint32_t flags) {
+		return (int)syscall(__NR_io_uring_enter, _ring, submit, complete, flags, nullptr, 0);
+	}
+	void Unmap() {
+		if (_sqes != nullptr) {
+			munmap(_sqes, _params.sq_entries * sizeof(io_uring_sqe));
+		}
+		if (_cqMap != nullptr && _cqMap != _sqMap) {
+			munmap(_cqMap, _cqMapSize);
+		}
+		if (_sqMap != nullptr) {
+			munmap(_sqMap, _sqMapSize);
+		}
+		close(_ring);
+	}
+	// Publishes queued entries and has the kernel consume them, optionally
+	// waiting for a completion in the same call.
+	void EnterRing(uint32_t complete) {
+		__atomic_store_n(_sqTail, _localTail, __ATOMIC_RELEASE);
+		for (;;) {
+			int consumed = Enter(_unsubmitted, complete, complete > 0 ? IORING_ENTER_GETEVENTS : 0);
+			if (consumed >= 0) {
+				_unsubmitted -= (uint32_t)consumed;
+				++_stats.submissions;
+				return;
+			}
+			if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+				throw StreamException("io_uring_enter failed");
+			}
+		}
+	}
+	virtual void Queue(bool write, int fd, AsyncBlock* block, uint64_t offset) override {
+		if (_localTail - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE) == _params.sq_entries) {
+			Submit();
+		}
+		uint32_t slot = _localTail & _sqMask;
+		io_uring_sqe* sqe = &_sqes[slot];
+		memset(sqe, 0, sizeof(*sqe));
+		if (_fixed) {
+			sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+			sqe->buf_index = (uint16_t)block->index;
+		} else {
+			sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+		}
+		sqe->fd = fd;
+		sqe->addr = (uint64_t)(uintptr_t)block->data;
+		sqe->len = (uint32_t)block->bytes;
+		sqe->off = offset;
+		sqe->user_data = (uint64_t)(uintptr_t)block;
+		_sqArray[slot] = slot;
+		++_localTail;
+		if (++_unsubmitted >= BatchSize) {
+			Submit();
+		}
+	}
+	virtual void Reap(bool wait) override {
+		for (;;) {
+			uint32_t head = *_cqHead;
+			uint32_t tail = __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE);
+			if (head != tail) {
+				for (; head != tail; ++head) {
+					const io_uring_cqe& cqe = _cqes[head & _cqMask];
+					Complete((AsyncBlock*)(uintptr_t)cqe.user_data, cqe.res);
+				}
+				__atomic_store_n(_cqHead, head, __ATOMIC_RELEASE);
+				return;
+			}
+			if (!wait) {
+				return;
+			}
+			EnterRing(1);
+		}
+	}
+public:
+	// Throws StreamException if io_uring can't be set up here.
+	UringIo(size_t blocks = 32, size_t blockSize = 256 << 10) : AsyncIo(blocks, blockSize), _sqMap(nullptr), _cqMap(nullptr), _sqes(nullptr), _localTail(0), _unsubmitted(0), _fixed(false) {
+		memset(&_params, 0, sizeof(_params));
+		_ring = (int)syscall(__NR_io_uring_setup, (uint32_t)blocks, &_params);
+		if (_ring < 0) {
+			throw StreamException("io_uring unavailable");
+		}
+		_sqMapSize = _params.sq_off.array + _params.sq_entries * sizeof(uint32_t);
+		_cqMapSize = _params.cq_off.cqes + _params.cq_entries * sizeof(io_uring_cqe);
+		bool single = (_params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+		if (single) {
+			_sqMapSize = _cqMapSize = std::max(_sqMapSize, _cqMapSize);
+		}
+		_sqMap = mmap(nullptr, _sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring, IORING_OFF_SQ_RING);
+		if (_sqMap == MAP_FAILED) {
+			_sqMap = nullptr;
+			Unmap();
+			throw StreamException("Cannot map io_uring");
+		}
+		_cqMap = single ? _sqMap : mmap(nullptr, _cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring, IORING_OFF_CQ_RING);
+		void* sqes = mmap(nullptr, _params.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring, IORING_OFF_SQES);
+		if (_cqMap == MAP_FAILED || sqes == MAP_FAILED) {
+			_cqMap = _cqMap == MAP_FAILED ? nullptr : _cqMap;
+			_sqes = sqes == MAP_FAILED ? nullptr : (io_uring_sqe*)sqes;
+			Unmap();
+			throw StreamException("Cannot map io_uring");
+		}
+		_sqes = (io_uring_sqe*)sqes;
+		uint8_t* sq = (uint8_t*)_sqMap;
+		_sqHead = (uint32_t*)(sq + _params.sq_off.head);
+		_sqTail = (uint32_t*)(sq + _params.sq_off.tail);
+		_sqArray = (uint32_t*)(sq + _params.sq_off.array);
+		_sqMask = *(uint32_t*)(sq + _params.sq_off.ring_mask);
+		uint8_t* cq = (uint8_t*)_cqMap;
+		_cqHead = (uint32_t*)(cq + _params.cq_off.head);
+		_cqTail = (uint32_t*)(cq + _params.cq_off.tail);
+		_cqes = (io_uring_cqe*)(cq + _params.cq_off.cqes);
+		_cqMask = *(uint32_t*)(cq + _params.cq_off.ring_mask);
+		_localTail = *_sqTail;
+		// Registration pins the pool, which a low RLIMIT_MEMLOCK may refuse;
+		// the plain opcodes work without it.
+		std::vector<iovec> buffers(_blocks.size());
+		for (size_t i = 0; i < _blocks.size(); ++i) {
+			buffers[i] = { _blocks[i].data, _blockSize };
+		}
+		_fixed = syscall(__NR_io_uring_register, _ring, IORING_REGISTER_BUFFERS, buffers.data(), (uint32_t)buffers.size()) == 0;
+	}
+	virtual ~UringIo() {
+		try {
+			Drain();
+		} catch (...) {
+		}
+		Unmap();
+	}
+	virtual const char* Backend() const override {
+		return _fixed ? "io_uring, registered buffers" : "io_uring";
+	}
+	virtual void Submit() override {
+		if (_unsubmitted > 0) {
+			EnterRing(0);
+		}
+	}
+};
+
+class PoolIo : public AsyncIo {
+protected:
+	struct Request {
+		bool write;
+		int fd;
+		AsyncBlock* block;
+		uint64_t offset;
+	};
+	std::vector<Request> _queued;
+	std::mutex _mutex;
+	std::condition_variable _wake;
+	std::vector<std::pair<AsyncBlock*, int64_t>> _completed;
+	// Last, so its threads are joined before anything they touch goes.
+	ThreadPool _pool;
+
+	// Runs on a pool thread.
+	static int64_t Transfer(const Request& request) {
+		size_t done = 0;
+		while (done < request.block->bytes) {
+			ssize_t moved = request.write
+				? pwrite(request.fd, request.block->data + done, request.block->bytes - done, (off_t)(request.offset + done))
+				: pread(request.fd, request.block->data + done, request.block->bytes - done, (off_t)(request.offset + done));
+			if (moved < 0 && errno == EINTR) {
+				continue;
+			}
+			if (moved < 0) {
+				return -errno;
+			}
+			if (moved == 0) {
+				break;
+			}
+			done += (size_t)moved;
+		}
+		return (int64_t)done;
+	}
+	virtual void Queue(bool write, int fd, AsyncBlock* block, uint64_t offset) override {
+		_queued.push_back({ write, fd, block, offset });
+		if (_queued.size() >= BatchSize) {
+			Submit();
+		}
+	}
+	virtual void Reap(bool wait) override {
+		std::vector<std::pair<AsyncBlock*, int64_t>> completed;
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			if (wait) {
+				_wake.wait(lock, [this]() { return !_completed.empty(); });
+			}
+			completed.swap(_completed);
+		}
+		for (auto& c : completed) {
+			Complete(c.first, c.second);
+		}
+	}
+public:
+	// Threads default to the batch size, which is as many requests as one
+	// submission hands over.
+	PoolIo(size_t blocks = 32, size_t blockSize = 256 << 10, unsigned threads = BatchSize) : AsyncIo(blocks, blockSize), _pool(threads) {}
+	virtual ~PoolIo() {
+		try {
+			Drain();
+		} catch (...) {
+		}
+	}
+	virtual const char* Backend() const override {
+		return "thread pool";
+	}
+	virtual void Submit() override {
+		if (_queued.empty()) {
+			return;
+		}
+		for (const Request& request : _queued) {
+			_pool.Submit([this, request]() {
+				int64_t result = Transfer(request);
+				std::lock_guard<std::mutex> lock(_mutex);
+				_completed.emplace_back(request.block, result);
+				_wake.notify_one();
+			});
+		}
+		_queued.clear();
+		++_stats.submissions;
+	}
+};
+
+inline std::unique_ptr<AsyncIo> CreateAsyncIo(size_t blocks = 32, size_t blockSize = 256 << 10) {
+	try {
+		return std::make_unique<UringIo>(blocks, blockSize);
+	} catch (const StreamException&) {
+		return std::make_unique<PoolIo>(blocks, blockSize);
+	}
+}
+
+// Writes whole blocks through an engine as they fill. Like DirectStreamOut,
+// an O_DIRECT file has its tail padded to a block and truncated back.
+class AsyncStreamOut : public IStreamOut, public IAsyncOwner {
+protected:
+	std::unique_ptr<AsyncIo> _owned;
+	AsyncIo& _io;
+	int _fd;
+	bool _direct;
+	bool _finished;
+	AsyncBlock* _block;
+	size_t _fill;
+	uint64_t _offset;
+	size_t _inFlight;
+	const char* _error;
+
+	void Open(const char* path, bool direct) {
+		int flags = O_WRONLY | O_CREAT | O_TRUNC;
+		_fd = direct ? OpenDirect(path, flags, _direct) : open(path, flags, 0644);
+		if (_fd < 0) {
+			throw StreamException("Cannot open file for writing");
+		}
+	}
+	void Issue(size_t bytes) {
+		_io.Write(_fd, _block, bytes, _offset);
+		++_inFlight;
+		_offset += _fill;
+		_block = nullptr;
+		_fill = 0;
+	}
+public:
+	AsyncStreamOut(AsyncIo& io, const char* path, bool direct = true) : _io(io), _direct(false), _finished(false), _block(nullptr), _fill(0), _offset(0), _inFlight(0), _error(nullptr) {
+		Open(path, direct);
+	}
+	// With an engine of its own.
+	AsyncStreamOut(const char* path, bool direct = true) : _owned(CreateAsyncIo()), _io(*_owned), _direct(false), _finished(false), _block(nullptr), _fill(0), _offset(0), _inFlight(0), _error(nullptr) {
+		Open(path, direct);
+	}
+	AsyncStreamOut(const AsyncStreamOut&) = delete;
+	AsyncStreamOut& operator=(const AsyncStreamOut&) = delete;
+	// Finish to find out whether the writes succeeded; this can't say.
+	virtual ~AsyncStreamOut() {
+		try {
+			Finish();
+		} catch (...) {
+		}
+		// Blocks still in flight would complete into a dead owner.
+		while (_inFlight > 0) {
+			try {
+				_io.Wait();
+			} catch (...) {
+				break;
+			}
+		}
+		close(_fd);
+	}
+	virtual void WriteBytes(const void* buffer, int count) override {
+		if (_finished) {
+			throw StreamException("Write after finish");
+		}
+		const uint8_t* source = (const uint8_t*)buffer;
+		size_t remaining = count < 0 ? 0 : (size_t)count;
+		while (remaining > 0) {
+			if (_block == nullptr) {
+				_block = _io.Acquire(this);
+			}
+			size_t chunk = std::min(remaining, _io.BlockSize() - _fill);
+			memcpy(_block->data + _fill, source, chunk);
+			_fill += chunk;
+			source += chunk;
+			remaining -= chunk;
+			if (_fill == _io.BlockSize()) {
+				Issue(_fill);
+			}
+		}
+	}
+	virtual void Completed(AsyncBlock* block) override {
+		if (block->result != (int64_t)block->bytes && _error == nullptr) {
+			_error = block->result < 0 ? "Async write failed" : "Short async write";
+		}
+		--_inFlight;
+		_io.Release(block);
+	}
+	// Writes the tail and waits for every block of this stream. Throws if
+	// any of them failed.
+	void Finish() {
+		if (_finished) {
+			return;
+		}
+		_finished = true;
+		uint64_t size = _offset + _fill;
+		if (_fill > 0) {
+			size_t bytes = _fill;
+			if (_direct) {
+				bytes = (_fill + DirectAlignment - 1) / DirectAlignment * DirectAlignment;
+				memset(_block->data + _fill, 0, bytes - _fill);
+			}
+			Issue(bytes);
+		} else if (_block != nullptr) {
+			_io.Release(_block);
+			_block = nullptr;
+		}
+		while (_inFlight > 0) {
+			_io.Wait();
+		}
+		if (_direct && ftruncate(_fd, (off_t)size) != 0) {
+			throw StreamException("Cannot truncate file");
+		}
+		if (_error != nullptr) {
+			throw StreamException(_error);
+		}
+	}
+	uint64_t Size() const {
+		return _offset + _fill;
+	}
+	bool Direct() const {
+		return _direct;
+	}
+};
+
+// Keeps up to readAhead blocks of the file requested ahead of the reader.
+// Only the block being read from is waited for; further read ahead is
+// skipped while the engine has no free blocks.
+class AsyncStreamIn : public IStreamIn, public IAsyncOwner {
+protected:
+	std::unique_ptr<AsyncIo> _owned;
+	AsyncIo& _io;
+	int _fd;
+	bool _direct;
+	uint64_t _size;
+	size_t _readAhead;
+	// Requested blocks in file order; the front is being read from.
+	std::deque<AsyncBlock*> _queue;
+	size_t _position;
+	uint64_t _next;
+	uint64_t _consumed;
+
+	void Open(const char* path, bool direct) {
+		_fd = direct ? OpenDirect(path, O_RDONLY, _direct) : open(path, O_RDONLY);
+		if (_fd < 0) {
+			throw StreamException("Cannot open file for reading");
+		}
+		struct stat info;
+		if (fstat(_fd, &info) != 0) {
+			close(_fd);
+			throw StreamException("Cannot stat file");
+		}
+		_size = (uint64_t)info.st_size;
+		Fill();
+	}
+	void Fill() {
+		while (_queue.size() < _readAhead && _next < _size && (_queue.empty() || _io.HasFree())) {
+			AsyncBlock* block = _io.Acquire(this);
+			_io.Read(_fd, block, _io.BlockSize(), _next);
+			_queue.push_back(block);
+			_next += _io.BlockSize();
+		}
+		_io.Submit();
+	}
+public:
+	AsyncStreamIn(AsyncIo& io, const char* path, size_t readAhead = 4, bool direct = true) : _io(io), _direct(false), _readAhead(std::max<size_t>(1, readAhead)), _position(0), _next(0), _consumed(0) {
+		Open(path, direct);
+	}
+	AsyncStreamIn(const char* path, size_t readAhead = 4, bool direct = true) : _owned(CreateAsyncIo()), _io(*_owned), _direct(false), _readAhead(std::max<size_t>(1, readAhead)), _position(0), _next(0), _consumed(0) {
+		Open(path, direct);
+	}
+	AsyncStreamIn(const AsyncStreamIn&) = delete;
+	AsyncStreamIn& operator=(const AsyncStreamIn&) = delete;
+	virtual ~AsyncStreamIn() {
+		for (AsyncBlock* block : _queue) {
+			while (!block->done) {
+				try {
+					_io.Wait();
+				} catch (...) {
+					break;
+				}
+			}
+			_io.Release(block);
+		}
+		close(_fd);
+	}
+	virtual void ReadBytes(void* buffer, int count) override {
+		uint8_t* target = (uint8_t*)buffer;
+		size_t remaining = count < 0 ? 0 : (size_t)count;
+		while (remaining > 0) {
+			if (_queue.empty()) {
+				throw StreamException("Short read from file");
+			}
+			AsyncBlock* block = _queue.front();
+			while (!block->done) {
+				_io.Wait();
+			}
+			if (block->result < 0) {
+				throw StreamException("Async read failed");
+			}
+			// Only the block holding the end of the file may come back short.
+			uint64_t expected = std::min<uint64_t>(_io.BlockSize(), _size - (_consumed - _position));
+			if ((uint64_t)block->result < expected) {
+				throw StreamException("Short async read");
+			}
+			size_t chunk = std::min(remaining, (size_t)expected - _position);
+			memcpy(target, block->data + _position, chunk);
+			_position += chunk;
+			_consumed += chunk;
+			target += chunk;
+			remaining -= chunk;
+			if (_position == expected) {
+				_queue.pop_front();
+				_io.Release(block);
+				_position = 0;
+				Fill();
+			}
+		}
+	}
+	virtual void Completed(AsyncBlock*) override {
+	}
+	uint64_t Size() const {
+		return _size;
+	}
+	bool AtEnd() const {
+		return _consumed >= _size;
+	}
+	bool Direct() const {
+		return _direct;
+	}
+};
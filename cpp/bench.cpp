@@ -0,0 +1,350 @@
+#include "bench.h"
+#include "binnedraster.h"
+#include "deferred.h"
+#include "geometric.h"
+#include "msaa.h"
+#include "spatialsort.h"
+#include "texture.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Benchmark Cases.
+//
+// Each case is one iteration of work; the runner decides how many iterations
+// make up a sample.
+///////////////////////////////////////////////////////////////////////////////
+
+// Discards everything; isolates the cost of the serializer from the sink.
+class NullStream : public IStreamOut {
+public:
+	virtual void WriteBytes(const void* buffer, int) override {
+		DoNotOptimize(buffer);
+	}
+};
+
+static SharedWorld CreateLargeWorld(ISceneFactory& factory, int count) {
+	SharedWorld world = std::make_shared<World>();
+	for (int i = 0; i < count; ++i) {
+		if (i % 2 == 0) {
+			world->push_back(factory.CreateBox(1.0f, 2.0f, 3.0f));
+		} else {
+			world->push_back(factory.CreateSphere(1.0f));
+		}
+	}
+	return world;
+}
+
+static SharedWorld& LargeGeomWorld() {
+	static GeomFactory factory;
+	static SharedWorld world = CreateLargeWorld(factory, 10000);
+	return world;
+}
+
+BENCHMARK(MemoryStreamWrite) {
+	MemoryStream stream;
+	uint8_t record[16] = {};
+	for (int i = 0; i < 4096; ++i) {
+		stream.WriteBytes(record, sizeof(record));
+	}
+	DoNotOptimize(stream.size());
+}
+
+BENCHMARK(CreateWorldGeom) {
+	GeomFactory factory;
+	SharedWorld world = CreateWorld(factory);
+	DoNotOptimize(world);
+}
+
+BENCHMARK(CreateWorldMesh) {
+	MeshFactory factory;
+	SharedWorld world = CreateWorld(factory);
+	DoNotOptimize(world);
+}
+
+BENCHMARK(VisitObjects10k) {
+	int count = 0;
+	VisitObjects(LargeGeomWorld(), [&count](IObject&) {
+		++count;
+	});
+	DoNotOptimize(count);
+}
+
+BENCHMARK(SaveEverythingNull10k) {
+	NullStream stream;
+	SaveEverything(LargeGeomWorld(), stream);
+}
+
+BENCHMARK(SaveEverythingMemory10k) {
+	MemoryStream stream;
+	SaveEverything(LargeGeomWorld(), stream);
+	DoNotOptimize(stream.size());
+}
+
+// A world built in random spatial order, then sorted along the Hilbert
+// curve. Sorting alone leaves the objects where the allocator put them;
+// relocating also puts them in curve order on the heap.
+static SharedWorld CreateSortedWorld(bool relocate) {
+	SharedWorld world = std::make_shared<World>();
+	uint32_t seed = 1;
+	auto next = [&seed]() {
+		seed = seed * 1664525u + 1013904223u;
+		return (float)(seed >> 8) / (1 << 24) * 1000.0f;
+	};
+	for (int i = 0; i < 100000; ++i) {
+		world->push_back(SharedGeomFactory().CreateSphere(1.0f, Vec3(next(), next(), next())));
+	}
+	WorldOrder order;
+	order.Reorder(world);
+	if (relocate) {
+		order.Relocate(world);
+	}
+	return world;
+}
+
+static float SumBoundsX(SharedWorld& world) {
+	float sum = 0.0f;
+	VisitObjects(world, [&sum](IObject& obj) {
+		sum += static_cast<Sphere&>(obj).GetBounds().min.x;
+	});
+	return sum;
+}
+
+BENCHMARK(VisitSortedScattered100k) {
+	static SharedWorld world = CreateSortedWorld(false);
+	DoNotOptimize(SumBoundsX(world));
+}
+
+BENCHMARK(VisitSortedRelocated100k) {
+	static SharedWorld world = CreateSortedWorld(true);
+	DoNotOptimize(SumBoundsX(world));
+}
+
+static float SumBoundsXBatched(SharedWorld& world, size_t prefetchDistance) {
+	float sum = 0.0f;
+	VisitBatchOptions options;
+	options.prefetchDistance = prefetchDistance;
+	VisitObjectBatches(world, [&sum](IObject* const* objects, size_t count) {
+		for (size_t i = 0; i < count; ++i) {
+			sum += static_cast<Sphere*>(objects[i])->GetBounds().min.x;
+		}
+	}, options);
+	return sum;
+}
+
+BENCHMARK(VisitBatchedNoPrefetchScattered100k) {
+	static SharedWorld world = CreateSortedWorld(false);
+	DoNotOptimize(SumBoundsXBatched(world, 0));
+}
+
+BENCHMARK(VisitBatchedPrefetch8Scattered100k) {
+	static SharedWorld world = CreateSortedWorld(false);
+	DoNotOptimize(SumBoundsXBatched(world, 8));
+}
+
+BENCHMARK(VisitBatchedPrefetch32Scattered100k) {
+	static SharedWorld world = CreateSortedWorld(false);
+	DoNotOptimize(SumBoundsXBatched(world, 32));
+}
+
+// 64k UVs sweeping a 1024 texture diagonally, as a textured span would.
+struct TextureBenchData {
+	Texture texture = Texture::Checker(1024, 16, Vec3(1, 1, 1), Vec3(0, 0, 0));
+	std::vector<float> u, v, rgba;
+	TextureBenchData() : u(65536), v(65536), rgba(65536 * 4) {
+		for (size_t i = 0; i < u.size(); ++i) {
+			u[i] = (i % 256) / 256.0f + (i / 256) * 0.37f;
+			v[i] = (i / 256) / 256.0f;
+		}
+	}
+};
+
+static TextureBenchData& TextureData() {
+	static TextureBenchData data;
+	return data;
+}
+
+BENCHMARK(TextureBilinear64k) {
+	TextureBenchData& data = TextureData();
+	data.texture.SampleBatch(data.u.data(), data.v.data(), data.u.size(), 0.0f, data.rgba.data());
+	DoNotOptimize(data.rgba.data());
+}
+
+BENCHMARK(TextureTrilinear64k) {
+	TextureBenchData& data = TextureData();
+	data.texture.SampleBatch(data.u.data(), data.v.data(), data.u.size(), 2.5f, data.rgba.data());
+	DoNotOptimize(data.rgba.data());
+}
+
+// A finely tessellated sphere filling part of the screen: half a million
+// triangles, most smaller than a pixel, so setup dominates fill.
+struct RasterBenchData {
+	TriangleMesh mesh;
+	StandardVertexShader vertex;
+	LambertShader fragment;
+	Framebuffer target = Framebuffer(640, 400);
+	BinnedRasterizer<StandardVertexShader::Varyings> rasterizer;
+	RasterBenchData() {
+		TessellateParametric(mesh, 512, 512, [](float s, float t, Vec3& p, Vec3& n) {
+			float au = 6.28318531f * s, av = 3.14159265f * t;
+			n = Vec3(sinf(av) * cosf(au), cosf(av), sinf(av) * sinf(au));
+			p = n * 1.5f;
+		});
+		vertex.viewProjection = MatLookAt(Vec3(0, 2, -6), Vec3(), Vec3(0, 1, 0)) * MatProjection(60.0f, 1.6f, 0.1f, 100.0f);
+	}
+};
+
+static RasterBenchData& RasterData() {
+	static RasterBenchData data;
+	return data;
+}
+
+BENCHMARK(RasterDenseDirect) {
+	RasterBenchData& data = RasterData();
+	data.target.Clear(Vec3());
+	DoNotOptimize(DrawMesh(data.target, data.mesh, data.vertex, data.fragment).fragments);
+}
+
+BENCHMARK(RasterDenseBinned) {
+	RasterBenchData& data = RasterData();
+	data.target.Clear(Vec3());
+	DoNotOptimize(data.rasterizer.Draw(data.target, data.mesh, data.vertex, data.fragment).fragments);
+}
+
+// Eight textured spheres in a row down the view axis, drawn far to near so
+// every layer passes the depth test: forward shades each pixel once per
+// layer, deferred once.
+struct OverdrawBenchData {
+	TriangleMesh mesh;
+	StandardVertexShader vertex;
+	Texture texture = Texture::Checker(256, 8, Vec3(0.9f, 0.9f, 0.9f), Vec3(0.2f, 0.2f, 0.25f));
+	Framebuffer target = Framebuffer(640, 400);
+	GBuffer gbuffer = GBuffer(640, 400);
+	BinnedRasterizer<StandardVertexShader::Varyings> rasterizer;
+	OverdrawBenchData() {
+		for (int layer = 0; layer < 8; ++layer) {
+			Vec3 center(0.15f * (layer % 3) - 0.15f, 0.0f, 4.0f - layer);
+			TessellateParametric(mesh, 64, 64, [&](float s, float t, Vec3& p, Vec3& n) {
+				float au = 6.28318531f * s, av = 3.14159265f * t;
+				n = Vec3(sinf(av) * cosf(au), cosf(av), sinf(av) * sinf(au));
+				p = center + n * 1.2f;
+			});
+		}
+		vertex.viewProjection = MatLookAt(Vec3(0, 0, -6), Vec3(), Vec3(0, 1, 0)) * MatProjection(60.0f, 1.6f, 0.1f, 100.0f);
+	}
+	TextureShader Textured() const {
+		TextureShader fragment;
+		fragment.texture = &texture;
+		return fragment;
+	}
+};
+
+static OverdrawBenchData& OverdrawData() {
+	static OverdrawBenchData data;
+	return data;
+}
+
+BENCHMARK(RasterOverdrawForward) {
+	OverdrawBenchData& data = OverdrawData();
+	data.target.Clear(Vec3());
+	DoNotOptimize(data.rasterizer.Draw(data.target, data.mesh, data.vertex, data.Textured()).fragments);
+}
+
+BENCHMARK(RasterOverdrawDeferred) {
+	OverdrawBenchData& data = OverdrawData();
+	DeferredShader shader;
+	DeferredMaterial material;
+	material.albedo = Vec3(1.0f, 1.0f, 1.0f);
+	material.texture = &data.texture;
+	shader.materials.push_back(material);
+	data.gbuffer.Clear();
+	DoNotOptimize(data.rasterizer.Draw(data.gbuffer, data.mesh, data.vertex, GBufferShader()).fragments);
+	shader.Shade(data.gbuffer, data.target.color);
+}
+
+// The overdraw spheres forward shaded again, anti-aliased by MSAA and by
+// drawing at twice the width and height and averaging down.
+BENCHMARK(RasterSupersample4x) {
+	static Framebuffer target(1280, 800);
+	static Image resolved(640, 400);
+	OverdrawBenchData& data = OverdrawData();
+	target.Clear(Vec3());
+	DoNotOptimize(data.rasterizer.Draw(target, data.mesh, data.vertex, data.Textured()).fragments);
+	for (int y = 0; y < resolved.height; ++y) {
+		for (int x = 0; x < resolved.width; ++x) {
+			const float* a = target.color.Pixel(2 * x, 2 * y);
+			const float* b = target.color.Pixel(2 * x, 2 * y + 1);
+			float* out = resolved.Pixel(x, y);
+			for (int c = 0; c < 3; ++c) {
+				out[c] = 0.25f * (a[c] + a[c + 3] + b[c] + b[c + 3]);
+			}
+		}
+	}
+}
+
+BENCHMARK(RasterMsaa4x) {
+	static MsaaFramebuffer<4> target(640, 400);
+	OverdrawBenchData& data = OverdrawData();
+	target.Clear(Vec3());
+	DoNotOptimize(data.rasterizer.Draw(target, data.mesh, data.vertex, data.Textured()).fragments);
+	target.Resolve(data.target.color);
+}
+
+BENCHMARK(RasterMsaa8x) {
+	static MsaaFramebuffer<8> target(640, 400);
+	OverdrawBenchData& data = OverdrawData();
+	target.Clear(Vec3());
+	DoNotOptimize(data.rasterizer.Draw(target, data.mesh, data.vertex, data.Textured()).fragments);
+	target.Resolve(data.target.color);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Entrypoint.
+//
+// bench [--filter <substring>] [--out <results.json>] [--baseline <file>]
+//       [--confidence <fraction>] [--max-seconds <seconds>]
+///////////////////////////////////////////////////////////////////////////////
+
+#include <iostream>
+
+int main(int argc, const char** argv) {
+	BenchmarkOptions options;
+	const char* filter = nullptr;
+	const char* outPath = nullptr;
+	const char* baselinePath = nullptr;
+	for (int i = 1; i + 1 < argc; i += 2) {
+		if (strcmp(argv[i], "--filter") == 0) {
+			filter = argv[i + 1];
+		} else if (strcmp(argv[i], "--out") == 0) {
+			outPath = argv[i + 1];
+		} else if (strcmp(argv[i], "--baseline") == 0) {
+			baselinePath = argv[i + 1];
+		} else if (strcmp(argv[i], "--confidence") == 0) {
+			options.confidence = atof(argv[i + 1]);
+		} else if (strcmp(argv[i], "--max-seconds") == 0) {
+			options.maxSeconds = atof(argv[i + 1]);
+		}
+	}
+	NullBuffer null;
+	std::streambuf* console = std::cout.rdbuf(&null);
+	std::ostream log(console);
+	std::vector<BenchmarkResult> results = Benchmarks::Instance().RunAll(options, filter, log);
+	std::cout.rdbuf(console);
+	if (outPath != nullptr) {
+		std::ofstream out(outPath);
+		WriteBenchmarkJson(out, results);
+		std::cout << "Results written to " << outPath << std::endl;
+	}
+	if (baselinePath != nullptr) {
+		std::ifstream in(baselinePath);
+		if (!in) {
+			std::cout << "Cannot open baseline " << baselinePath << std::endl;
+			return 1;
+		}
+		try {
+			CompareBenchmarks(std::cout, results, ReadBenchmarkJson(in));
+		} catch (const std::runtime_error& e) {
+			std::cout << e.what() << std::endl;
+			return 1;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,303 @@
+#pragma once
+
+///////////////////////////////////////////////////////////////////////////////
+// Benchmark Runner.
+//
+// Cases register themselves with BENCHMARK(name). Each case is warmed up,
+// calibrated so that one sample takes a measurable amount of time, and then
+// sampled until the distribution-free confidence interval of the median is
+// tight enough (or we run out of patience). We record median and MAD rather
+// than mean and standard deviation because timing noise is one-sided and
+// heavy tailed.
+//
+// Results are written as JSON including the raw samples so that a later run
+// can be compared against them with a Mann-Whitney U test.
+///////////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+// Swallows whatever is written to it. The world functions narrate to
+// std::cout, so the runners point it here to keep that out of the timings.
+class NullBuffer : public std::streambuf {
+protected:
+	virtual int overflow(int c) override {
+		return c;
+	}
+};
+
+// Keep the optimizer from discarding work whose result is otherwise unused.
+template <class T> inline void DoNotOptimize(const T& value) {
+#if defined(__GNUC__) || defined(__clang__)
+	asm volatile("" : : "r,m"(value) : "memory");
+#else
+	static volatile const void* sink;
+	sink = &value;
+#endif
+}
+
+struct BenchmarkCase {
+	std::string name;
+	std::function<void()> fn;
+};
+
+struct BenchmarkResult {
+	std::string name;
+	uint64_t iterations = 0;
+	double median = 0.0;
+	double mad = 0.0;
+	double relativeError = 0.0;
+	std::vector<double> samples;
+};
+
+struct BenchmarkOptions {
+	double warmupSeconds = 0.05;
+	double sampleSeconds = 0.002;
+	double maxSeconds = 2.0;
+	// Stop once the 95% interval of the median is within this fraction.
+	double confidence = 0.01;
+	size_t minSamples = 10;
+	size_t maxSamples = 1000;
+};
+
+class Benchmarks {
+protected:
+	std::vector<BenchmarkCase> _cases;
+	using Clock = std::chrono::steady_clock;
+
+	static double Median(std::vector<double> values) {
+		if (values.empty()) {
+			return 0.0;
+		}
+		std::sort(values.begin(), values.end());
+		size_t n = values.size();
+		return n % 2 == 1 ? values[n / 2] : 0.5 * (values[n / 2 - 1] + values[n / 2]);
+	}
+	// Half-width of the 95% interval of the median from order statistics,
+	// relative to the median itself.
+	static double MedianRelativeError(std::vector<double> values) {
+		std::sort(values.begin(), values.end());
+		double n = (double)values.size();
+		double spread = 1.96 * std::sqrt(n) / 2.0;
+		size_t lo = (size_t)std::max(0.0, std::floor(n / 2.0 - spread));
+		size_t hi = (size_t)std::min(n - 1.0, std::ceil(n / 2.0 + spread));
+		double median = Median(values);
+		return median > 0.0 ? 0.5 * (values[hi] - values[lo]) / median : 0.0;
+	}
+	// Time one sample of the given number of iterations, in nanoseconds per
+	// iteration.
+	static double Sample(const BenchmarkCase& c, uint64_t iterations) {
+		auto begin = Clock::now();
+		for (uint64_t i = 0; i < iterations; ++i) {
+			c.fn();
+		}
+		auto end = Clock::now();
+		return std::chrono::duration<double, std::nano>(end - begin).count() / iterations;
+	}
+public:
+	static Benchmarks& Instance() {
+		static Benchmarks benchmarks;
+		return benchmarks;
+	}
+	void Register(const char* name, std::function<void()> fn) {
+		_cases.push_back({ name, std::move(fn) });
+	}
+	BenchmarkResult Run(const BenchmarkCase& c, const BenchmarkOptions& options) {
+		BenchmarkResult result;
+		result.name = c.name;
+		// Warm up caches, branch predictors and the allocator, and find out
+		// how many iterations make up one sample.
+		uint64_t iterations = 1;
+		auto warmupEnd = Clock::now() + std::chrono::duration<double>(options.warmupSeconds);
+		do {
+			double ns = Sample(c, iterations);
+			if (ns * iterations < options.sampleSeconds * 1e9) {
+				iterations = std::max<uint64_t>(iterations + 1, (uint64_t)(options.sampleSeconds * 1e9 / std::max(ns, 1.0)));
+			}
+		} while (Clock::now() < warmupEnd);
+		result.iterations = iterations;
+		auto deadline = Clock::now() + std::chrono::duration<double>(options.maxSeconds);
+		while (result.samples.size() < options.maxSamples) {
+			result.samples.push_back(Sample(c, iterations));
+			if (result.samples.size() < options.minSamples) {
+				continue;
+			}
+			result.relativeError = MedianRelativeError(result.samples);
+			if (result.relativeError <= options.confidence || Clock::now() > deadline) {
+				break;
+			}
+		}
+		Summarize(result);
+		return result;
+	}
+	// Fills in median and MAD from the samples; for callers that take their
+	// own samples.
+	static void Summarize(BenchmarkResult& result) {
+		result.median = Median(result.samples);
+		std::vector<double> deviations;
+		for (double s : result.samples) {
+			deviations.push_back(std::fabs(s - result.median));
+		}
+		result.mad = Median(deviations);
+		result.relativeError = MedianRelativeError(result.samples);
+	}
+	std::vector<BenchmarkResult> RunAll(const BenchmarkOptions& options, const char* filter, std::ostream& log) {
+		std::vector<BenchmarkResult> results;
+		for (auto& c : _cases) {
+			if (filter != nullptr && c.name.find(filter) == std::string::npos) {
+				continue;
+			}
+			results.push_back(Run(c, options));
+			const BenchmarkResult& r = results.back();
+			log << r.name << ": median=" << r.median << "ns mad=" << r.mad << "ns samples=" << r.samples.size()
+				<< " (+/-" << r.relativeError * 100.0 << "%)" << std::endl;
+		}
+		return results;
+	}
+};
+
+struct BenchmarkRegistrar {
+	BenchmarkRegistrar(const char* name, std::function<void()> fn) {
+		Benchmarks::Instance().Register(name, std::move(fn));
+	}
+};
+
+#define BENCHMARK(name) \
+	static void Benchmark_##name(); \
+	static BenchmarkRegistrar BenchmarkRegistrar_##name(#name, Benchmark_##name); \
+	static void Benchmark_##name()
+
+///////////////////////////////////////////////////////////////////////////////
+// Result files and baseline comparison.
+///////////////////////////////////////////////////////////////////////////////
+
+inline void WriteBenchmarkJson(std::ostream& os, const std::vector<BenchmarkResult>& results) {
+	os.precision(17);
+	os << "{\"benchmarks\":[";
+	for (size_t i = 0; i < results.size(); ++i) {
+		const BenchmarkResult& r = results[i];
+		os << (i == 0 ? "\n" : ",\n");
+		os << "{\"name\":\"" << r.name << "\",\"iterations\":" << r.iterations;
+		os << ",\"median_ns\":" << r.median << ",\"mad_ns\":" << r.mad << ",\"samples\":[";
+		for (size_t j = 0; j < r.samples.size(); ++j) {
+			os << (j == 0 ? "" : ",") << r.samples[j];
+		}
+		os << "]}";
+	}
+	os << "\n]}" << std::endl;
+}
+
+// Reads back what WriteBenchmarkJson writes; it is not a general JSON parser.
+// Throws std::runtime_error on anything it can't make sense of, such as a
+// truncated or hand-edited file.
+inline std::map<std::string, std::vector<double>> ReadBenchmarkJson(std::istream& is) {
+	std::map<std::string, std::vector<double>> baseline;
+	std::stringstream text;
+	text << is.rdbuf();
+	std::string json = text.str();
+	size_t at = 0;
+	while ((at = json.find("\"name\":\"", at)) != std::string::npos) {
+		at += 8;
+		size_t end = json.find('"', at);
+		if (end == std::string::npos) {
+			throw std::runtime_error("Malformed baseline: unterminated name");
+		}
+		std::string name = json.substr(at, end - at);
+		size_t samples = json.find("\"samples\":[", end);
+		if (samples == std::string::npos) {
+			break;
+		}
+		at = samples + 11;
+		std::vector<double>& values = baseline[name];
+		while (at < json.size() && json[at] != ']') {
+			char* next = nullptr;
+			double value = strtod(json.c_str() + at, &next);
+			if (next == json.c_str() + at) {
+				throw std::runtime_error("Malformed baseline: bad sample in " + name);
+			}
+			values.push_back(value);
+			at = next - json.c_str();
+			if (json[at] == ',') {
+				++at;
+			}
+		}
+	}
+	return baseline;
+}
+
+// Two sided Mann-Whitney U test using the normal approximation with tie
+// correction. Returns the p-value for "both samples come from the same
+// distribution".
+inline double MannWhitneyP(const std::vector<double>& a, const std::vector<double>& b) {
+	struct Ranked {
+		double value;
+		int group;
+	};
+	std::vector<Ranked> all;
+	for (double v : a) {
+		all.push_back({ v, 0 });
+	}
+	for (double v : b) {
+		all.push_back({ v, 1 });
+	}
+	std::sort(all.begin(), all.end(), [](const Ranked& x, const Ranked& y) {
+		return x.value < y.value;
+	});
+	double n1 = (double)a.size(), n2 = (double)b.size(), n = n1 + n2;
+	double rankSumA = 0.0, ties = 0.0;
+	for (size_t i = 0; i < all.size();) {
+		size_t j = i;
+		while (j < all.size() && all[j].value == all[i].value) {
+			++j;
+		}
+		double rank = 0.5 * (i + 1 + j);
+		double t = (double)(j - i);
+		ties += t * t * t - t;
+		for (size_t k = i; k < j; ++k) {
+			if (all[k].group == 0) {
+				rankSumA += rank;
+			}
+		}
+		i = j;
+	}
+	double u = rankSumA - n1 * (n1 + 1.0) / 2.0;
+	double mean = n1 * n2 / 2.0;
+	double variance = n1 * n2 / 12.0 * ((n + 1.0) - ties / (n * (n - 1.0)));
+	if (variance <= 0.0) {
+		return 1.0;
+	}
+	double z = (std::fabs(u - mean) - 0.5) / std::sqrt(variance);
+	return std::erfc(std::max(z, 0.0) / std::sqrt(2.0));
+}
+
+inline void CompareBenchmarks(std::ostream& os, const std::vector<BenchmarkResult>& results, const std::map<std::string, std::vector<double>>& baseline, double alpha = 0.01) {
+	os << "[Comparison against baseline, alpha=" << alpha << "]" << std::endl;
+	for (auto& r : results) {
+		auto found = baseline.find(r.name);
+		if (found == baseline.end() || found->second.empty()) {
+			os << "  " << r.name << ": no baseline" << std::endl;
+			continue;
+		}
+		std::vector<double> base = found->second;
+		std::sort(base.begin(), base.end());
+		size_t n = base.size();
+		double baseMedian = n % 2 == 1 ? base[n / 2] : 0.5 * (base[n / 2 - 1] + base[n / 2]);
+		double delta = baseMedian > 0.0 ? (r.median - baseMedian) / baseMedian * 100.0 : 0.0;
+		double p = MannWhitneyP(r.samples, found->second);
+		os << "  " << r.name << ": " << baseMedian << "ns -> " << r.median << "ns ("
+			<< (delta >= 0.0 ? "+" : "") << delta << "%, p=" << p << ") "
+			<< (p >= alpha ? "no significant change" : delta < 0.0 ? "FASTER" : "SLOWER") << std::endl;
+	}
+}
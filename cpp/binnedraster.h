@@ -0,0 +1,316 @@
+#pragma once
+
+///////////////////////////////////////////////////////////////////////////////
+// Binned Rasterization.
+//
+// DrawMesh sets up and fills one triangle at a time on one thread. With dense
+// meshes most triangles cover a few pixels or none, and the per-triangle
+// work dominates. BinnedRasterizer splits the frame into two parallel
+// phases:
+//
+// The front end takes triangles four at a time in SIMD lanes: projection to
+// window space, trivial frustum rejection, a guard-band test and back-face
+// culling are all done across the four lanes before any per-triangle setup
+// happens. Triangles inside the guard band are set up straight from the
+// projected lanes. The rest are clipped against the near plane and the guard
+// band, which is rare, and their pieces set up one by one. Each setup is
+// kept in the worker's array and its index appended to the list of every
+// screen tile it overlaps, so a triangle is set up once however many tiles
+// it touches. Every worker has its own setups and tile lists, so binning
+// takes no locks.
+//
+// The back end then fills tiles in parallel. A tile walks the workers' lists
+// in worker order, and workers took contiguous runs of triangles, so
+// triangles still land in submission order; that merge is the only place
+// the per-worker bins meet.
+//
+// A setup is much bigger than the triangle it came from, so a large mesh
+// goes through both phases in batches of BatchSize triangles. That bounds
+// the setups held at once and keeps submission order across batches.
+///////////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <vector>
+
+#include "raster.h"
+#include "threadpool.h"
+
+template <int Varyings> class BinnedRasterizer {
+public:
+	// Even, so 2x2 quads never straddle tiles.
+	static constexpr int TileSize = 64;
+	// Triangles with every vertex within this multiple of w of the view
+	// axis are set up without clipping. Larger values clip less often at the
+	// cost of edge function precision on triangles far outside the window.
+	static constexpr float GuardBand = 8.0f;
+	static constexpr size_t BatchSize = 1 << 16;
+protected:
+	using Vertex = ShadedVertex<Varyings>;
+	using Setup = TriangleSetup<Varyings>;
+	// Everything one front end worker produces. Tile list entries index
+	// setups.
+	struct Bins {
+		std::vector<Setup> setups;
+		std::vector<std::vector<uint32_t>> tiles;
+		RasterStats stats;
+	};
+	const TriangleMesh* _mesh;
+	std::vector<Vertex> _vertices;
+	std::vector<Bins> _bins;
+	int _width, _height;
+	int _tilesX, _tilesY;
+
+	void Bin(Bins& bins, uint32_t entry, int minX, int minY, int maxX, int maxY) {
+		for (int ty = minY / TileSize; ty <= maxY / TileSize; ++ty) {
+			for (int tx = minX / TileSize; tx <= maxX / TileSize; ++tx) {
+				bins.tiles[ty * _tilesX + tx].push_back(entry);
+			}
+		}
+	}
+	void Bin(Bins& bins, const Setup& setup) {
+		Bin(bins, (uint32_t)(&setup - bins.setups.data()), setup.minX, setup.minY, setup.maxX, setup.maxY);
+	}
+	bool Project(const Vertex* v[3], Setup& setup) const {
+		float sx[3], sy[3], z[3], inverseW[3];
+		for (int i = 0; i < 3; ++i) {
+			const Vec4& clip = v[i]->clip;
+			inverseW[i] = 1.0f / clip.w;
+			sx[i] = (clip.x * inverseW[i] * 0.5f + 0.5f) * _width;
+			sy[i] = (0.5f - clip.y * inverseW[i] * 0.5f) * _height;
+			z[i] = clip.z * inverseW[i] * 0.5f + 0.5f;
+		}
+		return SetupScreenTriangle(v, sx, sy, z, inverseW, _width, _height, setup);
+	}
+	// Pieces of clipped triangles weren't projected by the front end, so
+	// they are projected here.
+	void ProjectAndBin(Bins& bins, const Vertex* v[3]) {
+		bins.setups.emplace_back();
+		if (Project(v, bins.setups.back())) {
+			Bin(bins, bins.setups.back());
+		} else {
+			bins.setups.pop_back();
+			++bins.stats.culled;
+		}
+	}
+	// Signed distance of a clip space vertex to plane p; inside is >= 0.
+	// Plane 0 is near, 1-4 are the guard band sides.
+	static float PlaneDistance(const Vec4& c, int p) {
+		switch (p) {
+		case 0: return c.z + c.w;
+		case 1: return GuardBand * c.w - c.x;
+		case 2: return GuardBand * c.w + c.x;
+		case 3: return GuardBand * c.w - c.y;
+		default: return GuardBand * c.w + c.y;
+		}
+	}
+	static Vertex Lerp(const Vertex& a, const Vertex& b, float t) {
+		Vertex r;
+		r.clip = Vec4(a.clip.x + (b.clip.x - a.clip.x) * t, a.clip.y + (b.clip.y - a.clip.y) * t, a.clip.z + (b.clip.z - a.clip.z) * t, a.clip.w + (b.clip.w - a.clip.w) * t);
+		for (int k = 0; k < Varyings; ++k) {
+			r.varyings[k] = a.varyings[k] + (b.varyings[k] - a.varyings[k]) * t;
+		}
+		return r;
+	}
+	// Sutherland-Hodgman in clip space, then a fan over what's left. Winding
+	// survives clipping, so back faces are still culled at setup.
+	void ClipAndBin(Bins& bins, const Vertex* v[3]) {
+		// Each plane adds at most one vertex.
+		Vertex polygon[2][8];
+		int count = 3;
+		for (int i = 0; i < 3; ++i) {
+			polygon[0][i] = *v[i];
+		}
+		int current = 0;
+		for (int p = 0; p < 5 && count > 0; ++p) {
+			const Vertex* in = polygon[current];
+			Vertex* out = polygon[current ^ 1];
+			int outCount = 0;
+			for (int i = 0; i < count; ++i) {
+				const Vertex& a = in[i];
+				const Vertex& b = in[(i + 1) % count];
+				float da = PlaneDistance(a.clip, p), db = PlaneDistance(b.clip, p);
+				if (da >= 0.0f) {
+					out[outCount++] = a;
+				}
+				if ((da >= 0.0f) != (db >= 0.0f)) {
+					out[outCount++] = Lerp(a, b, da / (da - db));
+				}
+			}
+			count = outCount;
+			current ^= 1;
+		}
+		for (int i = 1; i + 1 < count; ++i) {
+			const Vertex* fan[3] = { &polygon[current][0], &polygon[current][i], &polygon[current][i + 1] };
+			ProjectAndBin(bins, fan);
+		}
+	}
+	void FrontEnd(const TriangleMesh& mesh, size_t first, size_t last, Bins& bins) {
+		PROFILE_ZONE("BinnedRasterizer::FrontEnd");
+		const Float4 band(GuardBand), half(0.5f), zero(0.0f);
+		const Float4 width((float)_width), height((float)_height);
+		// At most one setup per triangle outside the rare clipped ones.
+		bins.setups.reserve(last - first);
+		for (size_t t = first; t < last; t += 4) {
+			int lanes = (int)std::min<size_t>(4, last - t);
+			const Vertex* triangles[4][3];
+			float cx[3][4], cy[3][4], cz[3][4], cw[3][4];
+			for (int lane = 0; lane < 4; ++lane) {
+				// Short batches repeat their last triangle; the extra lanes
+				// are ignored below.
+				size_t triangle = t + std::min(lane, lanes - 1);
+				for (int i = 0; i < 3; ++i) {
+					const Vertex* v = &_vertices[mesh.indices[triangle * 3 + i]];
+					triangles[lane][i] = v;
+					cx[i][lane] = v->clip.x;
+					cy[i][lane] = v->clip.y;
+					cz[i][lane] = v->clip.z;
+					cw[i][lane] = v->clip.w;
+				}
+			}
+			Float4 x[3], y[3], z[3], w[3];
+			for (int i = 0; i < 3; ++i) {
+				x[i] = Float4::Load(cx[i]);
+				y[i] = Float4::Load(cy[i]);
+				z[i] = Float4::Load(cz[i]);
+				w[i] = Float4::Load(cw[i]);
+			}
+			// Entirely outside one frustum plane.
+			Float4 allMask = Float4(0.0f) < Float4(1.0f);
+			Float4 outRight = allMask, outLeft = allMask, outTop = allMask, outBottom = allMask, outFar = allMask, outNear = allMask;
+			// Every vertex in front of the near plane and within the band.
+			Float4 inBand = allMask;
+			for (int i = 0; i < 3; ++i) {
+				outRight = outRight & (x[i] > w[i]);
+				outLeft = outLeft & (x[i] < -w[i]);
+				outTop = outTop & (y[i] > w[i]);
+				outBottom = outBottom & (y[i] < -w[i]);
+				outFar = outFar & (z[i] > w[i]);
+				outNear = outNear & (z[i] < -w[i]);
+				Float4 bandW = band * w[i];
+				inBand = inBand & (z[i] >= -w[i]) & (w[i] > zero) & (x[i] <= bandW) & (x[i] >= -bandW) & (y[i] <= bandW) & (y[i] >= -bandW);
+			}
+			int rejected = MoveMask(outRight | outLeft | outTop | outBottom | outFar | outNear);
+			int direct = MoveMask(inBand);
+			// Projection and facing, meaningful in the direct lanes only.
+			Float4 sx[3], sy[3], sz[3], inverseW[3];
+			for (int i = 0; i < 3; ++i) {
+				inverseW[i] = Float4(1.0f) / w[i];
+				sx[i] = (x[i] * inverseW[i] * half + half) * width;
+				sy[i] = (half - y[i] * inverseW[i] * half) * height;
+				sz[i] = z[i] * inverseW[i] * half + half;
+			}
+			Float4 area = (sx[1] - sx[0]) * (sy[2] - sy[0]) - (sy[1] - sy[0]) * (sx[2] - sx[0]);
+			int front = MoveMask(area < zero);
+			// Pixel bounds, rounded and clamped exactly as setup will.
+			Float4 minX = Max(zero, Floor(Min(sx[0], Min(sx[1], sx[2]))));
+			Float4 minY = Max(zero, Floor(Min(sy[0], Min(sy[1], sy[2]))));
+			Float4 maxX = Min(width - Float4(1.0f), -Floor(-Max(sx[0], Max(sx[1], sx[2]))));
+			Float4 maxY = Min(height - Float4(1.0f), -Floor(-Max(sy[0], Max(sy[1], sy[2]))));
+			int visible = MoveMask((minX <= maxX) & (minY <= maxY));
+			// Per vertex, per lane window coordinates for setup.
+			float px[3][4], py[3][4], pz[3][4], pw[3][4];
+			for (int i = 0; i < 3; ++i) {
+				sx[i].Store(px[i]);
+				sy[i].Store(py[i]);
+				sz[i].Store(pz[i]);
+				inverseW[i].Store(pw[i]);
+			}
+			for (int lane = 0; lane < lanes; ++lane) {
+				int bit = 1 << lane;
+				++bins.stats.triangles;
+				if (rejected & bit) {
+					++bins.stats.culled;
+				} else if (direct & bit) {
+					if ((front & visible & bit) == 0) {
+						++bins.stats.culled;
+						continue;
+					}
+					float lx[3] = { px[0][lane], px[1][lane], px[2][lane] };
+					float ly[3] = { py[0][lane], py[1][lane], py[2][lane] };
+					float lz[3] = { pz[0][lane], pz[1][lane], pz[2][lane] };
+					float lw[3] = { pw[0][lane], pw[1][lane], pw[2][lane] };
+					bins.setups.emplace_back();
+					// The lanes already passed facing and bounds; this only
+					// fails if scalar rounding disagrees.
+					if (SetupScreenTriangle(triangles[lane], lx, ly, lz, lw, _width, _height, bins.setups.back())) {
+						Bin(bins, bins.setups.back());
+					} else {
+						bins.setups.pop_back();
+						++bins.stats.culled;
+					}
+				} else {
+					++bins.stats.clipped;
+					ClipAndBin(bins, triangles[lane]);
+				}
+			}
+		}
+	}
+public:
+	BinnedRasterizer() : _mesh(nullptr), _width(0), _height(0), _tilesX(0), _tilesY(0) {}
+	// Target and FS pair up as for DrawMesh: a Framebuffer or
+	// MsaaFramebuffer with a fragment shader, or a G-buffer with a
+	// GBufferShader.
+	template <class Target, class VS, class FS> RasterStats Draw(Target& target, const TriangleMesh& mesh, const VS& vertex, const FS& fragment) {
+		static_assert(VS::Varyings == Varyings, "Vertex shader writes a different number of varyings");
+		PROFILE_ZONE("BinnedRasterizer::Draw");
+		ThreadPool& pool = ThreadPool::Shared();
+		_mesh = &mesh;
+		_width = target.width;
+		_height = target.height;
+		_tilesX = (_width + TileSize - 1) / TileSize;
+		_tilesY = (_height + TileSize - 1) / TileSize;
+		size_t tiles = (size_t)_tilesX * _tilesY;
+		_vertices.resize(mesh.positions.size());
+		pool.ParallelFor(0, _vertices.size(), [&](size_t first, size_t last) {
+			for (size_t i = first; i < last; ++i) {
+				_vertices[i].clip = vertex(mesh.positions[i], mesh.normals[i], mesh.st0[i * 2], mesh.st0[i * 2 + 1], _vertices[i].varyings);
+			}
+		});
+		size_t workers = pool.Size() + 1;
+		_bins.resize(workers);
+		for (Bins& bins : _bins) {
+			bins.tiles.resize(tiles);
+			bins.stats = RasterStats();
+		}
+		std::vector<RasterStats> tileStats(tiles);
+		size_t triangles = mesh.indices.size() / 3;
+		for (size_t batch = 0; batch < triangles; batch += BatchSize) {
+			size_t batchEnd = std::min(triangles, batch + BatchSize);
+			for (Bins& bins : _bins) {
+				bins.setups.clear();
+				for (auto& tile : bins.tiles) {
+					tile.clear();
+				}
+			}
+			// One contiguous run of the batch per worker, in multiples of
+			// the SIMD width.
+			size_t run = ((batchEnd - batch + workers - 1) / workers + 3) & ~(size_t)3;
+			pool.ParallelFor(0, workers, [&](size_t first, size_t last) {
+				for (size_t worker = first; worker < last; ++worker) {
+					size_t begin = std::min(batchEnd, batch + worker * run);
+					size_t end = std::min(batchEnd, begin + run);
+					FrontEnd(mesh, begin, end, _bins[worker]);
+				}
+			});
+			pool.ParallelFor(0, tiles, [&](size_t first, size_t last) {
+				PROFILE_ZONE("BinnedRasterizer::BackEnd");
+				for (size_t tile = first; tile < last; ++tile) {
+					int minX = (int)(tile % _tilesX) * TileSize, minY = (int)(tile / _tilesX) * TileSize;
+					for (const Bins& bins : _bins) {
+						for (uint32_t entry : bins.tiles[tile]) {
+							RasterTriangle(target, bins.setups[entry], fragment, tileStats[tile], minX, minY, minX + TileSize - 1, minY + TileSize - 1);
+						}
+					}
+				}
+			});
+		}
+		RasterStats stats;
+		for (const Bins& bins : _bins) {
+			stats += bins.stats;
+		}
+		for (const RasterStats& tile : tileStats) {
+			stats += tile;
+		}
+		return stats;
+	}
+};
@@ -0,0 +1,415 @@
+#pragma once
+
+///////////////////////////////////////////////////////////////////////////////
+// Bounding Volume Hierarchy.
+//
+// A binned SAH build over every IBounded object in a world. Building is the
+// expensive part, so dynamic scenes avoid it: when objects move the tree is
+// refit (bounds recomputed bottom up, one depth level at a time in parallel)
+// and a quality monitor compares each subtree's SAH cost with its cost when
+// built. Subtrees that have degraded past a threshold are rebuilt on their
+// own; the rest of the tree is left alone.
+//
+// Every subtree covers a contiguous range of the primitive array, which is
+// what makes rebuilding a subtree in place possible.
+///////////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include "geometric.h"
+#include "threadpool.h"
+
+struct BvhNode {
+	static constexpr uint32_t Invalid = UINT32_MAX;
+	Bounds bounds;
+	uint32_t left = Invalid;
+	uint32_t right = Invalid;
+	uint32_t parent = Invalid;
+	uint32_t depth = 0;
+	uint32_t first = 0;
+	uint32_t count = 0;
+	// SAH cost of the subtree when it was built, and as of the last refit.
+	float buildCost = 0.0f;
+	float cost = 0.0f;
+	bool Leaf() const {
+		return left == Invalid;
+	}
+};
+
+class Bvh {
+public:
+	struct Stats {
+		size_t nodes = 0;
+		size_t garbage = 0;
+		size_t refitNodes = 0;
+		size_t subtreeRebuilds = 0;
+		size_t fullBuilds = 0;
+	};
+	static constexpr uint32_t MaxLeafSize = 4;
+	static constexpr int Bins = 16;
+protected:
+	// Relative cost of visiting a node versus testing a primitive.
+	static constexpr float TraversalCost = 1.0f;
+	static constexpr float IntersectCost = 1.0f;
+
+	SharedWorld _world;
+	std::vector<BvhNode> _nodes;
+	// World slot of each primitive, in tree order.
+	std::vector<uint32_t> _prims;
+	// Indexed by world slot.
+	std::vector<Bounds> _slotBounds;
+	// Resolved once per build so traversal never casts; null for objects
+	// that can't be hit.
+	std::vector<const IIntersectable*> _slotIntersectable;
+	std::vector<uint32_t> _leafOfSlot;
+	std::vector<uint8_t> _dirty;
+	uint32_t _maxDepth;
+	Stats _stats;
+
+	static float Area(const Bounds& b) {
+		return std::max(b.SurfaceArea(), 1e-12f);
+	}
+	void UpdateNode(BvhNode& node) {
+		if (node.Leaf()) {
+			Bounds bounds;
+			for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+				bounds.Grow(_slotBounds[_prims[i]]);
+			}
+			node.bounds = bounds;
+			node.cost = IntersectCost * node.count;
+		} else {
+			const BvhNode& l = _nodes[node.left];
+			const BvhNode& r = _nodes[node.right];
+			node.bounds = l.bounds;
+			node.bounds.Grow(r.bounds);
+			node.cost = TraversalCost + (Area(l.bounds) * l.cost + Area(r.bounds) * r.cost) / Area(node.bounds);
+		}
+	}
+	void BuildNode(uint32_t index, uint32_t first, uint32_t count, uint32_t depth, uint32_t parent) {
+		BvhNode node;
+		node.first = first;
+		node.count = count;
+		node.depth = depth;
+		node.parent = parent;
+		_maxDepth = std::max(_maxDepth, depth);
+		Bounds centroids;
+		for (uint32_t i = first; i < first + count; ++i) {
+			centroids.Grow(_slotBounds[_prims[i]].Center());
+		}
+		Vec3 extent = centroids.Extent();
+		int axis = extent.x > extent.y && extent.x > extent.z ? 0 : extent.y > extent.z ? 1 : 2;
+		uint32_t split = first;
+		if (count > MaxLeafSize && extent[axis] > 0.0f) {
+			// Binned SAH along the widest centroid axis.
+			struct Bin {
+				Bounds bounds;
+				uint32_t count = 0;
+			} bins[Bins];
+			float lo = centroids.min[axis];
+			float scale = Bins / extent[axis];
+			auto binOf = [&](uint32_t slot) {
+				return std::min(Bins - 1, (int)((_slotBounds[slot].Center()[axis] - lo) * scale));
+			};
+			for (uint32_t i = first; i < first + count; ++i) {
+				Bin& bin = bins[binOf(_prims[i])];
+				bin.bounds.Grow(_slotBounds[_prims[i]]);
+				++bin.count;
+			}
+			float rightArea[Bins];
+			uint32_t rightCount[Bins];
+			Bounds accumulated;
+			uint32_t accumulatedCount = 0;
+			for (int b = Bins - 1; b > 0; --b) {
+				accumulated.Grow(bins[b].bounds);
+				accumulatedCount += bins[b].count;
+				rightArea[b] = accumulated.SurfaceArea();
+				rightCount[b] = accumulatedCount;
+			}
+			float bestCost = IntersectCost * count;
+			int bestBin = -1;
+			accumulated = Bounds();
+			accumulatedCount = 0;
+			Bounds total;
+			for (int b = 0; b < Bins; ++b) {
+				total.Grow(bins[b].bounds);
+			}
+			for (int b = 1; b < Bins; ++b) {
+				accumulated.Grow(bins[b - 1].bounds);
+				accumulatedCount += bins[b - 1].count;
+				if (accumulatedCount == 0 || rightCount[b] == 0) {
+					continue;
+				}
+				float cost = TraversalCost + IntersectCost * (accumulated.SurfaceArea() * accumulatedCount + rightArea[b] * rightCount[b]) / Area(total);
+				if (cost < bestCost) {
+					bestCost = cost;
+					bestBin = b;
+				}
+			}
+			if (bestBin > 0) {
+				uint32_t* middle = std::partition(&_prims[first], &_prims[first] + count, [&](uint32_t slot) {
+					return binOf(slot) < bestBin;
+				});
+				split = (uint32_t)(middle - &_prims[0]);
+			}
+		}
+		if (split == first || split == first + count) {
+			// SAH says a leaf is cheaper, or everything landed in one bin.
+			// Leaves are kept small either way so refits stay local.
+			if (count <= MaxLeafSize * 4) {
+				_nodes[index] = node;
+				for (uint32_t i = first; i < first + count; ++i) {
+					_leafOfSlot[_prims[i]] = index;
+				}
+				UpdateNode(_nodes[index]);
+				_nodes[index].buildCost = _nodes[index].cost;
+				return;
+			}
+			split = first + count / 2;
+			std::nth_element(&_prims[first], &_prims[split], &_prims[first] + count, [&](uint32_t a, uint32_t b) {
+				return _slotBounds[a].Center()[axis] < _slotBounds[b].Center()[axis];
+			});
+		}
+		node.left = (uint32_t)_nodes.size();
+		node.right = node.left + 1;
+		_nodes[index] = node;
+		_nodes.emplace_back();
+		_nodes.emplace_back();
+		BuildNode(node.left, first, split - first, depth + 1, index);
+		BuildNode(node.right, split, first + count - split, depth + 1, index);
+		UpdateNode(_nodes[index]);
+		_nodes[index].buildCost = _nodes[index].cost;
+	}
+	size_t CountDescendants(uint32_t index) const {
+		const BvhNode& node = _nodes[index];
+		return node.Leaf() ? 0 : 2 + CountDescendants(node.left) + CountDescendants(node.right);
+	}
+	// Recompute the listed nodes and every ancestor of them, deepest level
+	// first, fanning each level out across the thread pool.
+	void RefitFrom(std::vector<uint32_t> seeds) {
+		std::vector<std::vector<uint32_t>> levels(_maxDepth + 1);
+		_dirty.assign(_nodes.size(), 0);
+		for (uint32_t index : seeds) {
+			if (!_dirty[index]) {
+				_dirty[index] = 1;
+				levels[_nodes[index].depth].push_back(index);
+			}
+		}
+		for (int depth = (int)_maxDepth; depth >= 0; --depth) {
+			std::vector<uint32_t>& level = levels[depth];
+			if (level.size() > 256) {
+				ThreadPool::Shared().ParallelFor(0, level.size(), [&](size_t first, size_t last) {
+					for (size_t i = first; i < last; ++i) {
+						UpdateNode(_nodes[level[i]]);
+					}
+				});
+			} else {
+				for (uint32_t index : level) {
+					UpdateNode(_nodes[index]);
+				}
+			}
+			_stats.refitNodes += level.size();
+			for (uint32_t index : level) {
+				uint32_t parent = _nodes[index].parent;
+				if (parent != BvhNode::Invalid && !_dirty[parent]) {
+					_dirty[parent] = 1;
+					levels[depth - 1].push_back(parent);
+				}
+			}
+		}
+	}
+	void RebuildSubtree(uint32_t index) {
+		BvhNode node = _nodes[index];
+		_stats.garbage += CountDescendants(index);
+		BuildNode(index, node.first, node.count, node.depth, node.parent);
+		++_stats.subtreeRebuilds;
+		if (node.parent != BvhNode::Invalid) {
+			RefitFrom({ node.parent });
+		}
+	}
+public:
+	Bvh() : _maxDepth(0) {}
+	// Objects are looked up by slot here and nowhere else: putting a
+	// different object in a slot needs another Build, not a Refit.
+	void Build(SharedWorld& world) {
+		PROFILE_ZONE("Bvh::Build");
+		_world = world;
+		_nodes.clear();
+		_prims.clear();
+		_maxDepth = 0;
+		_slotBounds.assign(world->size(), Bounds());
+		_slotIntersectable.assign(world->size(), nullptr);
+		_leafOfSlot.assign(world->size(), BvhNode::Invalid);
+		for (uint32_t slot = 0; slot < world->size(); ++slot) {
+			IBounded* bounded = dynamic_cast<IBounded*>((*world)[slot].get());
+			if (bounded != nullptr) {
+				_slotBounds[slot] = bounded->GetBounds();
+				_slotIntersectable[slot] = dynamic_cast<const IIntersectable*>((*world)[slot].get());
+				_prims.push_back(slot);
+			}
+		}
+		_nodes.emplace_back();
+		BuildNode(0, 0, (uint32_t)_prims.size(), 0, BvhNode::Invalid);
+		_stats.garbage = 0;
+		++_stats.fullBuilds;
+	}
+	// Pick up new bounds for the given world slots after their objects moved.
+	// Slots the tree doesn't hold, including any past the world as it was at
+	// Build, are ignored.
+	void Refit(const std::vector<uint32_t>& movedSlots) {
+		PROFILE_ZONE("Bvh::Refit");
+		std::vector<uint32_t> leaves;
+		for (uint32_t slot : movedSlots) {
+			if (slot >= _leafOfSlot.size() || _leafOfSlot[slot] == BvhNode::Invalid) {
+				continue;
+			}
+			_slotBounds[slot] = dynamic_cast<IBounded*>((*_world)[slot].get())->GetBounds();
+			leaves.push_back(_leafOfSlot[slot]);
+		}
+		RefitFrom(std::move(leaves));
+	}
+	// Rebuild the largest subtrees whose cost has grown by more than the
+	// threshold since they were built. A degraded subtree holding more than
+	// maxFraction of all primitives is descended into rather than rebuilt,
+	// unless neither of its children is degraded on its own. Rebuilding the
+	// root is a full build. Returns the number of rebuilds.
+	size_t Maintain(float threshold = 1.3f, float maxFraction = 0.25f) {
+		PROFILE_ZONE("Bvh::Maintain");
+		if (_nodes.empty()) {
+			return 0;
+		}
+		size_t limit = (size_t)(_prims.size() * maxFraction);
+		size_t rebuilt = 0;
+		std::vector<uint32_t> stack = { 0 };
+		while (!stack.empty()) {
+			uint32_t index = stack.back();
+			stack.pop_back();
+			const BvhNode& node = _nodes[index];
+			if (node.cost <= node.buildCost * threshold) {
+				continue;
+			}
+			bool leftDegraded = !node.Leaf() && _nodes[node.left].cost > _nodes[node.left].buildCost * threshold;
+			bool rightDegraded = !node.Leaf() && _nodes[node.right].cost > _nodes[node.right].buildCost * threshold;
+			if (node.count <= limit || node.Leaf() || (!leftDegraded && !rightDegraded)) {
+				// Either small enough to rebuild outright, or the damage is
+				// spread across this level and no smaller rebuild will fix it.
+				if (index == 0) {
+					SharedWorld world = _world;
+					Build(world);
+					return rebuilt + 1;
+				}
+				RebuildSubtree(index);
+				++rebuilt;
+			} else {
+				stack.push_back(node.left);
+				stack.push_back(node.right);
+			}
+		}
+		// Subtree rebuilds leave their old nodes behind; compact once the
+		// garbage outweighs the live tree.
+		if (_stats.garbage > _nodes.size() / 2) {
+			SharedWorld world = _world;
+			Build(world);
+		}
+		return rebuilt;
+	}
+	// Cost of the whole tree now, relative to when the root was last built.
+	// A tree with no cost to speak of, such as one over an empty world, has
+	// not degraded.
+	float Degradation() const {
+		return _nodes.empty() || _nodes[0].buildCost <= 0.0f ? 1.0f : _nodes[0].cost / _nodes[0].buildCost;
+	}
+	// Calls fn with the world slot of every object whose bounds overlap the
+	// query box.
+	void Query(const Bounds& query, std::function<void(uint32_t)> fn) const {
+		if (_nodes.empty()) {
+			return;
+		}
+		auto overlaps = [&query](const Bounds& b) {
+			return b.max.x >= query.min.x && b.min.x <= query.max.x
+				&& b.max.y >= query.min.y && b.min.y <= query.max.y
+				&& b.max.z >= query.min.z && b.min.z <= query.max.z;
+		};
+		std::vector<uint32_t> stack = { 0 };
+		while (!stack.empty()) {
+			const BvhNode& node = _nodes[stack.back()];
+			stack.pop_back();
+			if (!overlaps(node.bounds)) {
+				continue;
+			}
+			if (node.Leaf()) {
+				for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+					if (overlaps(_slotBounds[_prims[i]])) {
+						fn(_prims[i]);
+					}
+				}
+			} else {
+				stack.push_back(node.left);
+				stack.push_back(node.right);
+			}
+		}
+	}
+	// Closest hit against every IIntersectable object in the tree. Children
+	// are visited nearest first so far subtrees are usually culled by t.
+	bool Intersect(const Ray& ray, Hit& hit) const {
+		if (_nodes.empty()) {
+			return false;
+		}
+		Vec3 inverse = InverseDirection(ray.direction);
+		bool found = false;
+		// Reused across calls so a ray never allocates.
+		thread_local std::vector<uint32_t> stack;
+		stack.clear();
+		stack.push_back(0);
+		while (!stack.empty()) {
+			const BvhNode& node = _nodes[stack.back()];
+			stack.pop_back();
+			float tNear, tFar;
+			if (!IntersectSlabs(node.bounds.min, node.bounds.max, ray, inverse, hit.t, tNear, tFar)) {
+				continue;
+			}
+			if (node.Leaf()) {
+				for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+					uint32_t slot = _prims[i];
+					const IIntersectable* object = _slotIntersectable[slot];
+					if (object != nullptr && object->Intersect(ray, hit)) {
+						hit.slot = slot;
+						found = true;
+					}
+				}
+				continue;
+			}
+			const BvhNode& l = _nodes[node.left];
+			const BvhNode& r = _nodes[node.right];
+			float lNear, lFar, rNear, rFar;
+			bool hitL = IntersectSlabs(l.bounds.min, l.bounds.max, ray, inverse, hit.t, lNear, lFar);
+			bool hitR = IntersectSlabs(r.bounds.min, r.bounds.max, ray, inverse, hit.t, rNear, rFar);
+			if (hitL && hitR) {
+				bool leftFirst = lNear <= rNear;
+				stack.push_back(leftFirst ? node.right : node.left);
+				stack.push_back(leftFirst ? node.left : node.right);
+			} else if (hitL) {
+				stack.push_back(node.left);
+			} else if (hitR) {
+				stack.push_back(node.right);
+			}
+		}
+		return found;
+	}
+	const std::vector<BvhNode>& Nodes() const {
+		return _nodes;
+	}
+	const std::vector<uint32_t>& Primitives() const {
+		return _prims;
+	}
+	const Bounds& SlotBounds(uint32_t slot) const {
+		return _slotBounds[slot];
+	}
+	Stats GetStats() const {
+		Stats stats = _stats;
+		stats.nodes = _nodes.size();
+		return stats;
+	}
+};
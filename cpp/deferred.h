@@ -0,0 +1,196 @@
+#pragma once
+
+///////////////////////////////////////////////////////////////////////////////
+// Deferred Shading.
+//
+// Forward rasterization runs the fragment shader for every fragment that
+// passes the depth test at the time it is drawn, so a pixel covered by five
+// layers drawn back to front is shaded five times. The deferred path splits
+// that in two: rasterization only records what is visible (depth, normal,
+// st0 and a material ID) into a G-buffer, and a separate pass shades every
+// pixel exactly once from it. Shading then costs the same for any depth
+// complexity, and the rasterizer's inner loop is a handful of stores.
+//
+// The G-buffer is one array per attribute rather than one struct per pixel,
+// and pixels are stored in 2x2 quads, four consecutive floats per quad in the
+// rasterizer's lane order. A quad of any attribute is one Float4 load, the
+// rasterizer writes quads with one masked store, and the shading pass gets
+// the same quads the forward path shades, so texture LOD still comes from
+// QuadLod.
+///////////////////////////////////////////////////////////////////////////////
+
+#include <cstdint>
+#include <vector>
+
+#include "raster.h"
+#include "threadpool.h"
+
+struct GBuffer {
+	// Material ID of pixels nothing was drawn to.
+	static constexpr uint32_t Empty = 0xFFFFFFFFu;
+	int width, height;
+	int quadsX, quadsY;
+	// Window space depth in [0, 1], smaller is nearer.
+	std::vector<float> depth;
+	std::vector<float> normalX, normalY, normalZ;
+	std::vector<float> u, v;
+	std::vector<uint32_t> material;
+	GBuffer(int width, int height) : width(width), height(height), quadsX((width + 1) / 2), quadsY((height + 1) / 2) {
+		size_t pixels = (size_t)quadsX * quadsY * 4;
+		depth.resize(pixels, 1.0f);
+		normalX.resize(pixels);
+		normalY.resize(pixels);
+		normalZ.resize(pixels);
+		u.resize(pixels);
+		v.resize(pixels);
+		material.resize(pixels, Empty);
+	}
+	size_t Index(int x, int y) const {
+		return ((size_t)(y >> 1) * quadsX + (x >> 1)) * 4 + (y & 1) * 2 + (x & 1);
+	}
+	float& Depth(int x, int y) {
+		return depth[Index(x, y)];
+	}
+	// Attributes under Empty are never read, so only these two need resetting.
+	void Clear(float clearDepth = 1.0f) {
+		std::fill(depth.begin(), depth.end(), clearDepth);
+		std::fill(material.begin(), material.end(), Empty);
+	}
+};
+
+// The G-buffer pass's fragment stage. Normal and st0 come from the standard
+// varying layout (StandardVertexShader); material is the ID the shading
+// pass looks up for everything this draw covers.
+struct GBufferShader {
+	uint32_t material = 0;
+};
+
+template <int Varyings> void RasterTriangle(GBuffer& target, const TriangleSetup<Varyings>& setup, const GBufferShader& shader, RasterStats& stats, int minX = 0, int minY = 0, int maxX = INT_MAX, int maxY = INT_MAX) {
+	static_assert(Varyings >= 5, "G-buffer needs the standard normal and st0 varyings");
+	TraverseTriangle(target, setup, stats, minX, minY, maxX, maxY, [&](int x, int y, int mask, const Float4* varyings) {
+		size_t base = target.Index(x, y);
+		Float4 keep = LaneMask(mask);
+		auto store = [&](std::vector<float>& channel, const Float4& value) {
+			float* quad = &channel[base];
+			Select(keep, value, Float4::Load(quad)).Store(quad);
+		};
+		store(target.normalX, varyings[0]);
+		store(target.normalY, varyings[1]);
+		store(target.normalZ, varyings[2]);
+		store(target.u, varyings[3]);
+		store(target.v, varyings[4]);
+		for (int lane = 0; lane < 4; ++lane) {
+			if (mask & (1 << lane)) {
+				target.material[base + lane] = shader.material;
+			}
+		}
+	});
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Shading Pass.
+//
+// Lambert lighting from one directional light, as LambertShader and
+// TextureShader, with the surface color from the pixel's material. Rows of
+// quads are shaded in parallel. Most quads lie inside one surface and are
+// shaded as a whole; quads on a boundary are shaded once per material they
+// contain and the lanes merged.
+///////////////////////////////////////////////////////////////////////////////
+
+struct DeferredMaterial {
+	Vec3 albedo = Vec3(0.8f, 0.8f, 0.8f);
+	// Multiplies albedo when set, sampled at st0 scaled by repeat.
+	const Texture* texture = nullptr;
+	float repeat = 1.0f;
+};
+
+struct DeferredShader {
+	std::vector<DeferredMaterial> materials;
+	// Towards the light, normalized.
+	Vec3 light = Vec3(0.0f, 1.0f, 0.0f);
+	float ambient = 0.15f;
+	Vec3 background = Vec3(0.0f, 0.0f, 0.0f);
+protected:
+	void ShadeQuad(const GBuffer& gbuffer, size_t base, int x, int y, Image& target) const {
+		Float4 nx = Float4::Load(&gbuffer.normalX[base]);
+		Float4 ny = Float4::Load(&gbuffer.normalY[base]);
+		Float4 nz = Float4::Load(&gbuffer.normalZ[base]);
+		Float4 length = Sqrt(nx * nx + ny * ny + nz * nz);
+		Float4 lambert = Max((nx * Float4(light.x) + ny * Float4(light.y) + nz * Float4(light.z)) / Max(length, Float4(1e-6f)), Float4(0.0f));
+		Float4 shade = Float4(ambient) + Float4(1.0f - ambient) * lambert;
+		const uint32_t* ids = &gbuffer.material[base];
+		Float4 rgb[3];
+		int done = 0;
+		for (int lane = 0; lane < 4; ++lane) {
+			if (done & (1 << lane)) {
+				continue;
+			}
+			uint32_t id = ids[lane];
+			int mask = 0;
+			for (int other = lane; other < 4; ++other) {
+				mask |= ids[other] == id ? 1 << other : 0;
+			}
+			done |= mask;
+			// Empty pixels, and any written with an ID past the material
+			// table, get the background.
+			Float4 color[3] = { Float4(background.x), Float4(background.y), Float4(background.z) };
+			if (id < materials.size()) {
+				const DeferredMaterial& material = materials[id];
+				color[0] = Float4(material.albedo.x) * shade;
+				color[1] = Float4(material.albedo.y) * shade;
+				color[2] = Float4(material.albedo.z) * shade;
+				if (material.texture != nullptr) {
+					Float4 u = Float4::Load(&gbuffer.u[base]) * Float4(material.repeat);
+					Float4 v = Float4::Load(&gbuffer.v[base]) * Float4(material.repeat);
+					if (mask != 0xF) {
+						// Other lanes hold another surface's st0; copy this
+						// lane's over them so they don't inflate the LOD.
+						Float4 inside = LaneMask(mask);
+						u = Select(inside, u, Float4(u[lane]));
+						v = Select(inside, v, Float4(v[lane]));
+					}
+					Float4 rgba[4];
+					material.texture->Sample(u, v, rgba);
+					for (int c = 0; c < 3; ++c) {
+						color[c] = color[c] * rgba[c];
+					}
+				}
+			}
+			if (mask == 0xF) {
+				rgb[0] = color[0];
+				rgb[1] = color[1];
+				rgb[2] = color[2];
+			} else {
+				Float4 inside = LaneMask(mask);
+				for (int c = 0; c < 3; ++c) {
+					rgb[c] = Select(inside, color[c], rgb[c]);
+				}
+			}
+		}
+		float r[4], g[4], b[4];
+		rgb[0].Store(r);
+		rgb[1].Store(g);
+		rgb[2].Store(b);
+		for (int lane = 0; lane < 4; ++lane) {
+			int px = x + (lane & 1), py = y + (lane >> 1);
+			if (px < target.width && py < target.height) {
+				float* pixel = target.Pixel(px, py);
+				pixel[0] = r[lane];
+				pixel[1] = g[lane];
+				pixel[2] = b[lane];
+			}
+		}
+	}
+public:
+	// Writes every pixel of target, which must match the G-buffer's size.
+	void Shade(const GBuffer& gbuffer, Image& target) const {
+		PROFILE_ZONE("DeferredShader::Shade");
+		ThreadPool::Shared().ParallelFor(0, (size_t)gbuffer.quadsY, [&](size_t first, size_t last) {
+			for (size_t qy = first; qy < last; ++qy) {
+				for (int qx = 0; qx < gbuffer.quadsX; ++qx) {
+					ShadeQuad(gbuffer, ((size_t)qy * gbuffer.quadsX + qx) * 4, qx * 2, (int)qy * 2, target);
+				}
+			}
+		});
+	}
+};
@@ -0,0 +1,357 @@
+#pragma once
+
+///////////////////////////////////////////////////////////////////////////////
+// Direct I/O Streams.
+//
+// A multi-gigabyte snapshot written through FileStreamOut goes through the
+// page cache and pushes out whatever the render workers had there. These
+// streams open the file with O_DIRECT so the data moves between our buffers
+// and the device without being cached.
+//
+// O_DIRECT wants the buffer, the file offset and the length all aligned to
+// the device block, so each stream owns two aligned buffers of BufferSize
+// bytes. The caller fills (or drains) one while the other is in flight on a
+// helper thread, which keeps the device busy while serialization runs. The
+// helper is the stream's own thread rather than the shared pool: it spends
+// its life blocked in the kernel, which would starve a pool sized to cores.
+//
+// The file rarely ends on a block boundary. The writer pads its last buffer
+// with zeros to the next block, writes that, then truncates the file back to
+// the true length. The reader simply asks for whole buffers; the last read
+// comes back short at the end of the file.
+//
+// Filesystems without O_DIRECT (tmpfs, some overlays) refuse the open. The
+// streams then fall back to ordinary I/O through the same buffers and drop
+// each range from the cache with posix_fadvise once it is done with.
+///////////////////////////////////////////////////////////////////////////////
+
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "geometric.h"
+
+// Runs one job at a time on its own thread. Submit waits for the previous
+// job, so there is never more than one in flight; an exception from a job is
+// rethrown by the next Wait or Submit.
+class IoHelper {
+protected:
+	std::mutex _mutex;
+	std::condition_variable _wake;
+	std::function<void()> _job;
+	bool _busy;
+	bool _stopping;
+	std::exception_ptr _error;
+	std::thread _thread;
+
+	void Worker() {
+		std::unique_lock<std::mutex> lock(_mutex);
+		for (;;) {
+			_wake.wait(lock, [this]() { return _stopping || _busy; });
+			if (!_busy) {
+				return;
+			}
+			lock.unlock();
+			try {
+				_job();
+			} catch (...) {
+				lock.lock();
+				_error = std::current_exception();
+				lock.unlock();
+			}
+			lock.lock();
+			_busy = false;
+			_wake.notify_all();
+		}
+	}
+public:
+	IoHelper() : _busy(false), _stopping(false) {
+		_thread = std::thread([this]() { Worker(); });
+	}
+	IoHelper(const IoHelper&) = delete;
+	IoHelper& operator=(const IoHelper&) = delete;
+	~IoHelper() {
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_wake.wait(lock, [this]() { return !_busy; });
+			_stopping = true;
+		}
+		_wake.notify_all();
+		_thread.join();
+	}
+	void Wait() {
+		std::unique_lock<std::mutex> lock(_mutex);
+		_wake.wait(lock, [this]() { return !_busy; });
+		if (_error) {
+			std::exception_ptr error = _error;
+			_error = nullptr;
+			std::rethrow_exception(error);
+		}
+	}
+	void Submit(std::function<void()> job) {
+		Wait();
+		std::lock_guard<std::mutex> lock(_mutex);
+		_job = std::move(job);
+		_busy = true;
+		_wake.notify_all();
+	}
+};
+
+struct AlignedFree {
+	void operator()(uint8_t* p) const {
+		free(p);
+	}
+};
+
+// The block size O_DIRECT is held to. 4K covers every device we run on; a
+// 512 byte device is happy with it too.
+static constexpr size_t DirectAlignment = 4096;
+
+inline std::unique_ptr<uint8_t[], AlignedFree> AllocateAligned(size_t bytes) {
+	void* p = nullptr;
+	if (posix_memalign(&p, DirectAlignment, bytes) != 0) {
+		throw std::bad_alloc();
+	}
+	return std::unique_ptr<uint8_t[], AlignedFree>((uint8_t*)p);
+}
+
+// Opens with O_DIRECT if the filesystem allows it, otherwise without. direct
+// says which happened.
+inline int OpenDirect(const char* path, int flags, bool& direct) {
+	int fd = open(path, flags | O_DIRECT, 0644);
+	direct = fd >= 0;
+	if (fd < 0 && errno == EINVAL) {
+		fd = open(path, flags, 0644);
+	}
+	return fd;
+}
+
+class DirectStreamOut : public IStreamOut {
+public:
+	static constexpr size_t BufferSize = 1 << 20;
+protected:
+	int _fd;
+	bool _direct;
+	bool _finished;
+	std::unique_ptr<uint8_t[], AlignedFree> _buffers[2];
+	int _current;
+	size_t _fill;
+	// File offset of the current buffer; always a multiple of BufferSize.
+	uint64_t _offset;
+	IoHelper _helper;
+
+	// Runs on the helper thread.
+	void WriteBlock(const uint8_t* data, size_t bytes, uint64_t offset) {
+		size_t done = 0;
+		while (done < bytes) {
+			ssize_t written = pwrite(_fd, data + done, bytes - done, (off_t)(offset + done));
+			if (written < 0 && errno == EINTR) {
+				continue;
+			}
+			if (written <= 0) {
+				throw StreamException("Direct write failed");
+			}
+			done += (size_t)written;
+		}
+		if (!_direct) {
+			// Dirty pages can't be dropped, so push these out first.
+			sync_file_range(_fd, (off_t)offset, (off_t)bytes, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+			posix_fadvise(_fd, (off_t)offset, (off_t)bytes, POSIX_FADV_DONTNEED);
+		}
+	}
+	// Hands the full current buffer to the helper and switches to the other.
+	void Flush() {
+		const uint8_t* data = _buffers[_current].get();
+		uint64_t offset = _offset;
+		_helper.Submit([this, data, offset]() {
+			WriteBlock(data, BufferSize, offset);
+		});
+		_offset += BufferSize;
+		_current ^= 1;
+		_fill = 0;
+	}
+public:
+	DirectStreamOut(const char* path) : _finished(false), _current(0), _fill(0), _offset(0) {
+		_fd = OpenDirect(path, O_WRONLY | O_CREAT | O_TRUNC, _direct);
+		if (_fd < 0) {
+			throw StreamException("Cannot open file for writing");
+		}
+		_buffers[0] = AllocateAligned(BufferSize);
+		_buffers[1] = AllocateAligned(BufferSize);
+	}
+	DirectStreamOut(const DirectStreamOut&) = delete;
+	DirectStreamOut& operator=(const DirectStreamOut&) = delete;
+	// Finishes if the caller didn't, but can't report a failure from here;
+	// call Finish to find out whether everything made it to the file.
+	virtual ~DirectStreamOut() {
+		try {
+			Finish();
+		} catch (...) {
+		}
+		close(_fd);
+	}
+	virtual void WriteBytes(const void* buffer, int count) override {
+		if (_finished) {
+			throw StreamException("Write after finish");
+		}
+		const uint8_t* source = (const uint8_t*)buffer;
+		size_t remaining = (size_t)count;
+		while (remaining > 0) {
+			size_t chunk = std::min(remaining, BufferSize - _fill);
+			memcpy(_buffers[_current].get() + _fill, source, chunk);
+			_fill += chunk;
+			source += chunk;
+			remaining -= chunk;
+			if (_fill == BufferSize) {
+				Flush();
+			}
+		}
+	}
+	// Writes the tail, padded to a whole block, and truncates the padding
+	// back off. Throws if this or any earlier write failed.
+	void Finish() {
+		if (_finished) {
+			return;
+		}
+		_finished = true;
+		_helper.Wait();
+		if (_fill > 0) {
+			size_t padded = (_fill + DirectAlignment - 1) / DirectAlignment * DirectAlignment;
+			memset(_buffers[_current].get() + _fill, 0, padded - _fill);
+			WriteBlock(_buffers[_current].get(), padded, _offset);
+		}
+		if (ftruncate(_fd, (off_t)(_offset + _fill)) != 0) {
+			throw StreamException("Cannot truncate file");
+		}
+	}
+	uint64_t Size() const {
+		return _offset + _fill;
+	}
+	// False if the filesystem refused O_DIRECT and the fallback is in use.
+	bool Direct() const {
+		return _direct;
+	}
+};
+
+class DirectStreamIn : public IStreamIn {
+public:
+	static constexpr size_t BufferSize = DirectStreamOut::BufferSize;
+protected:
+	int _fd;
+	bool _direct;
+	uint64_t _size;
+	std::unique_ptr<uint8_t[], AlignedFree> _buffers[2];
+	// File offset of each buffer and the bytes its last read received.
+	uint64_t _offsets[2];
+	size_t _valid[2];
+	int _current;
+	size_t _position;
+	// File offset of the next buffer to be read ahead.
+	uint64_t _next;
+	IoHelper _helper;
+
+	// Runs on the helper thread. Stops short only at the end of the file.
+	void ReadBlock(int index, uint64_t offset) {
+		uint8_t* data = _buffers[index].get();
+		size_t done = 0;
+		while (done < BufferSize) {
+			ssize_t got = pread(_fd, data + done, BufferSize - done, (off_t)(offset + done));
+			if (got < 0 && errno == EINTR) {
+				continue;
+			}
+			if (got < 0) {
+				throw StreamException("Direct read failed");
+			}
+			if (got == 0) {
+				break;
+			}
+			done += (size_t)got;
+		}
+		if (!_direct) {
+			posix_fadvise(_fd, (off_t)offset, (off_t)done, POSIX_FADV_DONTNEED);
+		}
+		_valid[index] = done;
+	}
+	void ReadAhead(int index) {
+		if (_next >= _size) {
+			_offsets[index] = _size;
+			_valid[index] = 0;
+			return;
+		}
+		uint64_t offset = _next;
+		_offsets[index] = offset;
+		_next += BufferSize;
+		_helper.Submit([this, index, offset]() {
+			ReadBlock(index, offset);
+		});
+	}
+	// Makes the read ahead buffer current and starts filling the other.
+	void Advance() {
+		_helper.Wait();
+		_current ^= 1;
+		_position = 0;
+		ReadAhead(_current ^ 1);
+	}
+public:
+	DirectStreamIn(const char* path) : _offsets{ 0, 0 }, _valid{ 0, 0 }, _current(1), _position(0), _next(0) {
+		_fd = OpenDirect(path, O_RDONLY, _direct);
+		if (_fd < 0) {
+			throw StreamException("Cannot open file for reading");
+		}
+		struct stat info;
+		if (fstat(_fd, &info) != 0) {
+			close(_fd);
+			throw StreamException("Cannot stat file");
+		}
+		_size = (uint64_t)info.st_size;
+		_buffers[0] = AllocateAligned(BufferSize);
+		_buffers[1] = AllocateAligned(BufferSize);
+		// The first Advance makes buffer 0 current.
+		ReadAhead(0);
+	}
+	DirectStreamIn(const DirectStreamIn&) = delete;
+	DirectStreamIn& operator=(const DirectStreamIn&) = delete;
+	virtual ~DirectStreamIn() {
+		try {
+			_helper.Wait();
+		} catch (...) {
+		}
+		close(_fd);
+	}
+	virtual void ReadBytes(void* buffer, int count) override {
+		uint8_t* target = (uint8_t*)buffer;
+		size_t remaining = count < 0 ? 0 : (size_t)count;
+		while (remaining > 0) {
+			if (_position == _valid[_current]) {
+				Advance();
+				if (_valid[_current] == 0) {
+					throw StreamException("Short read from file");
+				}
+			}
+			size_t chunk = std::min(remaining, _valid[_current] - _position);
+			memcpy(target, _buffers[_current].get() + _position, chunk);
+			_position += chunk;
+			target += chunk;
+			remaining -= chunk;
+		}
+	}
+	uint64_t Size() const {
+		return _size;
+	}
+	bool AtEnd() const {
+		return _offsets[_current] + _position >= _size;
+	}
+	bool Direct() const {
+		return _direct;
+	}
+};
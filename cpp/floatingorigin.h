@@ -0,0 +1,229 @@
+#pragma once
+
+///////////////////////////////////////////////////////////////////////////////
+// Floating Origin.
+//
+// Objects store float coordinates, which run out of precision a long way
+// from the origin: at 10,000km a float can't tell positions closer than a
+// metre apart. Storing doubles everywhere would halve the width of every
+// SIMD loop that touches a position, so a LargeWorld keeps floats and moves
+// the origin instead.
+//
+// Space is cut into cells, each anchored at a double precision corner. An
+// object lives in the cell containing its position, stored in float
+// coordinates relative to that anchor, so it never gets further from its own
+// origin than one cell size. Each cell has its own BVH built once over those
+// local coordinates.
+//
+// Rendering happens relative to an origin cell near the viewer. Each cell
+// reaches render space through a single float offset, computed in double
+// from the difference in cell coordinates and rounded once; a top level BVH
+// over the cells, with rays shifted into cell space on the way down, ties
+// them together. Nothing near the viewer ever sees a large coordinate.
+//
+// Rebasing is lazy and batched. Moving the focus only records where it is;
+// the origin follows once the focus has strayed more than RebaseCells from
+// it, and then on the next Update, which rewrites every cell's offset and
+// rebuilds the top level in one go. Objects and cell BVHs are never touched
+// by a rebase, so repeated rebasing can't accumulate rounding error.
+///////////////////////////////////////////////////////////////////////////////
+
+#include <cmath>
+#include <cstdint>
+#include <map>
+#include <memory>
+
+#include "bvh.h"
+#include "geometric.h"
+#include "pagedworld.h"
+#include "tessellate.h"
+#include "threadpool.h"
+
+// One cell as seen from the current origin. This is what the top level BVH
+// holds: bounds and intersection in render space, delegated to the cell's
+// own BVH in local space.
+class LargeWorldCell : public IObject, public IBounded, public IIntersectable, public ITessellatable {
+protected:
+	SharedWorld _objects;
+	Bvh _bvh;
+	Bounds _localBounds;
+	Vec3 _offset;
+	bool _dirty;
+public:
+	LargeWorldCell() : _objects(std::make_shared<World>()), _dirty(false) {}
+	// object is already in cell local coordinates.
+	void Add(const std::shared_ptr<IObject>& object) {
+		_objects->push_back(object);
+		IBounded* bounded = dynamic_cast<IBounded*>(object.get());
+		if (bounded != nullptr) {
+			_localBounds.Grow(bounded->GetBounds());
+		}
+		_dirty = true;
+	}
+	bool Dirty() const {
+		return _dirty;
+	}
+	void BuildBvh() {
+		_bvh.Build(_objects);
+		_dirty = false;
+	}
+	void SetOffset(const Vec3& offset) {
+		_offset = offset;
+	}
+	const Vec3& Offset() const {
+		return _offset;
+	}
+	const SharedWorld& Objects() const {
+		return _objects;
+	}
+	virtual Bounds GetBounds() const override {
+		return _localBounds.Empty() ? _localBounds : Bounds(_localBounds.min + _offset, _localBounds.max + _offset);
+	}
+	// Direction, and so t and the normal, are the same in both spaces.
+	virtual bool Intersect(const Ray& ray, Hit& hit) const override {
+		return _bvh.Intersect(Ray(ray.origin - _offset, ray.direction), hit);
+	}
+	virtual void Tessellate(TriangleMesh& mesh) const override {
+		size_t first = mesh.positions.size();
+		for (auto& object : *_objects) {
+			ITessellatable* tessellatable = dynamic_cast<ITessellatable*>(object.get());
+			if (tessellatable != nullptr) {
+				tessellatable->Tessellate(mesh);
+			}
+		}
+		for (size_t i = first; i < mesh.positions.size(); ++i) {
+			mesh.positions[i] += _offset;
+		}
+	}
+};
+
+class LargeWorld {
+public:
+	// How far, in cells on any axis, the focus may wander from the origin
+	// before a rebase is due.
+	static constexpr int RebaseCells = 2;
+	struct Stats {
+		size_t rebases = 0;
+		size_t cellBuilds = 0;
+		size_t topBuilds = 0;
+	};
+protected:
+	double _cellSize;
+	std::map<CellCoord, LargeWorldCell> _cells;
+	CellCoord _origin;
+	DVec3 _focus;
+	bool _rebasePending;
+	bool _topDirty;
+	// The top level: one LargeWorldCell per slot, not owned.
+	SharedWorld _top;
+	Bvh _topBvh;
+	Stats _stats;
+
+	static CellCoord CellOf(const DVec3& p, double cellSize) {
+		return { (int32_t)floor(p.x / cellSize), (int32_t)floor(p.y / cellSize), (int32_t)floor(p.z / cellSize) };
+	}
+	DVec3 Anchor(const CellCoord& cell) const {
+		return DVec3(cell.x * _cellSize, cell.y * _cellSize, cell.z * _cellSize);
+	}
+	// Exact in double for any cell a world could hold; rounded once.
+	Vec3 OffsetOf(const CellCoord& cell) const {
+		return (DVec3((double)cell.x - _origin.x, (double)cell.y - _origin.y, (double)cell.z - _origin.z) * _cellSize).ToVec3();
+	}
+public:
+	LargeWorld(double cellSize = 1024.0) : _cellSize(cellSize), _origin({ 0, 0, 0 }), _rebasePending(false), _topDirty(false), _top(std::make_shared<World>()) {}
+	LargeWorld(const LargeWorld&) = delete;
+	LargeWorld& operator=(const LargeWorld&) = delete;
+	// Places an object built around its own origin at a double precision
+	// position. The object is moved into its cell's local coordinates, so it
+	// must be ITranslatable.
+	void Add(const std::shared_ptr<IObject>& object, const DVec3& position) {
+		ITranslatable* translatable = dynamic_cast<ITranslatable*>(object.get());
+		if (translatable == nullptr) {
+			throw NotImplementedException();
+		}
+		CellCoord coord = CellOf(position, _cellSize);
+		translatable->Translate((position - Anchor(coord)).ToVec3());
+		auto found = _cells.find(coord);
+		if (found == _cells.end()) {
+			found = _cells.emplace(coord, LargeWorldCell()).first;
+			found->second.SetOffset(OffsetOf(coord));
+		}
+		found->second.Add(object);
+		_topDirty = true;
+	}
+	// Records where the viewer is. Cheap enough to call every frame; only
+	// marks a rebase as due, and only once the focus is RebaseCells away.
+	void SetFocus(const DVec3& focus) {
+		_focus = focus;
+		CellCoord cell = CellOf(focus, _cellSize);
+		if (std::abs(cell.x - _origin.x) > RebaseCells || std::abs(cell.y - _origin.y) > RebaseCells || std::abs(cell.z - _origin.z) > RebaseCells) {
+			_rebasePending = true;
+		}
+	}
+	// Brings everything up to date before rendering: builds the BVHs of
+	// cells that gained objects, in parallel, then applies a pending rebase
+	// and rebuilds the top level if anything changed. Returns true if the
+	// origin moved, after which positions from ToLocal must be fetched again.
+	bool Update() {
+		PROFILE_ZONE("LargeWorld::Update");
+		std::vector<LargeWorldCell*> dirty;
+		for (auto& cell : _cells) {
+			if (cell.second.Dirty()) {
+				dirty.push_back(&cell.second);
+			}
+		}
+		ThreadPool::Shared().ParallelFor(0, dirty.size(), [&](size_t first, size_t last) {
+			for (size_t i = first; i < last; ++i) {
+				dirty[i]->BuildBvh();
+			}
+		});
+		_stats.cellBuilds += dirty.size();
+		bool rebased = false;
+		if (_rebasePending) {
+			_origin = CellOf(_focus, _cellSize);
+			for (auto& cell : _cells) {
+				cell.second.SetOffset(OffsetOf(cell.first));
+			}
+			_rebasePending = false;
+			_topDirty = true;
+			rebased = true;
+			++_stats.rebases;
+		}
+		if (_topDirty) {
+			_top->clear();
+			for (auto& cell : _cells) {
+				// Aliasing constructor: the top level borrows the cells.
+				_top->push_back(std::shared_ptr<IObject>(std::shared_ptr<IObject>(), &cell.second));
+			}
+			_topBvh.Build(_top);
+			_topDirty = false;
+			++_stats.topBuilds;
+		}
+		return rebased;
+	}
+	// Render space is float, relative to the origin cell's anchor.
+	Vec3 ToLocal(const DVec3& p) const {
+		return (p - Anchor(_origin)).ToVec3();
+	}
+	DVec3 ToWorld(const Vec3& p) const {
+		return Anchor(_origin) + DVec3(p);
+	}
+	// The top level BVH, in render space. Anything that traces a Bvh can
+	// trace this, as of the last Update. Hit slots are cells, not objects.
+	const Bvh& GetBvh() const {
+		return _topBvh;
+	}
+	// The cells as top level objects, in the order of the BVH's slots.
+	const SharedWorld& Cells() const {
+		return _top;
+	}
+	const CellCoord& Origin() const {
+		return _origin;
+	}
+	double CellSize() const {
+		return _cellSize;
+	}
+	Stats GetStats() const {
+		return _stats;
+	}
+};
@@ -1,320 +1,736 @@
-///////////////////////////////////////////////////////////////////////////////
-// Classic Streaming Interfaces.
-///////////////////////////////////////////////////////////////////////////////
-
-class IStreamIn {
-public:
-	virtual ~IStreamIn() {}
-	virtual void ReadBytes(void* buffer, int count) = 0;
-};
-
-class IStreamOut {
-public:
-	virtual ~IStreamOut() {}
-	virtual void WriteBytes(const void* buffer, int count) = 0;
-};
-
-class ISerializable {
-public:
-	virtual ~ISerializable() {}
-	virtual void Load(IStreamIn& stream) = 0;
-	virtual void Save(IStreamOut& stream) = 0;
-};
+#include "asyncio.h"
+#include "binnedraster.h"
+#include "bvh.h"
+#include "deferred.h"
+#include "directio.h"
+#include "floatingorigin.h"
+#include "geometric.h"
+#include "geometrycache.h"
+#include "mmapstream.h"
+#include "msaa.h"
+#include "pagedworld.h"
+#include "parametric.h"
+#include "raster.h"
+#include "raytrace.h"
+#include "readahead.h"
+#include "teestream.h"
 
 ///////////////////////////////////////////////////////////////////////////////
-// Output Stream Implementors.
-//
-// Streaming interfaces are common and can be overridden to perform all kinds
-// of interesting behaviors. The obvious use is to provide streaming outputs to
-// network sockets, files, or memory buffers - this also makes them Adaptors in
-// design pattern parlance.
+// Entrypoint.
 ///////////////////////////////////////////////////////////////////////////////
 
-#include <iostream>
+#include <sys/mman.h>
 
-class Log : public IStreamOut {
-public:
-	Log() {
-		std::cout << "[Opening Log]" << std::endl;
+// Fraction of a file's pages that are in the page cache.
+double CachedFraction(const char* path) {
+	int fd = open(path, O_RDONLY);
+	struct stat info;
+	if (fd < 0 || fstat(fd, &info) != 0 || info.st_size == 0) {
+		if (fd >= 0) {
+			close(fd);
+		}
+		return 0.0;
 	}
-	virtual ~Log() {
-		std::cout << std::endl << "[Closing Log]" << std::endl;
+	void* mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mapped == MAP_FAILED) {
+		return 0.0;
 	}
-	virtual void WriteBytes(const void* buffer, int count) {
-		for (int i = 0; i < count; ++i) {
-			std::cout << " " << ((const uint8_t*)buffer)[i];
+	size_t page = sysconf(_SC_PAGESIZE);
+	std::vector<unsigned char> resident((info.st_size + page - 1) / page);
+	size_t cached = 0;
+	if (mincore(mapped, info.st_size, resident.data()) == 0) {
+		for (unsigned char r : resident) {
+			cached += r & 1;
 		}
 	}
-};
-
-#include <ctime>
+	munmap(mapped, info.st_size);
+	return (double)cached / resident.size();
+}
 
-class LogTime : public IStreamOut {
-public:
-	LogTime() {
-		std::cout << "[Opening Timestamped Log]" << std::endl;
-	}
-	virtual ~LogTime() {
-		std::cout << "[Closing Timestamped Log]" << std::endl;
-	}
-	virtual void WriteBytes(const void* buffer, int count) {
-		time_t t;
-		time(&t);
-		std::cout << "[" << t << "]";
-		for (int i = 0; i < count; ++i) {
-			std::cout << " " << ((const uint8_t*)buffer)[i];
-		}
-		std::cout << std::endl;
+// Writes back and evicts a file's pages, so the next read comes from the
+// device.
+void DropFromCache(const char* path) {
+	int fd = open(path, O_RDONLY);
+	if (fd >= 0) {
+		fdatasync(fd);
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
 	}
-};
+}
 
-class MemoryStream : public IStreamOut {
-protected:
-	std::vector<uint8_t> _memory;
-public:
-	virtual void WriteBytes(const void* buffer, int count) {
-		for (int i = 0; i < count; ++i) {
-			_memory.push_back(((const uint8_t*)buffer)[i]);
+// Save a million objects to a file with buffered and direct streams, load
+// the direct one back, and see how much of each file is left in the cache.
+void DirectDemo(const char* path) {
+	std::cout << "** Direct I/O" << std::endl;
+	SharedWorld world = std::make_shared<World>();
+	for (int i = 0; i < 1000000; ++i) {
+		float x = (float)(i % 1000), z = (float)(i / 1000);
+		world->push_back(i % 3 == 0 ? SharedGeomFactory().CreateBox(0.5f, 0.5f, 0.5f, Vec3(x, 0.0f, z)) : SharedGeomFactory().CreateSphere(0.25f, Vec3(x, 1.0f, z)));
+	}
+	auto ms = [](std::chrono::steady_clock::time_point begin) {
+		return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+	};
+	{
+		auto begin = std::chrono::steady_clock::now();
+		{
+			FileStreamOut out(path);
+			SaveEverything(world, out);
 		}
+		std::cout << "Buffered save: " << ms(begin) << "ms, " << CachedFraction(path) * 100.0 << "% cached" << std::endl;
 	}
-	uint32_t size() const {
-		return _memory.size();
+	uint64_t bytes;
+	bool direct;
+	{
+		auto begin = std::chrono::steady_clock::now();
+		DirectStreamOut out(path);
+		SaveEverything(world, out);
+		out.Finish();
+		bytes = out.Size();
+		direct = out.Direct();
+		std::cout << "Direct save: " << ms(begin) << "ms, " << bytes << " bytes, " << CachedFraction(path) * 100.0 << "% cached"
+			<< (direct ? "" : " (no O_DIRECT here, fadvise fallback)") << std::endl;
 	}
-};
-
-///////////////////////////////////////////////////////////////////////////////
-// Standard Geometrics.
-//
-// This is a rudimentary world setup intended only to demonstrate a usage of
-// concepts.
-///////////////////////////////////////////////////////////////////////////////
-
-#include <exception>
-
-class NotImplementedException : public std::exception {
-};
-
-// Tagging Interface
-// Doesn't do anything except declare an object.
-
-class IObject {
-public:
-	virtual ~IObject() {}
-};
+	{
+		auto begin = std::chrono::steady_clock::now();
+		DirectStreamIn in(path);
+		size_t loaded = 0;
+		while (!in.AtEnd()) {
+			LoadObject(in);
+			++loaded;
+		}
+		std::cout << "Direct load: " << ms(begin) << "ms, " << loaded << " of " << world->size() << " objects, "
+			<< CachedFraction(path) * 100.0 << "% cached" << std::endl;
+	}
+}
 
-class Box : public IObject, public ISerializable {
-protected:
-	float _x, _y, _z;
-public:
-	Box(float x, float y, float z) : _x(x), _y(y), _z(z) {}
-	virtual void Load(IStreamIn& stream) override {
-		throw NotImplementedException();
+// Save a large world as eight shards, first one after another through
+// buffered streams, then all at once from this thread through one async
+// engine, and load the shards back together.
+void ShardDemo(const char* directory) {
+	std::cout << "** Async Shards" << std::endl;
+	const int shardCount = 8;
+	std::vector<SharedWorld> shards;
+	for (int i = 0; i < shardCount; ++i) {
+		shards.push_back(std::make_shared<World>());
 	}
-	virtual void Save(IStreamOut& stream) override {
-		stream.WriteBytes("Box", 3);
-		stream.WriteBytes(&_x, sizeof(_x));
-		stream.WriteBytes(&_y, sizeof(_y));
-		stream.WriteBytes(&_z, sizeof(_z));
+	for (int i = 0; i < 1000000; ++i) {
+		float x = (float)(i % 1000), z = (float)(i / 1000);
+		shards[i % shardCount]->push_back(SharedGeomFactory().CreateSphere(0.25f, Vec3(x, 1.0f, z)));
 	}
-};
-
-class Sphere : public IObject, public ISerializable {
-protected:
-	float _radius;
-public:
-	Sphere(float radius) : _radius(radius) {}
-	virtual void Load(IStreamIn& stream) override {
-		throw NotImplementedException();
+	std::vector<std::string> paths;
+	for (int i = 0; i < shardCount; ++i) {
+		paths.push_back(std::string(directory) + "/shard-" + std::to_string(i) + ".bin");
 	}
-	virtual void Save(IStreamOut& stream) override {
-		stream.WriteBytes("Sphere", 6);
-		stream.WriteBytes(&_radius, sizeof(_radius));
+	auto ms = [](std::chrono::steady_clock::time_point begin) {
+		return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+	};
+	auto begin = std::chrono::steady_clock::now();
+	for (int i = 0; i < shardCount; ++i) {
+		FileStreamOut out(paths[i].c_str());
+		SaveEverything(shards[i], out);
 	}
-};
+	std::cout << "Buffered, one shard at a time: " << ms(begin) << "ms" << std::endl;
+	// A block for each writer plus room for plenty in flight.
+	std::unique_ptr<AsyncIo> io = CreateAsyncIo(64);
+	begin = std::chrono::steady_clock::now();
+	{
+		std::vector<std::unique_ptr<AsyncStreamOut>> outs;
+		for (int i = 0; i < shardCount; ++i) {
+			outs.push_back(std::make_unique<AsyncStreamOut>(*io, paths[i].c_str()));
+		}
+		for (int i = 0; i < shardCount; ++i) {
+			SaveEverything(shards[i], *outs[i]);
+		}
+		for (auto& out : outs) {
+			out->Finish();
+		}
+	}
+	AsyncIo::Stats saved = io->GetStats();
+	std::cout << "Async (" << io->Backend() << "), all shards at once: " << ms(begin) << "ms, "
+		<< saved.requests << " requests in " << saved.submissions << " submissions" << std::endl;
+	// Objects are taken from each shard in turn, so every shard's read
+	// ahead is in flight together.
+	begin = std::chrono::steady_clock::now();
+	size_t loaded = 0;
+	{
+		std::vector<std::unique_ptr<AsyncStreamIn>> ins;
+		for (int i = 0; i < shardCount; ++i) {
+			ins.push_back(std::make_unique<AsyncStreamIn>(*io, paths[i].c_str()));
+		}
+		bool any = true;
+		while (any) {
+			any = false;
+			for (auto& in : ins) {
+				if (!in->AtEnd()) {
+					LoadObject(*in);
+					++loaded;
+					any = true;
+				}
+			}
+		}
+	}
+	AsyncIo::Stats total = io->GetStats();
+	std::cout << "Async load: " << ms(begin) << "ms, " << loaded << " objects, " << total.requests - saved.requests
+		<< " requests in " << total.submissions - saved.submissions << " submissions" << std::endl;
+}
 
-class Mesh : public IObject, public ISerializable {
-protected:
-	int _vertices, _triangles;
-public:
-	Mesh(int vertices, int triangles) : _vertices(vertices), _triangles(triangles) {
+// Load a million objects from a file that isn't in the page cache, first
+// straight from a FileStreamIn and then through a read ahead decorator.
+void ReadAheadDemo(const char* path) {
+	std::cout << "** Read Ahead" << std::endl;
+	SharedWorld world = std::make_shared<World>();
+	for (int i = 0; i < 1000000; ++i) {
+		float x = (float)(i % 1000), z = (float)(i / 1000);
+		world->push_back(i % 3 == 0 ? SharedGeomFactory().CreateBox(0.5f, 0.5f, 0.5f, Vec3(x, 0.0f, z)) : SharedGeomFactory().CreateSphere(0.25f, Vec3(x, 1.0f, z)));
 	}
-	virtual void Load(IStreamIn& stream) override {
-		throw NotImplementedException();
+	{
+		FileStreamOut out(path);
+		SaveEverything(world, out);
+	}
+	auto ms = [](std::chrono::steady_clock::time_point begin) {
+		return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+	};
+	DropFromCache(path);
+	auto begin = std::chrono::steady_clock::now();
+	{
+		FileStreamIn in(path);
+		for (size_t i = 0; i < world->size(); ++i) {
+			LoadObject(in);
+		}
 	}
-	virtual void Save(IStreamOut& stream) override {
-		stream.WriteBytes("Mesh", 4);
-		stream.WriteBytes(&_vertices, sizeof(_vertices));
-		stream.WriteBytes(&_triangles, sizeof(_triangles));
+	std::cout << "Direct from file: " << ms(begin) << "ms" << std::endl;
+	DropFromCache(path);
+	begin = std::chrono::steady_clock::now();
+	FileStreamIn file(path);
+	ReadAheadStreamIn in(file, FileSize(path));
+	size_t loaded = 0;
+	while (!in.AtEnd()) {
+		LoadObject(in);
+		++loaded;
 	}
-};
-
-///////////////////////////////////////////////////////////////////////////////
-// Geometric Factory.
-//
-// We use a factory pattern to create the world either as parametric/geometric
-// objects or as mesh data. This is a basic example of an abstract factory.
-///////////////////////////////////////////////////////////////////////////////
+	ReadAheadStreamIn::Stats stats = in.GetStats();
+	std::cout << "With read ahead: " << ms(begin) << "ms, " << loaded << " objects, " << stats.blocks << " blocks, "
+		<< stats.stalls << " stalls waiting " << stats.stallMs << "ms" << std::endl;
+}
 
-class ISceneFactory {
-public:
-	virtual ~ISceneFactory() {}
-	virtual std::unique_ptr<IObject> CreateBox(float x, float y, float z) = 0;
-	virtual std::unique_ptr<IObject> CreateSphere(float radius) = 0;
-};
+// Save the "world" to different stream out implementors in one pass. The
+// console log is the slow sink, so it is buffered and prints on its own
+// thread while the memory stream fills in line.
+void SaveMethods(SharedWorld& world) {
+	PROFILE_ZONE("SaveMethods");
+	LogTime log;
+	MemoryStream str;
+	{
+		TeeStreamOut tee;
+		tee.Add(str).AddBuffered(log);
+		SaveEverything(world, tee);
+		tee.Finish();
+	}
+	std::cout << "Buffer contains " << str.size() << " bytes." << std::endl;
+}
 
-// Geometrics are parametric objects that cannot be directly renderered
-// (except via raytracers) as they are not b-reps.
-class GeomFactory : public ISceneFactory {
-public:
-	virtual std::unique_ptr<IObject> CreateBox(float x, float y, float z) override {
-		return std::make_unique<Box>(x, y, z);
+// Write a large grid world as a paged snapshot through a memory mapped
+// stream, which has the cell directory patched in place once the payloads
+// are out, then walk a focus point across it and watch cells stream in and
+// out under a small budget.
+void PagedDemo(const char* path) {
+	std::cout << "** Paged World" << std::endl;
+	SharedWorld world = std::make_shared<World>();
+	for (int z = 0; z < 64; ++z) {
+		for (int x = 0; x < 64; ++x) {
+			Vec3 center(x * 4.0f, 0.0f, z * 4.0f);
+			if ((x + z) % 2 == 0) {
+				world->push_back(SharedGeomFactory().CreateSphere(1.0f, center));
+			} else {
+				world->push_back(SharedGeomFactory().CreateBox(2.0f, 2.0f, 2.0f, center));
+			}
+		}
 	}
-	virtual std::unique_ptr<IObject> CreateSphere(float radius) override {
-		return std::make_unique<Sphere>(radius);
+	{
+		MmapStreamOut file(path);
+		WritePagedSnapshot(world, 32.0f, file);
+		file.Finish();
 	}
-};
+	PagedWorld paged(path, 16 * 1024);
+	for (int step = 0; step <= 8; ++step) {
+		Vec3 focus(step * 32.0f, 0.0f, 128.0f);
+		paged.Flush(focus, 48.0f);
+		PagedWorld::Stats stats = paged.GetStats();
+		size_t objects = 0;
+		paged.VisitResident([&objects](IObject&) { ++objects; });
+		std::cout << "Focus x=" << focus.x << ": " << stats.resident << " cells, " << objects << " objects, "
+			<< stats.residentBytes << " bytes resident, " << stats.loads << " loads, " << stats.evictions << " evictions, " << stats.failures << " failures" << std::endl;
+	}
+}
 
-// The MeshFactory is a stand-in for mesh data but it doesn't actually
-// create any triangle meshes (yet).
-class MeshFactory : public ISceneFactory {
-public:
-	virtual std::unique_ptr<IObject> CreateBox(float x, float y, float z) override {
-		return std::make_unique<Mesh>(8, 12);
+// Sweep a window of spheres through a cache that only fits part of the
+// world, as a camera flying past would.
+void GeometryCacheDemo() {
+	std::cout << "** Geometry Cache" << std::endl;
+	SharedWorld world = std::make_shared<World>();
+	for (int i = 0; i < 256; ++i) {
+		world->push_back(SharedGeomFactory().CreateSphere(1.0f, Vec3(i * 3.0f, 0.0f, 0.0f)));
 	}
-	virtual std::unique_ptr<IObject> CreateSphere(float radius) override {
-		return std::make_unique<Mesh>(36 * 36, 36 * 36 * 2);
+	size_t meshBytes = GeometryCache(0).Acquire(world->front())->Bytes();
+	GeometryCache cache(meshBytes * 48);
+	for (int frame = 0; frame < 256; frame += 4) {
+		for (int i = frame; i < frame + 32 && i < (int)world->size(); ++i) {
+			cache.Acquire((*world)[i]);
+		}
 	}
-};
-
-//////////////////////////////////////////////////////////////////////////////
-// Command Pattern.
-//
-// This is a very naive implementation of a command pattern that supports undo
-// (as long as the commands are maintained in a second list).
-//////////////////////////////////////////////////////////////////////////////
-
-class ICommand {
-public:
-	virtual ~ICommand() {}
-	virtual void CommandDo() = 0;
-	virtual void CommandUndo() = 0;
-};
-
-///////////////////////////////////////////////////////////////////////////////
-// Entrypoint.
-///////////////////////////////////////////////////////////////////////////////
-
-// Simple strategy to save everything in the world.
-// This corresponds to a visitor pattern.
-
-template <class T> using Array = std::vector<T>;
-
-using SharedFactory = std::shared_ptr<ISceneFactory>;
-
-using SharedObject = std::shared_ptr<IObject>;
-using World = Array<SharedObject>;
-using SharedWorld = std::shared_ptr<World>;
-
-using SharedCommand = std::shared_ptr<ICommand>;
-using Commands = Array<SharedCommand>;
-using SharedCommands = std::shared_ptr<Commands>;
-
-///////////////////////////////////////////////////////////////////////////////
-// This is a command pattern.
-///////////////////////////////////////////////////////////////////////////////
+	GeometryCache::Stats stats = cache.GetStats();
+	std::cout << "Mesh " << meshBytes << " bytes, budget " << meshBytes * 48 << " bytes: "
+		<< stats.hits << " hits, " << stats.misses << " misses, " << stats.evictions << " evictions, "
+		<< stats.entries << " entries, " << stats.residentBytes << " resident, " << stats.peakBytes << " peak" << std::endl;
+}
 
-class CreateBoxCommand : public ICommand {
-protected:
-	SharedWorld _world;
-	float _x, _y, _z;
-	SharedFactory _factory;
-public:
-	CreateBoxCommand(SharedWorld& world, float x, float y, float z) : _world(world), _x(x), _y(y), _z(z) {}
-	virtual void CommandDo() override {
-		_world->push_back(std::move(_factory->CreateBox(_x, _y, _z)));
+// Animate a tenth of a large world each frame and keep its BVH up to date
+// with refits, letting the quality monitor decide when to rebuild.
+void BvhDemo() {
+	std::cout << "** Dynamic BVH" << std::endl;
+	SharedWorld world = std::make_shared<World>();
+	uint32_t seed = 7;
+	auto next = [&seed]() {
+		seed = seed * 1664525u + 1013904223u;
+		return (float)(seed >> 8) / (1 << 24);
+	};
+	for (int i = 0; i < 20000; ++i) {
+		world->push_back(SharedGeomFactory().CreateSphere(0.5f, Vec3(next() * 200.0f, next() * 200.0f, next() * 200.0f)));
 	}
-	virtual void CommandUndo() override {
-		_world->pop_back();
+	Bvh bvh;
+	auto begin = std::chrono::steady_clock::now();
+	bvh.Build(world);
+	double buildMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+	std::cout << "Full build " << buildMs << "ms, " << bvh.GetStats().nodes << " nodes" << std::endl;
+	std::vector<uint32_t> moved;
+	for (uint32_t slot = 0; slot < world->size(); slot += 10) {
+		moved.push_back(slot);
 	}
-};
+	for (int frame = 0; frame < 10; ++frame) {
+		for (uint32_t slot : moved) {
+			Vec3 offset((next() - 0.5f) * 24.0f, (next() - 0.5f) * 24.0f, (next() - 0.5f) * 24.0f);
+			dynamic_cast<ITranslatable*>((*world)[slot].get())->Translate(offset);
+		}
+		begin = std::chrono::steady_clock::now();
+		bvh.Refit(moved);
+		float degradation = bvh.Degradation();
+		size_t rebuilt = bvh.Maintain();
+		double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+		std::cout << "Frame " << frame << ": refit+maintain " << ms << "ms, cost x" << degradation
+			<< " before, x" << bvh.Degradation() << " after, " << rebuilt << " rebuilds" << std::endl;
+	}
+	Bvh::Stats stats = bvh.GetStats();
+	std::cout << stats.refitNodes << " nodes refit, " << stats.subtreeRebuilds << " subtree rebuilds, "
+		<< stats.fullBuilds << " full builds" << std::endl;
+}
 
-class CreateSphereCommand : public ICommand {
-protected:
-	SharedWorld _world;
-	float _radius;
-	SharedFactory _factory;
-public:
-	CreateSphereCommand(SharedWorld& world, float radius) : _world(world), _radius(radius) {}
-	virtual void CommandDo() override {
-		_world->push_back(std::move(_factory->CreateSphere(_radius)));
+// A small sphere every 100km along a 10,000km line. A camera approaches
+// each one over ten frames, aimed at its center from an odd angle, so the
+// exact distance to the hit is known in double. Compares plain float world
+// coordinates with a LargeWorld following the camera.
+void LargeWorldDemo() {
+	std::cout << "** Floating Origin" << std::endl;
+	const float radius = 0.25f;
+	LargeWorld large;
+	SharedWorld naive = std::make_shared<World>();
+	std::vector<DVec3> centers;
+	for (int i = 0; i <= 100; ++i) {
+		DVec3 center(i * 1.0e5 + 0.37, 12.5 + i * 0.011, i * 3.0e4 + 0.61);
+		centers.push_back(center);
+		large.Add(SharedGeomFactory().CreateSphere(radius), center);
+		naive->push_back(SharedGeomFactory().CreateSphere(radius, center.ToVec3()));
 	}
-	virtual void CommandUndo() override {
-		_world->pop_back();
+	Bvh naiveBvh;
+	naiveBvh.Build(naive);
+	double naiveError = 0.0, largeError = 0.0, updateMs = 0.0;
+	size_t frames = 0, naiveMisses = 0, largeMisses = 0;
+	for (const DVec3& center : centers) {
+		for (int step = 0; step < 10; ++step) {
+			DVec3 away = DVec3(-3.3, 1.7, -7.9) * (1.0 + step * 0.2);
+			DVec3 eye = center + away;
+			double length = sqrt(away.x * away.x + away.y * away.y + away.z * away.z);
+			double expected = length - radius;
+			Vec3 direction = (away * (-1.0 / length)).ToVec3();
+			auto begin = std::chrono::steady_clock::now();
+			large.SetFocus(eye);
+			large.Update();
+			updateMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+			Hit hit;
+			if (large.GetBvh().Intersect(Ray(large.ToLocal(eye), direction), hit)) {
+				largeError = std::max(largeError, fabs(hit.t - expected));
+			} else {
+				++largeMisses;
+			}
+			hit = Hit();
+			if (naiveBvh.Intersect(Ray(eye.ToVec3(), direction), hit)) {
+				naiveError = std::max(naiveError, fabs(hit.t - expected));
+			} else {
+				++naiveMisses;
+			}
+			++frames;
+		}
 	}
-};
+	LargeWorld::Stats stats = large.GetStats();
+	std::cout << "Float world: max error " << naiveError << "m, " << naiveMisses << " misses in " << frames << " frames" << std::endl;
+	std::cout << "Large world: max error " << largeError << "m, " << largeMisses << " misses in " << frames << " frames, "
+		<< stats.rebases << " rebases, " << stats.cellBuilds << " cell builds, " << stats.topBuilds << " top builds, "
+		<< updateMs << "ms updating" << std::endl;
+}
 
-SharedWorld CreateWorld(ISceneFactory& factory) {
-	std::cout << "Creating World..." << std::endl;
+// A ground slab with a grid of boxes and spheres, a torus in the middle and
+// one parametric surface.
+SharedWorld CreateDemoScene() {
 	SharedWorld world = std::make_shared<World>();
-	world->push_back(std::move(factory.CreateBox(2.0f, 3.0f, 4.0f)));
-	world->push_back(std::move(factory.CreateSphere(1.0f)));
-	world->push_back(std::move(factory.CreateSphere(2.0f)));
+	world->push_back(SharedGeomFactory().CreateBox(40.0f, 1.0f, 40.0f, Vec3(0.0f, -0.5f, 0.0f)));
+	for (int z = -2; z <= 2; ++z) {
+		for (int x = -2; x <= 2; ++x) {
+			Vec3 center(x * 3.0f, 1.0f, z * 3.0f);
+			if (x == 0 && z == 0) {
+				world->push_back(std::make_shared<Torus>(1.0f, 0.4f, Vec3(0.0f, 0.4f, 0.0f)));
+			} else if (x == 1 && z == -1) {
+				// spherePos from python/module_parametric.py, squashed, through
+				// the Newton intersector.
+				world->push_back(std::make_shared<ParametricSurface>([](float u, float v) {
+					float au = 6.28318531f * u, av = 3.14159265f * v;
+					return Vec3(sinf(av) * cosf(au), 0.6f * cosf(av), sinf(av) * sinf(au));
+				}, Vec3(center.x, 0.6f, center.z)));
+			} else if ((x + z) % 2 == 0) {
+				world->push_back(SharedGeomFactory().CreateSphere(1.0f, center));
+			} else {
+				world->push_back(SharedGeomFactory().CreateBox(1.6f, 2.0f, 1.6f, center));
+			}
+		}
+	}
 	return world;
 }
 
-// Visitor pattern - walk through the objects of the world and call
-// a function on each one.
-void VisitObjects(SharedWorld& world, std::function<void(IObject&)> fn) {
-	for (auto& i : *world) {
-		fn(*i.get());
+// Path trace a small scene progressively. The camera is set again every pass
+// but only moves once, so accumulation restarts exactly once.
+void RenderDemo(const char* path) {
+	std::cout << "** Progressive Render" << std::endl;
+	SharedWorld world = CreateDemoScene();
+	Bvh bvh;
+	bvh.Build(world);
+	ProgressiveRenderer renderer(bvh, 320, 200);
+	Camera camera;
+	camera.position = Vec3(0.0f, 8.0f, -18.0f);
+	camera.target = Vec3(0.0f, 0.5f, 0.0f);
+	for (int pass = 0; pass < 32; ++pass) {
+		if (pass == 8) {
+			camera.position = Vec3(4.0f, 7.0f, -16.0f);
+		}
+		renderer.SetCamera(camera);
+		auto begin = std::chrono::steady_clock::now();
+		renderer.RenderPass(2);
+		double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+		if (pass % 8 == 7) {
+			std::cout << "Pass " << pass << ": " << ms << "ms, " << renderer.SamplesPerPixel() << " spp" << std::endl;
+		}
 	}
+	Image image;
+	renderer.Estimate(image);
+	FileStreamOut out(path);
+	WritePPM(out, image);
+	std::cout << "Image written to " << path << std::endl;
 }
 
-void SaveEverything(SharedWorld& world, IStreamOut& stream) {
-	std::cout << "Serializing objects..." << std::endl;
-	// Using the visitor pattern to serialize objects.
-	// Serialization is a relatively simple case of marching through
-	// objects and calling their serialization methods.
-	VisitObjects(world, [&stream](IObject& obj) {
-		ISerializable* serial = dynamic_cast<ISerializable*>(&obj);
-		if (serial != nullptr) {
-			serial->Save(stream);			
+// Passes writes through, noting when the first tile record starts (the
+// second write, after the stream header).
+class FirstTileClock : public IStreamOut {
+protected:
+	IStreamOut& _inner;
+	size_t _writes;
+public:
+	std::chrono::steady_clock::time_point firstTile;
+	FirstTileClock(IStreamOut& inner) : _inner(inner), _writes(0) {}
+	virtual void WriteBytes(const void* buffer, int count) override {
+		if (++_writes == 2) {
+			firstTile = std::chrono::steady_clock::now();
 		}
-	});
-}
+		_inner.WriteBytes(buffer, count);
+	}
+};
 
-// Save the "world" to different stream out implementors.
-void SaveMethods(SharedWorld& world) {
+// Trace the scene tile by tile straight into a tile stream file, then
+// assemble that into <file>.ppm.
+void TileDemo(const char* path) {
+	std::cout << "** Tile Streaming" << std::endl;
+	SharedWorld world = CreateDemoScene();
+	Bvh bvh;
+	bvh.Build(world);
+	PathTracer tracer(bvh);
+	Camera camera;
+	camera.position = Vec3(0.0f, 8.0f, -18.0f);
+	camera.target = Vec3(0.0f, 0.5f, 0.0f);
+	tracer.SetCamera(camera);
+	const int width = 640, height = 400, tileSize = 32, samples = 8;
 	{
-		Log log;
-		SaveEverything(world, log);
+		FileStreamOut file(path);
+		FirstTileClock clock(file);
+		auto begin = std::chrono::steady_clock::now();
+		TileStreamOut out(clock, width, height);
+		RenderTiles(tracer, out, samples, tileSize);
+		out.Finish();
+		auto end = std::chrono::steady_clock::now();
+		size_t workers = ThreadPool::Shared().Size() + 1;
+		std::cout << out.Tiles() << " tiles, first after " << std::chrono::duration<double, std::milli>(clock.firstTile - begin).count() << "ms, all after "
+			<< std::chrono::duration<double, std::milli>(end - begin).count() << "ms" << std::endl;
+		std::cout << "Pixels held: " << workers * tileSize * tileSize * 3 * sizeof(float) / 1024 << "KB in tiles, against "
+			<< (size_t)width * height * 3 * sizeof(float) / 1024 << "KB for the frame" << std::endl;
 	}
-	{
-		LogTime log;
-		SaveEverything(world, log);
+	FileStreamIn in(path);
+	TileAssembler assembler(in);
+	assembler.ReadAll();
+	std::string imagePath = std::string(path) + ".ppm";
+	FileStreamOut out(imagePath.c_str());
+	WritePPM(out, assembler.GetImage());
+	std::cout << (assembler.Complete() ? "Complete" : "Incomplete") << " image written to " << imagePath << std::endl;
+}
+
+// Rasterize the same scene through each of the standard fragment shaders,
+// one mesh per object so each can have its own color.
+void RasterDemo(const char* prefix) {
+	std::cout << "** Rasterizer" << std::endl;
+	SharedWorld world = CreateDemoScene();
+	std::vector<TriangleMesh> meshes;
+	for (auto& object : *world) {
+		ITessellatable* tessellatable = dynamic_cast<ITessellatable*>(object.get());
+		if (tessellatable != nullptr) {
+			meshes.emplace_back();
+			tessellatable->Tessellate(meshes.back());
+		}
 	}
+	const int width = 640, height = 400;
+	StandardVertexShader vertex;
+	BinnedRasterizer<StandardVertexShader::Varyings> rasterizer;
+	vertex.viewProjection = MatLookAt(Vec3(0.0f, 8.0f, -18.0f), Vec3(0.0f, 0.5f, 0.0f), Vec3(0.0f, 1.0f, 0.0f)) * MatProjection(45.0f, (float)width / height, 0.1f, 100.0f);
+	auto color = [](size_t i) {
+		return Vec3(0.3f + 0.5f * ((i * 37) % 11) / 10.0f, 0.3f + 0.5f * ((i * 53) % 7) / 6.0f, 0.3f + 0.5f * ((i * 71) % 5) / 4.0f);
+	};
+	auto draw = [&](const char* name, auto shade) {
+		Framebuffer target(width, height);
+		target.Clear(Vec3(0.5f, 0.7f, 1.0f));
+		auto begin = std::chrono::steady_clock::now();
+		RasterStats stats;
+		for (size_t i = 0; i < meshes.size(); ++i) {
+			stats += shade(target, meshes[i], color(i));
+		}
+		double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+		std::cout << name << ": " << ms << "ms, " << stats.triangles << " triangles, " << stats.culled << " culled, "
+			<< stats.clipped << " clipped, " << stats.fragments << " fragments" << std::endl;
+		std::string path = std::string(prefix) + "-" + name + ".ppm";
+		FileStreamOut out(path.c_str());
+		WritePPM(out, target.color);
+	};
+	draw("flat", [&](Framebuffer& target, const TriangleMesh& mesh, const Vec3& albedo) {
+		FlatShader fragment;
+		fragment.color = albedo;
+		return rasterizer.Draw(target, mesh, vertex, fragment);
+	});
+	draw("lambert", [&](Framebuffer& target, const TriangleMesh& mesh, const Vec3& albedo) {
+		LambertShader fragment;
+		fragment.albedo = albedo;
+		fragment.light = Normalize(Vec3(0.4f, 1.0f, -0.6f));
+		return rasterizer.Draw(target, mesh, vertex, fragment);
+	});
+	draw("uv", [&](Framebuffer& target, const TriangleMesh& mesh, const Vec3&) {
+		return rasterizer.Draw(target, mesh, vertex, UVDebugShader());
+	});
+	Texture checker = Texture::Checker(256, 8, Vec3(0.9f, 0.9f, 0.9f), Vec3(0.2f, 0.2f, 0.25f));
+	draw("textured", [&](Framebuffer& target, const TriangleMesh& mesh, const Vec3&) {
+		TextureShader fragment;
+		fragment.texture = &checker;
+		// The ground slab is one quad per face, so it needs many more repeats.
+		fragment.repeat = &mesh == &meshes[0] ? 16.0f : 1.0f;
+		fragment.light = Normalize(Vec3(0.4f, 1.0f, -0.6f));
+		return rasterizer.Draw(target, mesh, vertex, fragment);
+	});
+	// The textured pass again, deferred: one G-buffer draw per mesh, then one
+	// shading pass over the screen.
 	{
-		MemoryStream str;
-		SaveEverything(world, str);
-		std::cout << "Buffer contains " << str.size() << " bytes." << std::endl;
+		GBuffer gbuffer(width, height);
+		DeferredShader shader;
+		shader.light = Normalize(Vec3(0.4f, 1.0f, -0.6f));
+		shader.background = Vec3(0.5f, 0.7f, 1.0f);
+		for (size_t i = 0; i < meshes.size(); ++i) {
+			DeferredMaterial material;
+			material.albedo = Vec3(1.0f, 1.0f, 1.0f);
+			material.texture = &checker;
+			material.repeat = i == 0 ? 16.0f : 1.0f;
+			shader.materials.push_back(material);
+		}
+		Framebuffer target(width, height);
+		auto begin = std::chrono::steady_clock::now();
+		gbuffer.Clear();
+		RasterStats stats;
+		for (size_t i = 0; i < meshes.size(); ++i) {
+			GBufferShader fragment;
+			fragment.material = (uint32_t)i;
+			stats += rasterizer.Draw(gbuffer, meshes[i], vertex, fragment);
+		}
+		auto rasterized = std::chrono::steady_clock::now();
+		shader.Shade(gbuffer, target.color);
+		auto end = std::chrono::steady_clock::now();
+		std::cout << "deferred: " << std::chrono::duration<double, std::milli>(rasterized - begin).count() << "ms G-buffer, "
+			<< std::chrono::duration<double, std::milli>(end - rasterized).count() << "ms shading, " << stats.fragments << " fragments, "
+			<< (size_t)gbuffer.quadsX * gbuffer.quadsY * 4 << " pixels shaded" << std::endl;
+		std::string path = std::string(prefix) + "-deferred.ppm";
+		FileStreamOut out(path.c_str());
+		WritePPM(out, target.color);
 	}
+	// The lambert pass again with 4x and 8x MSAA.
+	auto msaa = [&](const char* name, auto& target) {
+		LambertShader fragment;
+		fragment.light = Normalize(Vec3(0.4f, 1.0f, -0.6f));
+		auto begin = std::chrono::steady_clock::now();
+		target.Clear(Vec3(0.5f, 0.7f, 1.0f));
+		RasterStats stats;
+		for (size_t i = 0; i < meshes.size(); ++i) {
+			fragment.albedo = color(i);
+			stats += rasterizer.Draw(target, meshes[i], vertex, fragment);
+		}
+		Image resolved(width, height);
+		target.Resolve(resolved);
+		double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+		std::cout << name << ": " << ms << "ms, " << stats.fragments << " fragments, " << target.ExpandedPixels() << " of "
+			<< width * height << " pixels expanded, " << target.Bytes() / 1024 << "KB" << std::endl;
+		std::string path = std::string(prefix) + "-" + name + ".ppm";
+		FileStreamOut out(path.c_str());
+		WritePPM(out, resolved);
+	};
+	MsaaFramebuffer<4> msaa4(width, height);
+	msaa("msaa4", msaa4);
+	MsaaFramebuffer<8> msaa8(width, height);
+	msaa("msaa8", msaa8);
 }
 
-
 // Main Entrypoint.
+// Pass "--trace <file>" to capture a timeline of the run and "--counters" to
+// report hardware counters for the hot regions. "--allocs" reports allocation
+// statistics when built as geometric-alloc and "--startup" prints the time
+// from process start to the first serialized buffer. "--paged <file>" runs
+// the paged world demo against a snapshot written to that file and
+// "--geometry-cache" runs the tessellation cache demo. "--bvh" animates a
+// world under a refitted BVH and "--large-world" compares float world
+// coordinates with a floating origin 10,000km out. "--render <file>" path traces a small scene
+// and writes the result as a PPM; "--tiles <file>" traces it in tiles
+// streamed to that file as they finish, then assembles <file>.ppm from them.
+// "--direct <file>" saves and loads a large world through O_DIRECT streams
+// and "--shards <dir>" saves and loads it as shards through async streams.
+// "--readahead <file>" loads it cold with and without a read ahead thread.
+// "--raster <prefix>" rasterizes it once per
+// standard shader into <prefix>-<shader>.ppm, plus a textured pass drawn
+// both forward and deferred and the lambert pass with 4x and 8x MSAA.
+
+#include <cstring>
+#include <fstream>
 
 int main(int argc, const char** argv) {
+	STARTUP_MARK("main");
+	const char* tracePath = nullptr;
+	bool counters = false;
+	bool allocs = false;
+	bool startup = false;
+	const char* pagedPath = nullptr;
+	bool geometryCache = false;
+	bool bvh = false;
+	bool largeWorld = false;
+	const char* renderPath = nullptr;
+	const char* tilesPath = nullptr;
+	const char* directPath = nullptr;
+	const char* shardDirectory = nullptr;
+	const char* readAheadPath = nullptr;
+	const char* rasterPrefix = nullptr;
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+			tracePath = argv[++i];
+		} else if (strcmp(argv[i], "--counters") == 0) {
+			counters = true;
+		} else if (strcmp(argv[i], "--allocs") == 0) {
+			allocs = true;
+		} else if (strcmp(argv[i], "--startup") == 0) {
+			startup = true;
+		} else if (strcmp(argv[i], "--paged") == 0 && i + 1 < argc) {
+			pagedPath = argv[++i];
+		} else if (strcmp(argv[i], "--geometry-cache") == 0) {
+			geometryCache = true;
+		} else if (strcmp(argv[i], "--bvh") == 0) {
+			bvh = true;
+		} else if (strcmp(argv[i], "--large-world") == 0) {
+			largeWorld = true;
+		} else if (strcmp(argv[i], "--render") == 0 && i + 1 < argc) {
+			renderPath = argv[++i];
+		} else if (strcmp(argv[i], "--tiles") == 0 && i + 1 < argc) {
+			tilesPath = argv[++i];
+		} else if (strcmp(argv[i], "--direct") == 0 && i + 1 < argc) {
+			directPath = argv[++i];
+		} else if (strcmp(argv[i], "--shards") == 0 && i + 1 < argc) {
+			shardDirectory = argv[++i];
+		} else if (strcmp(argv[i], "--readahead") == 0 && i + 1 < argc) {
+			readAheadPath = argv[++i];
+		} else if (strcmp(argv[i], "--raster") == 0 && i + 1 < argc) {
+			rasterPrefix = argv[++i];
+		}
+	}
+	Profiler::Instance().Enable(tracePath != nullptr);
+	PerfCounters::Instance().Enable(counters);
 	{
 		std::cout << "** Using Geometry Factory" << std::endl;
-		GeomFactory factory;
-		SharedWorld world = CreateWorld(factory);
+		SharedWorld world = CreateWorld(SharedGeomFactory());
 		SaveMethods(world);
+		STARTUP_MARK("first-result");
 	}
+	AllocTracker::FrameMark();
 	{
 		std::cout << "** Using Mesh Factory" << std::endl;
-		MeshFactory factory;
-		SharedWorld world = CreateWorld(factory);
+		SharedWorld world = CreateWorld(SharedMeshFactory());
 		SaveMethods(world);
 	}
+	AllocTracker::FrameMark();
+	if (pagedPath != nullptr) {
+		PagedDemo(pagedPath);
+	}
+	if (geometryCache) {
+		GeometryCacheDemo();
+	}
+	if (bvh) {
+		BvhDemo();
+	}
+	if (largeWorld) {
+		LargeWorldDemo();
+	}
+	if (renderPath != nullptr) {
+		RenderDemo(renderPath);
+	}
+	if (tilesPath != nullptr) {
+		TileDemo(tilesPath);
+	}
+	if (directPath != nullptr) {
+		DirectDemo(directPath);
+	}
+	if (shardDirectory != nullptr) {
+		ShardDemo(shardDirectory);
+	}
+	if (readAheadPath != nullptr) {
+		ReadAheadDemo(readAheadPath);
+	}
+	if (rasterPrefix != nullptr) {
+		RasterDemo(rasterPrefix);
+	}
+	if (tracePath != nullptr) {
+		std::ofstream trace(tracePath);
+		Profiler::Instance().WriteChromeTrace(trace);
+		std::cout << "Trace written to " << tracePath << std::endl;
+	}
+	if (counters) {
+		PerfCounters::Instance().Report(std::cout);
+	}
+	if (startup) {
+		StartupTimeline::Instance().Report(std::cout);
+	}
+	if (allocs) {
+		AllocTracker::Report(std::cout);
+	}
 	return 0;
-}
\ No newline at end of file
+}
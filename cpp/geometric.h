@@ -0,0 +1,663 @@
+#pragma once
+
+#include "alloctrack.h"
+#include "linalg.h"
+#include "perfcounters.h"
+#include "profiler.h"
+#include "ray.h"
+#include "startup.h"
+#include "tessellate.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Classic Streaming Interfaces.
+///////////////////////////////////////////////////////////////////////////////
+
+class IStreamIn {
+public:
+	virtual ~IStreamIn() {}
+	virtual void ReadBytes(void* buffer, int count) = 0;
+};
+
+class IStreamOut {
+public:
+	virtual ~IStreamOut() {}
+	virtual void WriteBytes(const void* buffer, int count) = 0;
+};
+
+// Output streams that can go back and fill in bytes they have already
+// written past, such as a length that isn't known until its payload has been
+// written. Optional: writers discover it with a dynamic_cast, the same way
+// spatial code discovers IBounded, and fall back to buffering without it.
+class ISeekableStreamOut {
+public:
+	virtual ~ISeekableStreamOut() {}
+	// Bytes written so far.
+	virtual uint64_t Position() const = 0;
+	// Writes count zero bytes to be patched later, returning where they went.
+	virtual uint64_t ReserveSlot(int count) = 0;
+	// Overwrites bytes at slot, which must lie within what has been written.
+	// Later writes still append.
+	virtual void PatchSlot(uint64_t slot, const void* buffer, int count) = 0;
+};
+
+class ISerializable {
+public:
+	virtual ~ISerializable() {}
+	virtual void Load(IStreamIn& stream) = 0;
+	virtual void Save(IStreamOut& stream) = 0;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Output Stream Implementors.
+//
+// Streaming interfaces are common and can be overridden to perform all kinds
+// of interesting behaviors. The obvious use is to provide streaming outputs to
+// network sockets, files, or memory buffers - this also makes them Adaptors in
+// design pattern parlance.
+///////////////////////////////////////////////////////////////////////////////
+
+#include <cstdint>
+#include <iostream>
+
+class Log : public IStreamOut {
+public:
+	Log() {
+		std::cout << "[Opening Log]" << std::endl;
+	}
+	virtual ~Log() {
+		std::cout << std::endl << "[Closing Log]" << std::endl;
+	}
+	virtual void WriteBytes(const void* buffer, int count) {
+		for (int i = 0; i < count; ++i) {
+			std::cout << " " << ((const uint8_t*)buffer)[i];
+		}
+	}
+};
+
+#include <ctime>
+
+class LogTime : public IStreamOut {
+public:
+	LogTime() {
+		std::cout << "[Opening Timestamped Log]" << std::endl;
+	}
+	virtual ~LogTime() {
+		std::cout << "[Closing Timestamped Log]" << std::endl;
+	}
+	virtual void WriteBytes(const void* buffer, int count) {
+		time_t t;
+		time(&t);
+		std::cout << "[" << t << "]";
+		for (int i = 0; i < count; ++i) {
+			std::cout << " " << ((const uint8_t*)buffer)[i];
+		}
+		std::cout << std::endl;
+	}
+};
+
+#include <vector>
+
+class MemoryStream : public IStreamOut, public ISeekableStreamOut {
+protected:
+	std::vector<uint8_t> _memory;
+public:
+	virtual void WriteBytes(const void* buffer, int count) {
+		ALLOC_TAG("MemoryStream");
+		for (int i = 0; i < count; ++i) {
+			_memory.push_back(((const uint8_t*)buffer)[i]);
+		}
+	}
+	virtual uint64_t Position() const override {
+		return _memory.size();
+	}
+	virtual uint64_t ReserveSlot(int count) override {
+		ALLOC_TAG("MemoryStream");
+		uint64_t slot = _memory.size();
+		_memory.resize(_memory.size() + count);
+		return slot;
+	}
+	virtual void PatchSlot(uint64_t slot, const void* buffer, int count) override;
+	uint32_t size() const {
+		return _memory.size();
+	}
+	const uint8_t* data() const {
+		return _memory.data();
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Input Stream Implementors.
+//
+// Inputs have to be able to fail: a short file or a truncated buffer throws
+// a StreamException rather than handing back garbage.
+///////////////////////////////////////////////////////////////////////////////
+
+#include <exception>
+
+class StreamException : public std::exception {
+protected:
+	const char* _what;
+public:
+	StreamException(const char* what) : _what(what) {}
+	virtual const char* what() const noexcept override {
+		return _what;
+	}
+};
+
+class MemoryStreamIn : public IStreamIn {
+protected:
+	const uint8_t* _data;
+	size_t _size;
+	size_t _position;
+public:
+	MemoryStreamIn(const void* data, size_t size) : _data((const uint8_t*)data), _size(size), _position(0) {}
+	virtual void ReadBytes(void* buffer, int count) override {
+		if (count < 0 || _size - _position < (size_t)count) {
+			throw StreamException("Read past end of memory stream");
+		}
+		memcpy(buffer, _data + _position, count);
+		_position += count;
+	}
+	bool AtEnd() const {
+		return _position == _size;
+	}
+};
+
+#include <cstdio>
+
+// MemoryStream::PatchSlot needs StreamException.
+inline void MemoryStream::PatchSlot(uint64_t slot, const void* buffer, int count) {
+	if (count < 0 || slot > _memory.size() || _memory.size() - slot < (size_t)count) {
+		throw StreamException("Patch outside memory stream");
+	}
+	memcpy(_memory.data() + slot, buffer, count);
+}
+
+class FileStreamOut : public IStreamOut, public ISeekableStreamOut {
+protected:
+	FILE* _file;
+	uint64_t _position;
+public:
+	FileStreamOut(const char* path) : _file(fopen(path, "wb")), _position(0) {
+		if (_file == nullptr) {
+			throw StreamException("Cannot open file for writing");
+		}
+	}
+	virtual ~FileStreamOut() {
+		fclose(_file);
+	}
+	virtual void WriteBytes(const void* buffer, int count) override {
+		if (fwrite(buffer, 1, count, _file) != (size_t)count) {
+			throw StreamException("Short write to file");
+		}
+		_position += count;
+	}
+	virtual uint64_t Position() const override {
+		return _position;
+	}
+	virtual uint64_t ReserveSlot(int count) override {
+		uint64_t slot = _position;
+		uint8_t zeros[256] = {};
+		for (int left = count; left > 0; left -= (int)sizeof(zeros)) {
+			WriteBytes(zeros, std::min(left, (int)sizeof(zeros)));
+		}
+		return slot;
+	}
+	// Seeks back within stdio's buffer or the file, then to the end again.
+	virtual void PatchSlot(uint64_t slot, const void* buffer, int count) override {
+		if (count < 0 || slot > _position || _position - slot < (uint64_t)count) {
+			throw StreamException("Patch outside file");
+		}
+		if (fseeko(_file, (off_t)slot, SEEK_SET) != 0 || fwrite(buffer, 1, count, _file) != (size_t)count || fseeko(_file, (off_t)_position, SEEK_SET) != 0) {
+			throw StreamException("Cannot patch file");
+		}
+	}
+};
+
+class FileStreamIn : public IStreamIn {
+protected:
+	FILE* _file;
+public:
+	FileStreamIn(const char* path) : _file(fopen(path, "rb")) {
+		if (_file == nullptr) {
+			throw StreamException("Cannot open file for reading");
+		}
+	}
+	virtual ~FileStreamIn() {
+		fclose(_file);
+	}
+	virtual void ReadBytes(void* buffer, int count) override {
+		if (fread(buffer, 1, count, _file) != (size_t)count) {
+			throw StreamException("Short read from file");
+		}
+	}
+	void Seek(uint64_t offset) {
+		if (fseeko(_file, (off_t)offset, SEEK_SET) != 0) {
+			throw StreamException("Cannot seek in file");
+		}
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Standard Geometrics.
+//
+// This is a rudimentary world setup intended only to demonstrate a usage of
+// concepts.
+///////////////////////////////////////////////////////////////////////////////
+
+#include <cmath>
+#include <cstring>
+#include <memory>
+
+class NotImplementedException : public std::exception {
+};
+
+// Tagging Interface
+// Doesn't do anything except declare an object.
+
+class IObject {
+public:
+	virtual ~IObject() {}
+};
+
+// Objects that occupy space in the world. Anything spatial (partitioning,
+// culling, sorting) discovers this with a dynamic_cast, the same way the
+// serializer discovers ISerializable.
+
+class IBounded {
+public:
+	virtual ~IBounded() {}
+	virtual Bounds GetBounds() const = 0;
+};
+
+// Objects that can be moved after creation.
+
+class ITranslatable {
+public:
+	virtual ~ITranslatable() {}
+	virtual void Translate(const Vec3& offset) = 0;
+};
+
+class Box : public IObject, public IBounded, public ITranslatable, public ITessellatable, public IIntersectable, public ISerializable {
+protected:
+	float _x, _y, _z;
+	Vec3 _center;
+public:
+	Box() : Box(0.0f, 0.0f, 0.0f) {}
+	Box(float x, float y, float z, const Vec3& center = Vec3()) : _x(x), _y(y), _z(z), _center(center) {}
+	virtual Bounds GetBounds() const override {
+		Vec3 half(_x * 0.5f, _y * 0.5f, _z * 0.5f);
+		return Bounds(_center - half, _center + half);
+	}
+	virtual void Translate(const Vec3& offset) override {
+		_center += offset;
+	}
+	virtual void Tessellate(TriangleMesh& mesh) const override {
+		TessellateBox(mesh, _x, _y, _z, _center);
+	}
+	virtual bool Intersect(const Ray& ray, Hit& hit) const override {
+		return IntersectBox(GetBounds(), ray, hit);
+	}
+	// Load picks up after the tag; see LoadObject.
+	virtual void Load(IStreamIn& stream) override {
+		stream.ReadBytes(&_x, sizeof(_x));
+		stream.ReadBytes(&_y, sizeof(_y));
+		stream.ReadBytes(&_z, sizeof(_z));
+		stream.ReadBytes(&_center, sizeof(_center));
+	}
+	virtual void Save(IStreamOut& stream) override {
+		stream.WriteBytes("Box", 3);
+		stream.WriteBytes(&_x, sizeof(_x));
+		stream.WriteBytes(&_y, sizeof(_y));
+		stream.WriteBytes(&_z, sizeof(_z));
+		stream.WriteBytes(&_center, sizeof(_center));
+	}
+};
+
+class Sphere : public IObject, public IBounded, public ITranslatable, public ITessellatable, public IIntersectable, public ISerializable {
+protected:
+	float _radius;
+	Vec3 _center;
+public:
+	Sphere() : Sphere(0.0f) {}
+	Sphere(float radius, const Vec3& center = Vec3()) : _radius(radius), _center(center) {}
+	virtual Bounds GetBounds() const override {
+		Vec3 half(_radius, _radius, _radius);
+		return Bounds(_center - half, _center + half);
+	}
+	virtual void Translate(const Vec3& offset) override {
+		_center += offset;
+	}
+	virtual void Tessellate(TriangleMesh& mesh) const override {
+		TessellateSphere(mesh, _radius, _center);
+	}
+	virtual bool Intersect(const Ray& ray, Hit& hit) const override {
+		return IntersectSphere(_center, _radius, ray, hit);
+	}
+	virtual void Load(IStreamIn& stream) override {
+		stream.ReadBytes(&_radius, sizeof(_radius));
+		stream.ReadBytes(&_center, sizeof(_center));
+	}
+	virtual void Save(IStreamOut& stream) override {
+		stream.WriteBytes("Sphere", 6);
+		stream.WriteBytes(&_radius, sizeof(_radius));
+		stream.WriteBytes(&_center, sizeof(_center));
+	}
+};
+
+class Torus : public IObject, public IBounded, public ITranslatable, public ITessellatable, public IIntersectable, public ISerializable {
+protected:
+	float _major, _minor;
+	Vec3 _center;
+public:
+	Torus() : Torus(0.0f, 0.0f) {}
+	Torus(float major, float minor, const Vec3& center = Vec3()) : _major(major), _minor(minor), _center(center) {}
+	virtual Bounds GetBounds() const override {
+		Vec3 half(_major + _minor, _minor, _major + _minor);
+		return Bounds(_center - half, _center + half);
+	}
+	virtual void Translate(const Vec3& offset) override {
+		_center += offset;
+	}
+	virtual void Tessellate(TriangleMesh& mesh) const override {
+		TessellateTorus(mesh, _major, _minor, _center);
+	}
+	virtual bool Intersect(const Ray& ray, Hit& hit) const override {
+		return IntersectTorus(_center, _major, _minor, ray, hit);
+	}
+	virtual void Load(IStreamIn& stream) override {
+		stream.ReadBytes(&_major, sizeof(_major));
+		stream.ReadBytes(&_minor, sizeof(_minor));
+		stream.ReadBytes(&_center, sizeof(_center));
+	}
+	virtual void Save(IStreamOut& stream) override {
+		stream.WriteBytes("Torus", 5);
+		stream.WriteBytes(&_major, sizeof(_major));
+		stream.WriteBytes(&_minor, sizeof(_minor));
+		stream.WriteBytes(&_center, sizeof(_center));
+	}
+};
+
+class Mesh : public IObject, public IBounded, public ITranslatable, public ISerializable {
+protected:
+	int _vertices, _triangles;
+	Bounds _bounds;
+public:
+	Mesh() : Mesh(0, 0) {}
+	Mesh(int vertices, int triangles, const Bounds& bounds = Bounds()) : _vertices(vertices), _triangles(triangles), _bounds(bounds) {
+	}
+	virtual Bounds GetBounds() const override {
+		return _bounds;
+	}
+	virtual void Translate(const Vec3& offset) override {
+		_bounds.min += offset;
+		_bounds.max += offset;
+	}
+	virtual void Load(IStreamIn& stream) override {
+		stream.ReadBytes(&_vertices, sizeof(_vertices));
+		stream.ReadBytes(&_triangles, sizeof(_triangles));
+		stream.ReadBytes(&_bounds, sizeof(_bounds));
+	}
+	virtual void Save(IStreamOut& stream) override {
+		stream.WriteBytes("Mesh", 4);
+		stream.WriteBytes(&_vertices, sizeof(_vertices));
+		stream.WriteBytes(&_triangles, sizeof(_triangles));
+		stream.WriteBytes(&_bounds, sizeof(_bounds));
+	}
+};
+
+// Reads back one object written by Save. The tags aren't length prefixed,
+// but their first letters are unique, which is enough to dispatch on.
+inline std::unique_ptr<IObject> LoadObject(IStreamIn& stream) {
+	char tag[8] = {};
+	stream.ReadBytes(tag, 1);
+	std::unique_ptr<IObject> object;
+	const char* expected = nullptr;
+	if (tag[0] == 'B') {
+		object = std::make_unique<Box>();
+		expected = "Box";
+	} else if (tag[0] == 'S') {
+		object = std::make_unique<Sphere>();
+		expected = "Sphere";
+	} else if (tag[0] == 'T') {
+		object = std::make_unique<Torus>();
+		expected = "Torus";
+	} else if (tag[0] == 'M') {
+		object = std::make_unique<Mesh>();
+		expected = "Mesh";
+	} else {
+		throw StreamException("Unknown object tag");
+	}
+	int length = (int)strlen(expected);
+	stream.ReadBytes(tag + 1, length - 1);
+	if (memcmp(tag, expected, length) != 0) {
+		throw StreamException("Corrupt object tag");
+	}
+	dynamic_cast<ISerializable*>(object.get())->Load(stream);
+	return object;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Geometric Factory.
+//
+// We use a factory pattern to create the world either as parametric/geometric
+// objects or as mesh data. This is a basic example of an abstract factory.
+///////////////////////////////////////////////////////////////////////////////
+
+class ISceneFactory {
+public:
+	virtual ~ISceneFactory() {}
+	virtual std::unique_ptr<IObject> CreateBox(float x, float y, float z, const Vec3& center = Vec3()) = 0;
+	virtual std::unique_ptr<IObject> CreateSphere(float radius, const Vec3& center = Vec3()) = 0;
+};
+
+// Geometrics are parametric objects that cannot be directly renderered
+// (except via raytracers) as they are not b-reps.
+class GeomFactory : public ISceneFactory {
+public:
+	virtual std::unique_ptr<IObject> CreateBox(float x, float y, float z, const Vec3& center = Vec3()) override {
+		PROFILE_ZONE("GeomFactory::CreateBox");
+		ALLOC_TAG("Factory");
+		return std::make_unique<Box>(x, y, z, center);
+	}
+	virtual std::unique_ptr<IObject> CreateSphere(float radius, const Vec3& center = Vec3()) override {
+		PROFILE_ZONE("GeomFactory::CreateSphere");
+		ALLOC_TAG("Factory");
+		return std::make_unique<Sphere>(radius, center);
+	}
+};
+
+// The MeshFactory is a stand-in for mesh data but it doesn't actually
+// create any triangle meshes (yet).
+class MeshFactory : public ISceneFactory {
+public:
+	virtual std::unique_ptr<IObject> CreateBox(float x, float y, float z, const Vec3& center = Vec3()) override {
+		PROFILE_ZONE("MeshFactory::CreateBox");
+		ALLOC_TAG("Factory");
+		Vec3 half(x * 0.5f, y * 0.5f, z * 0.5f);
+		return std::make_unique<Mesh>(8, 12, Bounds(center - half, center + half));
+	}
+	virtual std::unique_ptr<IObject> CreateSphere(float radius, const Vec3& center = Vec3()) override {
+		PROFILE_ZONE("MeshFactory::CreateSphere");
+		ALLOC_TAG("Factory");
+		const TessellationTable& table = SphereTessellation();
+		Vec3 half(radius, radius, radius);
+		return std::make_unique<Mesh>(table.Vertices(), table.Triangles(), Bounds(center - half, center + half));
+	}
+};
+
+// Factories are stateless today but are the natural home for pools and
+// caches, so processes get at them through lazily built shared instances.
+inline ISceneFactory& SharedGeomFactory() {
+	static Lazy<GeomFactory> factory("GeomFactory");
+	return factory.Get();
+}
+
+inline ISceneFactory& SharedMeshFactory() {
+	static Lazy<MeshFactory> factory("MeshFactory");
+	return factory.Get();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Command Pattern.
+//
+// This is a very naive implementation of a command pattern that supports undo
+// (as long as the commands are maintained in a second list).
+//////////////////////////////////////////////////////////////////////////////
+
+class ICommand {
+public:
+	virtual ~ICommand() {}
+	virtual void CommandDo() = 0;
+	virtual void CommandUndo() = 0;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// World.
+///////////////////////////////////////////////////////////////////////////////
+
+// Simple strategy to save everything in the world.
+// This corresponds to a visitor pattern.
+
+#include <functional>
+
+template <class T> using Array = std::vector<T>;
+
+using SharedFactory = std::shared_ptr<ISceneFactory>;
+
+using SharedObject = std::shared_ptr<IObject>;
+using World = Array<SharedObject>;
+using SharedWorld = std::shared_ptr<World>;
+
+using SharedCommand = std::shared_ptr<ICommand>;
+using Commands = Array<SharedCommand>;
+using SharedCommands = std::shared_ptr<Commands>;
+
+///////////////////////////////////////////////////////////////////////////////
+// This is a command pattern.
+///////////////////////////////////////////////////////////////////////////////
+
+class CreateBoxCommand : public ICommand {
+protected:
+	SharedWorld _world;
+	float _x, _y, _z;
+	SharedFactory _factory;
+public:
+	CreateBoxCommand(SharedWorld& world, float x, float y, float z) : _world(world), _x(x), _y(y), _z(z) {}
+	virtual void CommandDo() override {
+		PROFILE_ZONE("CreateBoxCommand::CommandDo");
+		_world->push_back(std::move(_factory->CreateBox(_x, _y, _z)));
+	}
+	virtual void CommandUndo() override {
+		PROFILE_ZONE("CreateBoxCommand::CommandUndo");
+		_world->pop_back();
+	}
+};
+
+class CreateSphereCommand : public ICommand {
+protected:
+	SharedWorld _world;
+	float _radius;
+	SharedFactory _factory;
+public:
+	CreateSphereCommand(SharedWorld& world, float radius) : _world(world), _radius(radius) {}
+	virtual void CommandDo() override {
+		PROFILE_ZONE("CreateSphereCommand::CommandDo");
+		_world->push_back(std::move(_factory->CreateSphere(_radius)));
+	}
+	virtual void CommandUndo() override {
+		PROFILE_ZONE("CreateSphereCommand::CommandUndo");
+		_world->pop_back();
+	}
+};
+
+inline SharedWorld CreateWorld(ISceneFactory& factory) {
+	PROFILE_ZONE("CreateWorld");
+	ALLOC_TAG("World");
+	std::cout << "Creating World..." << std::endl;
+	SharedWorld world = std::make_shared<World>();
+	world->push_back(std::move(factory.CreateBox(2.0f, 3.0f, 4.0f)));
+	world->push_back(std::move(factory.CreateSphere(1.0f)));
+	world->push_back(std::move(factory.CreateSphere(2.0f)));
+	return world;
+}
+
+// Visitor pattern - walk through the objects of the world and call
+// a function on each one.
+inline void VisitObjects(SharedWorld& world, std::function<void(IObject&)> fn) {
+	PROFILE_ZONE("VisitObjects");
+	PerfRegion counters("VisitObjects", world->size());
+	for (auto& i : *world) {
+		fn(*i.get());
+	}
+}
+
+#if !defined(__GNUC__) && !defined(__clang__) && defined(_MSC_VER)
+#include <xmmintrin.h>
+#endif
+
+inline void Prefetch(const void* address) {
+#if defined(__GNUC__) || defined(__clang__)
+	__builtin_prefetch(address);
+#elif defined(_MSC_VER)
+	_mm_prefetch((const char*)address, _MM_HINT_T0);
+#endif
+}
+
+// Batched visitor. Every object lives in its own heap block, so walking the
+// world is a chain of dependent misses the hardware prefetcher can't see
+// coming. Here we gather raw pointers a block at a time, prefetching each
+// object prefetchDistance entries before it is reached, and hand the block
+// to the callback in one call, which also amortizes the std::function hop.
+// Prefetching is off by default: the VisitBatched benches measure no gain
+// from it here, so it is left for callers that can show one.
+struct VisitBatchOptions {
+	size_t blockSize = 64;
+	size_t prefetchDistance = 0;
+};
+
+inline void VisitObjectBatches(SharedWorld& world, std::function<void(IObject* const* objects, size_t count)> fn, const VisitBatchOptions& options = VisitBatchOptions()) {
+	PROFILE_ZONE("VisitObjectBatches");
+	PerfRegion counters("VisitObjectBatches", world->size());
+	const size_t blockSize = std::max<size_t>(options.blockSize, 1);
+	const size_t distance = options.prefetchDistance;
+	const size_t count = world->size();
+	const SharedObject* objects = world->data();
+	std::vector<IObject*> block(blockSize);
+	for (size_t i = 0; i < distance && i < count; ++i) {
+		Prefetch(objects[i].get());
+	}
+	for (size_t first = 0; first < count; first += blockSize) {
+		size_t n = std::min(blockSize, count - first);
+		for (size_t j = 0; j < n; ++j) {
+			size_t ahead = first + j + distance;
+			if (ahead < count) {
+				Prefetch(objects[ahead].get());
+			}
+			block[j] = objects[first + j].get();
+		}
+		fn(block.data(), n);
+	}
+}
+
+// Using the visitor pattern to serialize objects.
+// Serialization is a relatively simple case of marching through
+// objects and calling their serialization methods.
+inline void SaveObjects(SharedWorld& world, IStreamOut& stream) {
+	VisitObjectBatches(world, [&stream](IObject* const* objects, size_t count) {
+		for (size_t i = 0; i < count; ++i) {
+			ISerializable* serial = dynamic_cast<ISerializable*>(objects[i]);
+			if (serial != nullptr) {
+				serial->Save(stream);
+			}
+		}
+	});
+}
+
+inline void SaveEverything(SharedWorld& world, IStreamOut& stream) {
+	PROFILE_ZONE("SaveEverything");
+	ALLOC_TAG("Serializer");
+	PerfRegion counters("SaveEverything", world->size());
+	std::cout << "Serializing objects..." << std::endl;
+	SaveObjects(world, stream);
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+///////////////////////////////////////////////////////////////////////////////
+// Geometry Cache.
+//
+// Tessellated triangles are big and the analytic parameters they came from
+// are tiny, so we treat triangles as a cache. The cache holds tessellations
+// for objects up to a byte budget, dropping the least recently used ones
+// when it goes over; a later request simply tessellates again.
+//
+// Entries are handed out as shared pointers. Evicting an entry drops the
+// cache's reference only, so a caller that is still drawing a mesh keeps it
+// alive until it lets go.
+///////////////////////////////////////////////////////////////////////////////
+
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+#include "geometric.h"
+
+using SharedTriangleMesh = std::shared_ptr<const TriangleMesh>;
+
+class GeometryCache {
+public:
+	struct Stats {
+		uint64_t hits = 0;
+		uint64_t misses = 0;
+		uint64_t evictions = 0;
+		uint64_t residentBytes = 0;
+		uint64_t peakBytes = 0;
+		size_t entries = 0;
+	};
+protected:
+	struct Entry {
+		const IObject* key;
+		// Lets us notice that the object died and its address was reused.
+		std::weak_ptr<IObject> owner;
+		SharedTriangleMesh mesh;
+		size_t bytes;
+	};
+	using Lru = std::list<Entry>;
+	uint64_t _budget;
+	std::mutex _mutex;
+	Lru _lru;
+	std::unordered_map<const IObject*, Lru::iterator> _index;
+	Stats _stats;
+
+	void EvictLocked() {
+		// Never evict the entry we just touched, even if it alone is over
+		// budget; the caller needs it.
+		while (_stats.residentBytes > _budget && _lru.size() > 1) {
+			Entry& victim = _lru.back();
+			_stats.residentBytes -= victim.bytes;
+			_index.erase(victim.key);
+			_lru.pop_back();
+			++_stats.evictions;
+		}
+		_stats.entries = _lru.size();
+	}
+	void RemoveLocked(const IObject* key) {
+		auto found = _index.find(key);
+		if (found != _index.end()) {
+			_stats.residentBytes -= found->second->bytes;
+			_lru.erase(found->second);
+			_index.erase(found);
+			_stats.entries = _lru.size();
+		}
+	}
+public:
+	GeometryCache(uint64_t budgetBytes) : _budget(budgetBytes) {}
+	// Returns the tessellation for the object, or null if the object cannot
+	// be tessellated. Misses tessellate outside the lock.
+	SharedTriangleMesh Acquire(const SharedObject& object) {
+		const ITessellatable* source = dynamic_cast<const ITessellatable*>(object.get());
+		if (source == nullptr) {
+			return nullptr;
+		}
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			auto found = _index.find(object.get());
+			if (found != _index.end()) {
+				if (found->second->owner.lock() == object) {
+					_lru.splice(_lru.begin(), _lru, found->second);
+					++_stats.hits;
+					return found->second->mesh;
+				}
+				RemoveLocked(object.get());
+			}
+			++_stats.misses;
+		}
+		PROFILE_ZONE("GeometryCache::Tessellate");
+		auto mesh = std::make_shared<TriangleMesh>();
+		source->Tessellate(*mesh);
+		size_t bytes = mesh->Bytes();
+		std::lock_guard<std::mutex> lock(_mutex);
+		// Someone may have raced us to it; keep theirs.
+		auto found = _index.find(object.get());
+		if (found != _index.end() && found->second->owner.lock() == object) {
+			_lru.splice(_lru.begin(), _lru, found->second);
+			return found->second->mesh;
+		}
+		RemoveLocked(object.get());
+		_lru.push_front({ object.get(), object, mesh, bytes });
+		_index[object.get()] = _lru.begin();
+		_stats.residentBytes += bytes;
+		EvictLocked();
+		_stats.peakBytes = std::max(_stats.peakBytes, _stats.residentBytes);
+		return mesh;
+	}
+	// Drop an object's tessellation, e.g. after its parameters change.
+	void Invalidate(const IObject& object) {
+		std::lock_guard<std::mutex> lock(_mutex);
+		RemoveLocked(&object);
+	}
+	void SetBudget(uint64_t budgetBytes) {
+		std::lock_guard<std::mutex> lock(_mutex);
+		_budget = budgetBytes;
+		EvictLocked();
+	}
+	Stats GetStats() {
+		std::lock_guard<std::mutex> lock(_mutex);
+		return _stats;
+	}
+};
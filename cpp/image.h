@@ -0,0 +1,47 @@
+#pragma once
+
+///////////////////////////////////////////////////////////////////////////////
+// Images.
+//
+// Linear floating point RGB, written out through any IStreamOut as a binary
+// PPM with a 2.2 gamma. PPM is the least possible work to get pixels into a
+// file that every viewer understands.
+///////////////////////////////////////////////////////////////////////////////
+
+#include <cmath>
+#include <string>
+#include <vector>
+
+#include "geometric.h"
+
+struct Image {
+	int width = 0;
+	int height = 0;
+	std::vector<float> rgb;
+	Image() {}
+	Image(int width, int height) : width(width), height(height), rgb((size_t)width * height * 3, 0.0f) {}
+	float* Pixel(int x, int y) {
+		return &rgb[((size_t)y * width + x) * 3];
+	}
+	const float* Pixel(int x, int y) const {
+		return &rgb[((size_t)y * width + x) * 3];
+	}
+};
+
+inline uint8_t EncodeSrgb8(float linear) {
+	float clamped = linear < 0.0f ? 0.0f : linear > 1.0f ? 1.0f : linear;
+	return (uint8_t)(powf(clamped, 1.0f / 2.2f) * 255.0f + 0.5f);
+}
+
+inline void WritePPM(IStreamOut& stream, const Image& image) {
+	std::string header = "P6\n" + std::to_string(image.width) + " " + std::to_string(image.height) + "\n255\n";
+	stream.WriteBytes(header.data(), (int)header.size());
+	std::vector<uint8_t> row((size_t)image.width * 3);
+	for (int y = 0; y < image.height; ++y) {
+		const float* pixels = image.Pixel(0, y);
+		for (size_t i = 0; i < row.size(); ++i) {
+			row[i] = EncodeSrgb8(pixels[i]);
+		}
+		stream.WriteBytes(row.data(), (int)row.size());
+	}
+}
@@ -0,0 +1,174 @@
+#pragma once
+
+///////////////////////////////////////////////////////////////////////////////
+// Linear Algebra.
+//
+// Just enough vector math for placing and bounding objects. Kept as plain
+// value types so they serialize by memcpy.
+///////////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+struct Vec3 {
+	float x, y, z;
+	Vec3() : x(0.0f), y(0.0f), z(0.0f) {}
+	Vec3(float x, float y, float z) : x(x), y(y), z(z) {}
+	Vec3 operator+(const Vec3& v) const { return Vec3(x + v.x, y + v.y, z + v.z); }
+	Vec3 operator-(const Vec3& v) const { return Vec3(x - v.x, y - v.y, z - v.z); }
+	Vec3 operator*(float s) const { return Vec3(x * s, y * s, z * s); }
+	Vec3 operator-() const { return Vec3(-x, -y, -z); }
+	Vec3& operator+=(const Vec3& v) { x += v.x; y += v.y; z += v.z; return *this; }
+	float operator[](int i) const { return i == 0 ? x : i == 1 ? y : z; }
+	bool operator==(const Vec3& v) const { return x == v.x && y == v.y && z == v.z; }
+	bool operator!=(const Vec3& v) const { return !(*this == v); }
+};
+
+// Double precision position, for placing things in worlds too big for float
+// to address to the nearest millimetre. Only converted to Vec3 once it has
+// been made relative to something nearby; see floatingorigin.h.
+struct DVec3 {
+	double x, y, z;
+	DVec3() : x(0.0), y(0.0), z(0.0) {}
+	DVec3(double x, double y, double z) : x(x), y(y), z(z) {}
+	explicit DVec3(const Vec3& v) : x(v.x), y(v.y), z(v.z) {}
+	DVec3 operator+(const DVec3& v) const { return DVec3(x + v.x, y + v.y, z + v.z); }
+	DVec3 operator-(const DVec3& v) const { return DVec3(x - v.x, y - v.y, z - v.z); }
+	DVec3 operator*(double s) const { return DVec3(x * s, y * s, z * s); }
+	Vec3 ToVec3() const { return Vec3((float)x, (float)y, (float)z); }
+};
+
+// Componentwise product, for colors.
+inline Vec3 Mul(const Vec3& a, const Vec3& b) {
+	return Vec3(a.x * b.x, a.y * b.y, a.z * b.z);
+}
+
+inline float Dot(const Vec3& a, const Vec3& b) {
+	return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+inline Vec3 Cross(const Vec3& a, const Vec3& b) {
+	return Vec3(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x);
+}
+
+inline float Length(const Vec3& v) {
+	return sqrtf(Dot(v, v));
+}
+
+inline Vec3 Normalize(const Vec3& v) {
+	float length = Length(v);
+	return length > 0.0f ? v * (1.0f / length) : v;
+}
+
+inline Vec3 Min(const Vec3& a, const Vec3& b) {
+	return Vec3(std::min(a.x, b.x), std::min(a.y, b.y), std::min(a.z, b.z));
+}
+
+inline Vec3 Max(const Vec3& a, const Vec3& b) {
+	return Vec3(std::max(a.x, b.x), std::max(a.y, b.y), std::max(a.z, b.z));
+}
+
+// Axis aligned bounding box. A default constructed box is empty and absorbs
+// into anything it is grown by.
+struct Bounds {
+	Vec3 min, max;
+	Bounds() : min(FLT_MAX, FLT_MAX, FLT_MAX), max(-FLT_MAX, -FLT_MAX, -FLT_MAX) {}
+	Bounds(const Vec3& min, const Vec3& max) : min(min), max(max) {}
+	bool Empty() const {
+		return min.x > max.x || min.y > max.y || min.z > max.z;
+	}
+	Vec3 Center() const {
+		return (min + max) * 0.5f;
+	}
+	Vec3 Extent() const {
+		return max - min;
+	}
+	void Grow(const Vec3& p) {
+		min = Min(min, p);
+		max = Max(max, p);
+	}
+	void Grow(const Bounds& b) {
+		min = Min(min, b.min);
+		max = Max(max, b.max);
+	}
+	float SurfaceArea() const {
+		if (Empty()) {
+			return 0.0f;
+		}
+		Vec3 e = Extent();
+		return 2.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
+	}
+};
+
+// Homogeneous points and 4x4 transforms, laid out like
+// python/module_matrix.py: row vectors multiply on the left (v * M), so the
+// translation sits in the bottom row and transforms compose left to right.
+struct Vec4 {
+	float x, y, z, w;
+	Vec4() : x(0.0f), y(0.0f), z(0.0f), w(0.0f) {}
+	Vec4(float x, float y, float z, float w) : x(x), y(y), z(z), w(w) {}
+	Vec4(const Vec3& v, float w) : x(v.x), y(v.y), z(v.z), w(w) {}
+};
+
+struct Mat4 {
+	float m[4][4];
+	Mat4() : m{ { 1, 0, 0, 0 }, { 0, 1, 0, 0 }, { 0, 0, 1, 0 }, { 0, 0, 0, 1 } } {}
+	Mat4 operator*(const Mat4& b) const {
+		Mat4 r;
+		for (int i = 0; i < 4; ++i) {
+			for (int j = 0; j < 4; ++j) {
+				r.m[i][j] = m[i][0] * b.m[0][j] + m[i][1] * b.m[1][j] + m[i][2] * b.m[2][j] + m[i][3] * b.m[3][j];
+			}
+		}
+		return r;
+	}
+};
+
+inline Vec4 Transform(const Vec4& v, const Mat4& a) {
+	return Vec4(
+		v.x * a.m[0][0] + v.y * a.m[1][0] + v.z * a.m[2][0] + v.w * a.m[3][0],
+		v.x * a.m[0][1] + v.y * a.m[1][1] + v.z * a.m[2][1] + v.w * a.m[3][1],
+		v.x * a.m[0][2] + v.y * a.m[1][2] + v.z * a.m[2][2] + v.w * a.m[3][2],
+		v.x * a.m[0][3] + v.y * a.m[1][3] + v.z * a.m[2][3] + v.w * a.m[3][3]);
+}
+
+// Directions ignore the translation row.
+inline Vec3 TransformDirection(const Vec3& v, const Mat4& a) {
+	Vec4 r = Transform(Vec4(v, 0.0f), a);
+	return Vec3(r.x, r.y, r.z);
+}
+
+inline Mat4 MatTranslate(const Vec3& t) {
+	Mat4 r;
+	r.m[3][0] = t.x;
+	r.m[3][1] = t.y;
+	r.m[3][2] = t.z;
+	return r;
+}
+
+inline Mat4 MatLookAt(const Vec3& eye, const Vec3& center, const Vec3& up) {
+	Vec3 f = Normalize(center - eye);
+	Vec3 s = Normalize(Cross(f, up));
+	Vec3 u = Cross(s, f);
+	Mat4 r;
+	r.m[0][0] = s.x; r.m[0][1] = u.x; r.m[0][2] = -f.x;
+	r.m[1][0] = s.y; r.m[1][1] = u.y; r.m[1][2] = -f.y;
+	r.m[2][0] = s.z; r.m[2][1] = u.z; r.m[2][2] = -f.z;
+	r.m[3][0] = -Dot(s, eye); r.m[3][1] = -Dot(u, eye); r.m[3][2] = Dot(f, eye);
+	return r;
+}
+
+// OpenGL style: looks down -z, clip z in [-w, w]. matProjection has no
+// aspect ratio; this one scales x by it.
+inline Mat4 MatProjection(float fovY, float aspect, float nearZ, float farZ) {
+	float f = 1.0f / tanf(fovY * 0.5f * 3.14159265f / 180.0f);
+	Mat4 r;
+	r.m[0][0] = f / aspect;
+	r.m[1][1] = f;
+	r.m[2][2] = (farZ + nearZ) / (nearZ - farZ);
+	r.m[2][3] = -1.0f;
+	r.m[3][2] = 2.0f * farZ * nearZ / (nearZ - farZ);
+	r.m[3][3] = 0.0f;
+	return r;
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+///////////////////////////////////////////////////////////////////////////////
+// Memory Mapped Output.
+//
+// MmapStreamOut writes a file through a shared mapping: WriteBytes is a
+// memcpy into the page cache, with no syscall per write and no stdio buffer
+// in between. The file is grown ahead of the writer by doubling, remapped as
+// it grows, and truncated to what was actually written on Finish.
+//
+// Everything written is still mapped, so patching a reserved slot is as
+// cheap as writing it was.
+///////////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "geometric.h"
+
+class MmapStreamOut : public IStreamOut, public ISeekableStreamOut {
+public:
+	static constexpr size_t InitialCapacity = 1 << 20;
+protected:
+	int _fd;
+	uint8_t* _map;
+	size_t _capacity;
+	uint64_t _position;
+	bool _finished;
+
+	void Grow(size_t needed) {
+		size_t capacity = std::max(_capacity * 2, needed);
+		if (ftruncate(_fd, (off_t)capacity) != 0) {
+			throw StreamException("Cannot grow mapped file");
+		}
+		void* map = _map == nullptr
+			? mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0)
+			: mremap(_map, _capacity, capacity, MREMAP_MAYMOVE);
+		if (map == MAP_FAILED) {
+			throw StreamException("Cannot map file");
+		}
+		_map = (uint8_t*)map;
+		_capacity = capacity;
+	}
+public:
+	MmapStreamOut(const char* path) : _map(nullptr), _capacity(0), _position(0), _finished(false) {
+		_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (_fd < 0) {
+			throw StreamException("Cannot open file for writing");
+		}
+		try {
+			Grow(InitialCapacity);
+		} catch (...) {
+			close(_fd);
+			throw;
+		}
+	}
+	MmapStreamOut(const MmapStreamOut&) = delete;
+	MmapStreamOut& operator=(const MmapStreamOut&) = delete;
+	// Finish to find out whether the truncate succeeded; this can't say.
+	virtual ~MmapStreamOut() {
+		try {
+			Finish();
+		} catch (...) {
+		}
+		close(_fd);
+	}
+	virtual void WriteBytes(const void* buffer, int count) override {
+		if (_finished) {
+			throw StreamException("Write after finish");
+		}
+		if (count < 0) {
+			throw StreamException("Negative write");
+		}
+		if (_capacity - _position < (size_t)count) {
+			Grow((size_t)_position + count);
+		}
+		memcpy(_map + _position, buffer, count);
+		_position += count;
+	}
+	virtual uint64_t Position() const override {
+		return _position;
+	}
+	virtual uint64_t ReserveSlot(int count) override {
+		if (_finished) {
+			throw StreamException("Write after finish");
+		}
+		uint64_t slot = _position;
+		if (count > 0) {
+			if (_capacity - _position < (size_t)count) {
+				Grow((size_t)_position + count);
+			}
+			// Already zero: nothing is ever written past _position, and
+			// growing the file extends it with zeros.
+			_position += count;
+		}
+		return slot;
+	}
+	virtual void PatchSlot(uint64_t slot, const void* buffer, int count) override {
+		if (_finished || count < 0 || slot > _position || _position - slot < (uint64_t)count) {
+			throw StreamException("Patch outside mapped file");
+		}
+		memcpy(_map + slot, buffer, count);
+	}
+	// Unmaps and cuts the file back to what was written.
+	void Finish() {
+		if (_finished) {
+			return;
+		}
+		_finished = true;
+		munmap(_map, _capacity);
+		_map = nullptr;
+		if (ftruncate(_fd, (off_t)_position) != 0) {
+			throw StreamException("Cannot truncate mapped file");
+		}
+	}
+};
@@ -0,0 +1,296 @@
+#pragma once
+
+///////////////////////////////////////////////////////////////////////////////
+// Multisample Anti-Aliasing.
+//
+// Supersampling renders at 4 or 8 times the pixels and shades every one of
+// them. MSAA keeps the extra samples only where they matter. Coverage and
+// depth are tested at 4 or 8 positions inside each pixel, but the fragment
+// shader runs once per pixel at its center, and the color goes to whichever
+// samples the triangle covered and passed depth at.
+//
+// Inside a surface every sample of a pixel ends up the same color, so color
+// is stored compressed: one color per pixel, the same as a Framebuffer. Only
+// when a triangle covers part of a pixel does the pixel expand into a block
+// holding a color per sample. Blocks come from a pool that is reserved for
+// every pixel expanding but handed out with an atomic bump, so memory pages
+// are only touched for pixels on edges, and tiles can be filled in parallel
+// without locks. Depth is kept per sample everywhere, since samples inside a
+// surface differ in depth even when they don't differ in color. It is laid
+// out by 2x2 quad, then sample, then pixel, so one sample of a quad is one
+// Float4 as in the G-buffer.
+//
+// Sample positions are the standard D3D patterns, in sixteenths of a pixel
+// from its center.
+///////////////////////////////////////////////////////////////////////////////
+
+#include <atomic>
+#include <climits>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "raster.h"
+#include "threadpool.h"
+
+inline constexpr float MsaaPattern4[4][2] = {
+	{ -2, -6 }, { 6, -2 }, { -6, 2 }, { 2, 6 },
+};
+inline constexpr float MsaaPattern8[8][2] = {
+	{ 1, -3 }, { -1, 3 }, { 5, 1 }, { -3, -5 }, { -5, 5 }, { -7, -1 }, { 3, 7 }, { 7, -7 },
+};
+
+template <int Samples> class MsaaFramebuffer {
+	static_assert(Samples == 4 || Samples == 8, "MSAA supports 4 and 8 samples");
+public:
+	static constexpr uint32_t FullCoverage = (1u << Samples) - 1;
+	// Block index of a pixel still holding one color.
+	static constexpr uint32_t Compressed = 0xFFFFFFFFu;
+	// Sample s of a pixel sits at SampleX(s), SampleY(s) from its top-left
+	// corner.
+	static float SampleX(int s) {
+		return 0.5f + (Samples == 4 ? MsaaPattern4[s][0] : MsaaPattern8[s][0]) / 16.0f;
+	}
+	static float SampleY(int s) {
+		return 0.5f + (Samples == 4 ? MsaaPattern4[s][1] : MsaaPattern8[s][1]) / 16.0f;
+	}
+protected:
+	// A block is all the reds, then all the greens, then all the blues, so a
+	// channel's samples load as Float4s.
+	static constexpr size_t BlockFloats = 3 * Samples;
+	std::vector<float> _color;
+	std::vector<uint32_t> _blocks;
+	// new[] without an initializer leaves the pool untouched; large
+	// allocations come straight from the OS and stay unbacked until written.
+	std::unique_ptr<float[]> _pool;
+	std::atomic<uint32_t> _used;
+
+	float* Block(uint32_t block) {
+		return &_pool[(size_t)block * BlockFloats];
+	}
+	const float* Block(uint32_t block) const {
+		return &_pool[(size_t)block * BlockFloats];
+	}
+	// Sum of a pixel's samples for one channel, spread across four lanes.
+	Float4 ChannelSum(size_t pixel, int channel) const {
+		uint32_t block = _blocks[pixel];
+		if (block == Compressed) {
+			return Float4(_color[pixel * 3 + channel] * (Samples / 4));
+		}
+		const float* samples = Block(block) + channel * Samples;
+		Float4 sum = Float4::Load(samples);
+		for (int s = 4; s < Samples; s += 4) {
+			sum += Float4::Load(samples + s);
+		}
+		return sum;
+	}
+	void ResolvePixel(size_t pixel, float* rgb) const {
+		for (int c = 0; c < 3; ++c) {
+			float lanes[4];
+			ChannelSum(pixel, c).Store(lanes);
+			rgb[c] = (lanes[0] + lanes[1] + lanes[2] + lanes[3]) * (1.0f / Samples);
+		}
+	}
+public:
+	int width, height;
+	int quadsX, quadsY;
+	// Window space depth per sample, in the order QuadDepths gives.
+	std::vector<float> depth;
+	MsaaFramebuffer(int width, int height) : _color((size_t)width * height * 3), _blocks((size_t)width * height, Compressed), _pool(new float[(size_t)width * height * BlockFloats]), _used(0),
+		width(width), height(height), quadsX((width + 1) / 2), quadsY((height + 1) / 2), depth((size_t)quadsX * quadsY * 4 * Samples, 1.0f) {}
+	void Clear(const Vec3& background, float clearDepth = 1.0f) {
+		for (size_t i = 0; i < _blocks.size(); ++i) {
+			_color[i * 3 + 0] = background.x;
+			_color[i * 3 + 1] = background.y;
+			_color[i * 3 + 2] = background.z;
+		}
+		std::fill(_blocks.begin(), _blocks.end(), Compressed);
+		std::fill(depth.begin(), depth.end(), clearDepth);
+		_used = 0;
+	}
+	// Depths of the quad with top-left pixel (x, y): Samples Float4s, one
+	// per sample.
+	float* QuadDepths(int x, int y) {
+		return &depth[((size_t)(y >> 1) * quadsX + (x >> 1)) * 4 * Samples];
+	}
+	// Color the samples in coverage. Partial coverage expands a compressed
+	// pixel; full coverage of a compressed pixel keeps it compressed.
+	void Write(int x, int y, uint32_t coverage, float r, float g, float b) {
+		size_t pixel = (size_t)y * width + x;
+		uint32_t& block = _blocks[pixel];
+		if (block == Compressed) {
+			float* color = &_color[pixel * 3];
+			if (coverage == FullCoverage) {
+				color[0] = r;
+				color[1] = g;
+				color[2] = b;
+				return;
+			}
+			block = _used.fetch_add(1, std::memory_order_relaxed);
+			float* samples = Block(block);
+			for (int s = 0; s < Samples; ++s) {
+				samples[s] = color[0];
+				samples[Samples + s] = color[1];
+				samples[2 * Samples + s] = color[2];
+			}
+		}
+		float* samples = Block(block);
+		for (int s = 0; s < Samples; ++s) {
+			if (coverage & (1u << s)) {
+				samples[s] = r;
+				samples[Samples + s] = g;
+				samples[2 * Samples + s] = b;
+			}
+		}
+	}
+	size_t ExpandedPixels() const {
+		return _used;
+	}
+	// Memory actually in use, against Samples times a Framebuffer for
+	// supersampling.
+	size_t Bytes() const {
+		return depth.size() * sizeof(float) + _color.size() * sizeof(float) + _blocks.size() * sizeof(uint32_t) + (size_t)_used * BlockFloats * sizeof(float);
+	}
+	// Average each pixel's samples into target, which must be the same size.
+	// Runs of four compressed pixels are copied; anything else sums each
+	// pixel's samples for a channel into one Float4 per pixel, and a
+	// transpose turns four of those into one Float4 of pixel sums.
+	void Resolve(Image& target) const {
+		PROFILE_ZONE("MsaaFramebuffer::Resolve");
+		ThreadPool::Shared().ParallelFor(0, (size_t)height, [&](size_t first, size_t last) {
+			for (size_t y = first; y < last; ++y) {
+				size_t row = y * width;
+				int x = 0;
+				for (; x + 4 <= width; x += 4) {
+					size_t pixel = row + x;
+					float* rgb = target.Pixel(x, (int)y);
+					if ((_blocks[pixel] & _blocks[pixel + 1] & _blocks[pixel + 2] & _blocks[pixel + 3]) == Compressed) {
+						memcpy(rgb, &_color[pixel * 3], 12 * sizeof(float));
+						continue;
+					}
+					float channels[3][4];
+					for (int c = 0; c < 3; ++c) {
+						Float4 p0 = ChannelSum(pixel, c), p1 = ChannelSum(pixel + 1, c), p2 = ChannelSum(pixel + 2, c), p3 = ChannelSum(pixel + 3, c);
+						Transpose(p0, p1, p2, p3);
+						((p0 + p1 + p2 + p3) * Float4(1.0f / Samples)).Store(channels[c]);
+					}
+					for (int i = 0; i < 4; ++i) {
+						rgb[i * 3 + 0] = channels[0][i];
+						rgb[i * 3 + 1] = channels[1][i];
+						rgb[i * 3 + 2] = channels[2][i];
+					}
+				}
+				for (; x < width; ++x) {
+					ResolvePixel(row + x, target.Pixel(x, (int)y));
+				}
+			}
+		});
+	}
+};
+
+// Coverage and depth at every sample, shading once per pixel at its center.
+// Edge functions and depth are affine, so each sample's value is the quad's
+// value plus a per-triangle constant, and a sample's depth for the whole
+// quad is one load. Varyings at a center outside the triangle are
+// extrapolated, as GPUs do without centroid interpolation.
+template <int Samples, int Varyings, class FS> void RasterTriangle(MsaaFramebuffer<Samples>& target, const TriangleSetup<Varyings>& setup, const FS& fragment, RasterStats& stats, int minX = 0, int minY = 0, int maxX = INT_MAX, int maxY = INT_MAX) {
+	using Target = MsaaFramebuffer<Samples>;
+	const Float4 laneX(0.0f, 1.0f, 0.0f, 1.0f);
+	const Float4 laneY(0.0f, 0.0f, 1.0f, 1.0f);
+	Float4 a[3], b[3], c[3];
+	float za = 0.0f, zb = 0.0f, zc = 0.0f;
+	for (int i = 0; i < 3; ++i) {
+		a[i] = Float4(setup.a[i] * setup.inverseArea);
+		b[i] = Float4(setup.b[i] * setup.inverseArea);
+		c[i] = Float4(setup.c[i] * setup.inverseArea);
+		za += setup.a[i] * setup.inverseArea * setup.z[i];
+		zb += setup.b[i] * setup.inverseArea * setup.z[i];
+		zc += setup.c[i] * setup.inverseArea * setup.z[i];
+	}
+	Float4 edgeOffset[Samples][3], zOffset[Samples];
+	for (int s = 0; s < Samples; ++s) {
+		float sx = Target::SampleX(s), sy = Target::SampleY(s);
+		for (int i = 0; i < 3; ++i) {
+			edgeOffset[s][i] = Float4((setup.a[i] * sx + setup.b[i] * sy) * setup.inverseArea);
+		}
+		zOffset[s] = Float4(za * sx + zb * sy);
+	}
+	minX = std::max(minX, setup.minX);
+	minY = std::max(minY, setup.minY);
+	maxX = std::min(maxX, setup.maxX);
+	maxY = std::min(maxY, setup.maxY);
+	int startX = minX & ~1;
+	for (int y = minY & ~1; y <= maxY; y += 2) {
+		Float4 py = Float4((float)y) + laneY;
+		Float4 rowValid = py < Float4((float)target.height);
+		for (int x = startX; x <= maxX; x += 2) {
+			Float4 px = Float4((float)x) + laneX;
+			Float4 valid = rowValid & (px < Float4((float)target.width));
+			++stats.quads;
+			Float4 edge[3];
+			for (int i = 0; i < 3; ++i) {
+				edge[i] = a[i] * px + b[i] * py + c[i];
+			}
+			Float4 z = Float4(za) * px + Float4(zb) * py + Float4(zc);
+			float* depth = target.QuadDepths(x, y);
+			// Bit lane of passed[s] for each pixel whose sample s is inside
+			// and nearer.
+			int passed[Samples];
+			int mask = 0;
+			for (int s = 0; s < Samples; ++s) {
+				Float4 inside = valid;
+				for (int i = 0; i < 3; ++i) {
+					Float4 weight = edge[i] + edgeOffset[s][i];
+					inside = inside & (setup.topLeft[i] ? weight >= Float4(0.0f) : weight > Float4(0.0f));
+				}
+				passed[s] = 0;
+				if (MoveMask(inside) == 0) {
+					continue;
+				}
+				Float4 sampleZ = z + zOffset[s];
+				Float4 current = Float4::Load(depth + s * 4);
+				Float4 pass = inside & (sampleZ < current);
+				Select(pass, sampleZ, current).Store(depth + s * 4);
+				passed[s] = MoveMask(pass);
+				mask |= passed[s];
+			}
+			if (mask == 0) {
+				continue;
+			}
+			Float4 cx = px + Float4(0.5f), cy = py + Float4(0.5f);
+			Float4 weight[3];
+			for (int i = 0; i < 3; ++i) {
+				weight[i] = a[i] * cx + b[i] * cy + c[i];
+			}
+			Float4 w = Float4(1.0f) / (weight[0] * Float4(setup.inverseW[0]) + weight[1] * Float4(setup.inverseW[1]) + weight[2] * Float4(setup.inverseW[2]));
+			Float4 varyings[Varyings];
+			for (int k = 0; k < Varyings; ++k) {
+				varyings[k] = (weight[0] * Float4(setup.varyings[0][k]) + weight[1] * Float4(setup.varyings[1][k]) + weight[2] * Float4(setup.varyings[2][k])) * w;
+			}
+			Float4 rgb[3];
+			fragment(varyings, rgb);
+			float r[4], g[4], bl[4];
+			rgb[0].Store(r);
+			rgb[1].Store(g);
+			rgb[2].Store(bl);
+			// Lanes where every sample passed, the usual case inside a surface.
+			int full = mask;
+			for (int s = 0; s < Samples; ++s) {
+				full &= passed[s];
+			}
+			for (int lane = 0; lane < 4; ++lane) {
+				if (mask & (1 << lane)) {
+					uint32_t coverage = Target::FullCoverage;
+					if (!(full & (1 << lane))) {
+						coverage = 0;
+						for (int s = 0; s < Samples; ++s) {
+							coverage |= (uint32_t)((passed[s] >> lane) & 1) << s;
+						}
+					}
+					target.Write(x + (lane & 1), y + (lane >> 1), coverage, r[lane], g[lane], bl[lane]);
+					++stats.fragments;
+				}
+			}
+		}
+	}
+}
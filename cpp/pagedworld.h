@@ -0,0 +1,262 @@
+#pragma once
+
+///////////////////////////////////////////////////////////////////////////////
+// Paged World.
+//
+// Space is cut into a uniform grid of cells. A snapshot stores each cell's
+// objects in its own region of the file behind a directory, so any cell can
+// be loaded without touching the others. A PagedWorld keeps the cells around
+// a focus point resident, loading them on the shared thread pool and evicting
+// the furthest ones when it goes over its memory budget.
+//
+// Snapshot layout (all little endian, native struct packing):
+//
+//   "PWLD" | cellSize:float | cells:uint32 | PagedCellEntry * cells | payloads
+//
+// Each payload is simply the objects' Save() output back to back.
+///////////////////////////////////////////////////////////////////////////////
+
+#include <cmath>
+#include <fstream>
+#include <future>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include "geometric.h"
+#include "threadpool.h"
+
+struct CellCoord {
+	int32_t x, y, z;
+	bool operator<(const CellCoord& c) const {
+		return x != c.x ? x < c.x : y != c.y ? y < c.y : z < c.z;
+	}
+	bool operator==(const CellCoord& c) const {
+		return x == c.x && y == c.y && z == c.z;
+	}
+};
+
+inline CellCoord CellOf(const Vec3& p, float cellSize) {
+	return { (int32_t)floorf(p.x / cellSize), (int32_t)floorf(p.y / cellSize), (int32_t)floorf(p.z / cellSize) };
+}
+
+struct PagedCellEntry {
+	CellCoord cell;
+	uint32_t objects;
+	uint64_t offset;
+	uint64_t bytes;
+};
+
+// Objects are assigned to the cell containing their bounds center. Objects
+// without bounds have nowhere to live in a paged world and are skipped.
+inline void WritePagedSnapshot(SharedWorld& world, float cellSize, IStreamOut& stream) {
+	PROFILE_ZONE("WritePagedSnapshot");
+	std::map<CellCoord, World> cells;
+	for (auto& object : *world) {
+		IBounded* bounded = dynamic_cast<IBounded*>(object.get());
+		if (bounded != nullptr && dynamic_cast<ISerializable*>(object.get()) != nullptr) {
+			cells[CellOf(bounded->GetBounds().Center(), cellSize)].push_back(object);
+		}
+	}
+	uint32_t count = (uint32_t)cells.size();
+	stream.WriteBytes("PWLD", 4);
+	stream.WriteBytes(&cellSize, sizeof(cellSize));
+	stream.WriteBytes(&count, sizeof(count));
+	std::vector<PagedCellEntry> entries;
+	uint64_t offset = 4 + sizeof(float) + sizeof(uint32_t) + cells.size() * sizeof(PagedCellEntry);
+	// A seekable stream takes the payloads as they are serialized and has
+	// the directory patched in afterwards. Anything else needs the payloads
+	// serialized up front so the directory knows their sizes.
+	ISeekableStreamOut* seekable = dynamic_cast<ISeekableStreamOut*>(&stream);
+	if (seekable != nullptr) {
+		uint64_t directory = seekable->ReserveSlot((int)(cells.size() * sizeof(PagedCellEntry)));
+		for (auto& cell : cells) {
+			SharedWorld cellWorld = std::make_shared<World>(cell.second);
+			uint64_t begin = seekable->Position();
+			SaveObjects(cellWorld, stream);
+			uint64_t bytes = seekable->Position() - begin;
+			entries.push_back({ cell.first, (uint32_t)cell.second.size(), offset, bytes });
+			offset += bytes;
+		}
+		seekable->PatchSlot(directory, entries.data(), (int)(entries.size() * sizeof(PagedCellEntry)));
+		return;
+	}
+	std::vector<MemoryStream> payloads(cells.size());
+	size_t index = 0;
+	for (auto& cell : cells) {
+		SharedWorld cellWorld = std::make_shared<World>(cell.second);
+		SaveObjects(cellWorld, payloads[index]);
+		entries.push_back({ cell.first, (uint32_t)cell.second.size(), offset, payloads[index].size() });
+		offset += payloads[index].size();
+		++index;
+	}
+	stream.WriteBytes(entries.data(), (int)(entries.size() * sizeof(PagedCellEntry)));
+	for (auto& payload : payloads) {
+		stream.WriteBytes(payload.data(), payload.size());
+	}
+}
+
+class PagedWorld {
+public:
+	struct Stats {
+		size_t resident = 0;
+		size_t loading = 0;
+		uint64_t residentBytes = 0;
+		uint64_t loads = 0;
+		uint64_t evictions = 0;
+		// Loads that threw. The cell is requested again on a later Update.
+		uint64_t failures = 0;
+	};
+protected:
+	struct Cell {
+		PagedCellEntry entry;
+		SharedWorld world;
+		std::shared_future<SharedWorld> pending;
+	};
+	// Rough cost of an object once loaded, on top of its serialized bytes:
+	// the control block, vtables and the World slot.
+	static const uint64_t ObjectOverhead = 64;
+
+	std::string _path;
+	float _cellSize;
+	uint64_t _budget;
+	std::map<CellCoord, Cell> _cells;
+	std::mutex _mutex;
+	Stats _stats;
+
+	static uint64_t CellBytes(const PagedCellEntry& entry) {
+		return entry.bytes + entry.objects * ObjectOverhead;
+	}
+	float DistanceTo(const CellCoord& c, const Vec3& focus) const {
+		Vec3 center((c.x + 0.5f) * _cellSize, (c.y + 0.5f) * _cellSize, (c.z + 0.5f) * _cellSize);
+		return Length(center - focus);
+	}
+	// Runs on the thread pool. Each load opens its own handle so loads never
+	// contend on a shared file position.
+	static SharedWorld LoadCell(std::string path, PagedCellEntry entry) {
+		PROFILE_ZONE("PagedWorld::LoadCell");
+		std::vector<uint8_t> payload(entry.bytes);
+		std::ifstream file(path, std::ios::binary);
+		file.seekg(entry.offset);
+		file.read((char*)payload.data(), payload.size());
+		if (!file) {
+			throw StreamException("Short read from paged snapshot");
+		}
+		MemoryStreamIn stream(payload.data(), payload.size());
+		SharedWorld world = std::make_shared<World>();
+		for (uint32_t i = 0; i < entry.objects; ++i) {
+			world->push_back(LoadObject(stream));
+		}
+		return world;
+	}
+public:
+	PagedWorld(const char* path, uint64_t budgetBytes) : _path(path), _cellSize(1.0f), _budget(budgetBytes) {
+		FileStreamIn stream(path);
+		char magic[4];
+		stream.ReadBytes(magic, 4);
+		if (memcmp(magic, "PWLD", 4) != 0) {
+			throw StreamException("Not a paged world snapshot");
+		}
+		uint32_t count = 0;
+		stream.ReadBytes(&_cellSize, sizeof(_cellSize));
+		stream.ReadBytes(&count, sizeof(count));
+		for (uint32_t i = 0; i < count; ++i) {
+			PagedCellEntry entry;
+			stream.ReadBytes(&entry, sizeof(entry));
+			_cells[entry.cell].entry = entry;
+		}
+	}
+	~PagedWorld() {
+		// Don't let in-flight loads outlive the snapshot they're reading.
+		for (auto& cell : _cells) {
+			if (cell.second.pending.valid()) {
+				cell.second.pending.wait();
+			}
+		}
+	}
+	float CellSize() const {
+		return _cellSize;
+	}
+	// Request every cell within radius of the focus, finish any loads that
+	// have completed, and evict the furthest resident cells while over budget.
+	// Cells inside the radius are never evicted, so the budget is a target
+	// rather than a hard limit when the radius alone exceeds it.
+	void Update(const Vec3& focus, float radius) {
+		PROFILE_ZONE("PagedWorld::Update");
+		std::lock_guard<std::mutex> lock(_mutex);
+		std::vector<std::pair<float, Cell*>> resident;
+		_stats.residentBytes = 0;
+		_stats.resident = 0;
+		_stats.loading = 0;
+		for (auto& pair : _cells) {
+			Cell& cell = pair.second;
+			float distance = DistanceTo(pair.first, focus);
+			bool wanted = distance <= radius + _cellSize;
+			if (cell.pending.valid() && cell.pending.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+				try {
+					cell.world = cell.pending.get();
+					++_stats.loads;
+				} catch (...) {
+					++_stats.failures;
+				}
+				cell.pending = std::shared_future<SharedWorld>();
+			} else if (wanted && cell.world == nullptr && !cell.pending.valid()) {
+				cell.pending = ThreadPool::Shared().Submit([path = _path, entry = cell.entry]() {
+					return LoadCell(path, entry);
+				}).share();
+			}
+			if (cell.pending.valid()) {
+				++_stats.loading;
+			}
+			if (cell.world != nullptr) {
+				_stats.residentBytes += CellBytes(cell.entry);
+				++_stats.resident;
+				if (!wanted) {
+					resident.push_back({ distance, &cell });
+				}
+			}
+		}
+		std::sort(resident.begin(), resident.end(), [](const std::pair<float, Cell*>& a, const std::pair<float, Cell*>& b) {
+			return a.first > b.first;
+		});
+		for (auto& candidate : resident) {
+			if (_stats.residentBytes <= _budget) {
+				break;
+			}
+			_stats.residentBytes -= CellBytes(candidate.second->entry);
+			candidate.second->world = nullptr;
+			--_stats.resident;
+			++_stats.evictions;
+		}
+	}
+	// Request, then block until every requested load has landed. Meant for
+	// the first frame after a teleport where there is nothing to show yet.
+	void Flush(const Vec3& focus, float radius) {
+		Update(focus, radius);
+		std::vector<std::shared_future<SharedWorld>> pending;
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			for (auto& cell : _cells) {
+				if (cell.second.pending.valid()) {
+					pending.push_back(cell.second.pending);
+				}
+			}
+		}
+		for (auto& p : pending) {
+			p.wait();
+		}
+		Update(focus, radius);
+	}
+	void VisitResident(std::function<void(IObject&)> fn) {
+		std::lock_guard<std::mutex> lock(_mutex);
+		for (auto& cell : _cells) {
+			if (cell.second.world != nullptr) {
+				VisitObjects(cell.second.world, fn);
+			}
+		}
+	}
+	Stats GetStats() {
+		std::lock_guard<std::mutex> lock(_mutex);
+		return _stats;
+	}
+};
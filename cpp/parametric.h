@@ -0,0 +1,236 @@
+#pragma once
+
+///////////////////////////////////////////////////////////////////////////////
+// Parametric Surfaces.
+//
+// Any surface given as a function of (u, v) in [0, 1]^2, as in
+// python/module_parametric.py. Rays hit it by Newton iteration on
+// S(u, v) = o + t d rather than against a tessellation, so a surface costs a
+// handful of bounding boxes instead of millions of triangles.
+//
+// Newton only finds the root near where it starts, so the domain is cut into
+// a grid of patches, each with a bounding box. The boxes are gathered into a
+// quadtree over (u, v): each node halves its rectangle of patches along u
+// and v and bounds its children. A ray walks the tree nearest child first
+// and starts one solve per patch box it reaches, so subtrees beyond the best
+// hit so far are never opened.
+//
+// Normals are dS/du x dS/dv, which faces out for surfaces that wind the same
+// way as spherePos and TessellateSphere; triangles from Tessellate wind
+// counter-clockwise around that normal.
+///////////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+#include "geometric.h"
+
+class ParametricSurface : public IObject, public IBounded, public ITranslatable, public ITessellatable, public IIntersectable {
+public:
+	using Function = std::function<Vec3(float u, float v)>;
+	static constexpr int MaxIterations = 16;
+protected:
+	struct Patch {
+		Bounds bounds;
+		float u0, v0, u1, v1;
+	};
+	// Children are count consecutive nodes from first. A leaf has none and
+	// first is its patch.
+	struct PatchNode {
+		Bounds bounds;
+		uint32_t first;
+		uint32_t count;
+	};
+	Function _position;
+	Vec3 _center;
+	int _patchesU, _patchesV;
+	// Tessellate's grid steps along each side of a patch.
+	int _steps;
+	std::vector<Patch> _patches;
+	std::vector<PatchNode> _nodes;
+	Bounds _bounds;
+
+	// Covers patches [pu0, pu1) x [pv0, pv1).
+	void BuildNode(uint32_t index, int pu0, int pv0, int pu1, int pv1) {
+		if (pu1 - pu0 == 1 && pv1 - pv0 == 1) {
+			uint32_t patch = (uint32_t)(pv0 * _patchesU + pu0);
+			_nodes[index] = { _patches[patch].bounds, patch, 0 };
+			return;
+		}
+		int splitU = pu1 - pu0 > 1 ? (pu0 + pu1) / 2 : pu1;
+		int splitV = pv1 - pv0 > 1 ? (pv0 + pv1) / 2 : pv1;
+		int ranges[2][2][2] = { { { pu0, splitU }, { splitU, pu1 } }, { { pv0, splitV }, { splitV, pv1 } } };
+		int halvesU = splitU < pu1 ? 2 : 1, halvesV = splitV < pv1 ? 2 : 1;
+		uint32_t first = (uint32_t)_nodes.size();
+		_nodes.resize(_nodes.size() + halvesU * halvesV);
+		Bounds bounds;
+		uint32_t child = first;
+		for (int j = 0; j < halvesV; ++j) {
+			for (int i = 0; i < halvesU; ++i, ++child) {
+				BuildNode(child, ranges[0][i][0], ranges[1][j][0], ranges[0][i][1], ranges[1][j][1]);
+				bounds.Grow(_nodes[child].bounds);
+			}
+		}
+		_nodes[index] = { bounds, first, (uint32_t)(halvesU * halvesV) };
+	}
+	// Bounds are built from samples, which misses the bulge of a curved
+	// patch between them; padding by a fraction of the patch size covers it
+	// for anything that doesn't fold back on itself inside one patch.
+	void BuildPatches() {
+		const int samples = 4;
+		_patches.clear();
+		_bounds = Bounds();
+		for (int pv = 0; pv < _patchesV; ++pv) {
+			for (int pu = 0; pu < _patchesU; ++pu) {
+				Patch patch;
+				patch.u0 = (float)pu / _patchesU;
+				patch.u1 = (float)(pu + 1) / _patchesU;
+				patch.v0 = (float)pv / _patchesV;
+				patch.v1 = (float)(pv + 1) / _patchesV;
+				for (int j = 0; j <= samples; ++j) {
+					for (int i = 0; i <= samples; ++i) {
+						float u = patch.u0 + (patch.u1 - patch.u0) * i / samples;
+						float v = patch.v0 + (patch.v1 - patch.v0) * j / samples;
+						patch.bounds.Grow(_position(u, v));
+					}
+				}
+				float pad = 0.1f * Length(patch.bounds.Extent()) + 1e-4f;
+				patch.bounds.min = patch.bounds.min - Vec3(pad, pad, pad);
+				patch.bounds.max = patch.bounds.max + Vec3(pad, pad, pad);
+				_bounds.Grow(patch.bounds);
+				_patches.push_back(patch);
+			}
+		}
+		_nodes.clear();
+		if (!_patches.empty()) {
+			_nodes.emplace_back();
+			BuildNode(0, 0, 0, _patchesU, _patchesV);
+		}
+	}
+	// Central differences; the function is opaque so there is nothing better.
+	void Derivatives(float u, float v, Vec3& du, Vec3& dv) const {
+		const float h = 1e-3f;
+		du = (_position(u + h, v) - _position(u - h, v)) * (0.5f / h);
+		dv = (_position(u, v + h) - _position(u, v - h)) * (0.5f / h);
+	}
+	// Newton on F(t, u, v) = S(u, v) - o - t d. The Jacobian columns are
+	// dS/du, dS/dv and -d. Starts from whichever of a few samples across the
+	// patch passes closest to the ray; the patch middle alone often sends
+	// grazing rays off to the far side of the surface.
+	bool Solve(const Patch& patch, const Ray& local, float& t, float& u, float& v) const {
+		const int samples = 2;
+		float inverseLength = 1.0f / Dot(local.direction, local.direction);
+		float bestDistance = FLT_MAX;
+		for (int j = 0; j <= samples; ++j) {
+			for (int i = 0; i <= samples; ++i) {
+				float su = patch.u0 + (patch.u1 - patch.u0) * i / samples;
+				float sv = patch.v0 + (patch.v1 - patch.v0) * j / samples;
+				Vec3 p = _position(su, sv);
+				float st = Dot(p - local.origin, local.direction) * inverseLength;
+				Vec3 offset = p - local.At(st);
+				float distance = Dot(offset, offset);
+				if (distance < bestDistance) {
+					bestDistance = distance;
+					u = su;
+					v = sv;
+					t = st;
+				}
+			}
+		}
+		float tolerance = 1e-5f * (1.0f + Length(patch.bounds.Extent()));
+		for (int iteration = 0; iteration < MaxIterations; ++iteration) {
+			Vec3 f = _position(u, v) - local.At(t);
+			if (Length(f) < tolerance) {
+				// Any root on the surface is a real hit, even one that
+				// belongs to another patch; callers keep the nearest.
+				const float slack = 1e-4f;
+				return u >= -slack && u <= 1.0f + slack && v >= -slack && v <= 1.0f + slack;
+			}
+			Vec3 su, sv;
+			Derivatives(u, v, su, sv);
+			Vec3 nd = -local.direction;
+			// Cramer's rule for J [du dv dt] = -f.
+			float determinant = Dot(su, Cross(sv, nd));
+			if (fabsf(determinant) < 1e-12f) {
+				return false;
+			}
+			float inverse = 1.0f / determinant;
+			Vec3 rhs = -f;
+			u += Dot(rhs, Cross(sv, nd)) * inverse;
+			v += Dot(su, Cross(rhs, nd)) * inverse;
+			t += Dot(su, Cross(sv, rhs)) * inverse;
+		}
+		return false;
+	}
+public:
+	ParametricSurface(Function position, const Vec3& center = Vec3(), int patchesU = 16, int patchesV = 16, int steps = 4) : _position(position), _center(center), _patchesU(patchesU), _patchesV(patchesV), _steps(std::max(1, steps)) {
+		BuildPatches();
+	}
+	virtual Bounds GetBounds() const override {
+		return Bounds(_bounds.min + _center, _bounds.max + _center);
+	}
+	virtual void Translate(const Vec3& offset) override {
+		_center += offset;
+	}
+	virtual void Tessellate(TriangleMesh& mesh) const override {
+		TessellateParametric(mesh, _steps * _patchesU, _steps * _patchesV, [this](float s, float t, Vec3& p, Vec3& n) {
+			Vec3 du, dv;
+			Derivatives(s, t, du, dv);
+			p = _center + _position(s, t);
+			n = Normalize(Cross(du, dv));
+		});
+	}
+	virtual bool Intersect(const Ray& ray, Hit& hit) const override {
+		if (_nodes.empty()) {
+			return false;
+		}
+		Ray local(ray.origin - _center, ray.direction);
+		Vec3 inverse = InverseDirection(ray.direction);
+		bool found = false;
+		// Reused across calls so a ray never allocates.
+		thread_local std::vector<uint32_t> stack;
+		stack.clear();
+		stack.push_back(0);
+		while (!stack.empty()) {
+			const PatchNode& node = _nodes[stack.back()];
+			stack.pop_back();
+			float tNear, tFar;
+			// Tested again on the way out: hits since the push may have
+			// moved hit.t in front of it.
+			if (!IntersectSlabs(node.bounds.min, node.bounds.max, local, inverse, hit.t, tNear, tFar)) {
+				continue;
+			}
+			if (node.count == 0) {
+				float t, u, v;
+				if (Solve(_patches[node.first], local, t, u, v) && t > 1e-4f && t < hit.t) {
+					Vec3 du, dv;
+					Derivatives(u, v, du, dv);
+					hit.t = t;
+					hit.normal = Normalize(Cross(du, dv));
+					hit.u = u;
+					hit.v = v;
+					found = true;
+				}
+				continue;
+			}
+			// Pushed furthest first so the nearest child is opened next.
+			std::pair<float, uint32_t> children[4];
+			int hits = 0;
+			for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+				if (IntersectSlabs(_nodes[i].bounds.min, _nodes[i].bounds.max, local, inverse, hit.t, tNear, tFar)) {
+					// Kept sorted by distance as they come; there are at most four.
+					int at = hits++;
+					for (; at > 0 && tNear < children[at - 1].first; --at) {
+						children[at] = children[at - 1];
+					}
+					children[at] = { tNear, i };
+				}
+			}
+			for (int i = hits - 1; i >= 0; --i) {
+				stack.push_back(children[i].second);
+			}
+		}
+		return found;
+	}
+};
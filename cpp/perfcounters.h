@@ -0,0 +1,239 @@
+#pragma once
+
+///////////////////////////////////////////////////////////////////////////////
+// Hardware Counter Regions.
+//
+// Wall clock tells us how long a region took but not why. On Linux we open a
+// small perf_event group per thread (cycles, instructions, last level cache
+// misses and branch misses) and sample it on entry and exit of named regions.
+//
+// Counters are frequently unavailable: containers, VMs without a virtual PMU
+// and perf_event_paranoid all get in the way. Whatever fails to open is
+// simply reported as unavailable; regions still work and cost next to
+// nothing when nothing could be opened.
+///////////////////////////////////////////////////////////////////////////////
+
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+
+#if defined(__linux__)
+#include <cerrno>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+enum PerfCounterId {
+	PERF_CYCLES,
+	PERF_INSTRUCTIONS,
+	PERF_LLC_MISSES,
+	PERF_BRANCH_MISSES,
+	PERF_COUNTER_COUNT
+};
+
+struct PerfSample {
+	uint64_t value[PERF_COUNTER_COUNT] = {};
+};
+
+// One counter group for the calling thread. Counters that failed to open
+// keep a descriptor of -1 and always read as zero.
+class PerfCounterGroup {
+protected:
+	int _fd[PERF_COUNTER_COUNT];
+	int _leader;
+	int _opened;
+	std::string _error;
+public:
+	PerfCounterGroup() : _leader(-1), _opened(0) {
+		for (int i = 0; i < PERF_COUNTER_COUNT; ++i) {
+			_fd[i] = -1;
+		}
+#if defined(__linux__)
+		static const uint64_t configs[PERF_COUNTER_COUNT] = {
+			PERF_COUNT_HW_CPU_CYCLES,
+			PERF_COUNT_HW_INSTRUCTIONS,
+			PERF_COUNT_HW_CACHE_MISSES,
+			PERF_COUNT_HW_BRANCH_MISSES,
+		};
+		for (int i = 0; i < PERF_COUNTER_COUNT; ++i) {
+			perf_event_attr attr;
+			memset(&attr, 0, sizeof(attr));
+			attr.size = sizeof(attr);
+			attr.type = PERF_TYPE_HARDWARE;
+			attr.config = configs[i];
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+			attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_ID;
+			int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, _leader, 0);
+			if (fd < 0) {
+				if (_error.empty()) {
+					_error = strerror(errno);
+				}
+				continue;
+			}
+			_fd[i] = fd;
+			if (_leader < 0) {
+				_leader = fd;
+			}
+			++_opened;
+		}
+		if (_leader >= 0) {
+			ioctl(_leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+			ioctl(_leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+		}
+#else
+		_error = "perf_event is only available on Linux";
+#endif
+	}
+	~PerfCounterGroup() {
+#if defined(__linux__)
+		for (int i = 0; i < PERF_COUNTER_COUNT; ++i) {
+			if (_fd[i] >= 0) {
+				close(_fd[i]);
+			}
+		}
+#endif
+	}
+	PerfCounterGroup(const PerfCounterGroup&) = delete;
+	PerfCounterGroup& operator=(const PerfCounterGroup&) = delete;
+	static PerfCounterGroup& ForThread() {
+		thread_local PerfCounterGroup group;
+		return group;
+	}
+	bool Available(PerfCounterId id) const {
+		return _fd[id] >= 0;
+	}
+	bool AnyAvailable() const {
+		return _opened > 0;
+	}
+	const std::string& Error() const {
+		return _error;
+	}
+	// Counters are free running; regions take deltas which keeps nesting
+	// trivially correct.
+	PerfSample Read() const {
+		PerfSample sample;
+#if defined(__linux__)
+		if (_leader < 0) {
+			return sample;
+		}
+		// Layout with PERF_FORMAT_GROUP | PERF_FORMAT_ID:
+		// { nr, { value, id } * nr }
+		uint64_t buffer[1 + 2 * PERF_COUNTER_COUNT];
+		if (read(_leader, buffer, sizeof(buffer)) <= 0) {
+			return sample;
+		}
+		// Members are returned in the order they joined the group, which is
+		// the order of our enum minus the ones that failed.
+		uint64_t n = 0;
+		for (int i = 0; i < PERF_COUNTER_COUNT && n < buffer[0]; ++i) {
+			if (_fd[i] >= 0) {
+				sample.value[i] = buffer[1 + 2 * n];
+				++n;
+			}
+		}
+#endif
+		return sample;
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Region accumulation and reporting.
+///////////////////////////////////////////////////////////////////////////////
+
+struct PerfRegionTotals {
+	uint64_t calls = 0;
+	uint64_t objects = 0;
+	PerfSample sum;
+};
+
+class PerfCounters {
+protected:
+	bool _enabled;
+	std::mutex _mutex;
+	std::map<std::string, PerfRegionTotals> _regions;
+	PerfCounters() : _enabled(false) {}
+public:
+	static PerfCounters& Instance() {
+		static PerfCounters counters;
+		return counters;
+	}
+	// Enable before any threads that will use regions are started.
+	void Enable(bool enabled = true) {
+		_enabled = enabled;
+	}
+	bool Enabled() const {
+		return _enabled;
+	}
+	void Accumulate(const char* name, uint64_t objects, const PerfSample& delta) {
+		std::lock_guard<std::mutex> lock(_mutex);
+		PerfRegionTotals& totals = _regions[name];
+		++totals.calls;
+		totals.objects += objects;
+		for (int i = 0; i < PERF_COUNTER_COUNT; ++i) {
+			totals.sum.value[i] += delta.value[i];
+		}
+	}
+	void Report(std::ostream& os) {
+		PerfCounterGroup& group = PerfCounterGroup::ForThread();
+		if (!group.AnyAvailable()) {
+			os << "[Hardware counters unavailable: " << group.Error() << "]" << std::endl;
+			return;
+		}
+		std::lock_guard<std::mutex> lock(_mutex);
+		os << "[Hardware counters]" << std::endl;
+		for (auto& region : _regions) {
+			const PerfRegionTotals& totals = region.second;
+			const uint64_t* v = totals.sum.value;
+			os << "  " << region.first << ": calls=" << totals.calls;
+			if (group.Available(PERF_CYCLES) && group.Available(PERF_INSTRUCTIONS) && v[PERF_CYCLES] > 0) {
+				os << " ipc=" << (double)v[PERF_INSTRUCTIONS] / v[PERF_CYCLES];
+			}
+			static const char* names[PERF_COUNTER_COUNT] = { "cycles", "instructions", "llc-misses", "branch-misses" };
+			for (int i = 0; i < PERF_COUNTER_COUNT; ++i) {
+				os << " " << names[i] << "=";
+				if (!group.Available((PerfCounterId)i)) {
+					os << "n/a";
+					continue;
+				}
+				os << v[i];
+				if (totals.objects > 0) {
+					os << " (" << (double)v[i] / totals.objects << "/obj)";
+				}
+			}
+			os << std::endl;
+		}
+	}
+};
+
+// RAII region. Pass the number of objects processed so the report can
+// normalize counts per object.
+class PerfRegion {
+protected:
+	const char* _name;
+	uint64_t _objects;
+	PerfSample _begin;
+public:
+	PerfRegion(const char* name, uint64_t objects = 0) : _name(PerfCounters::Instance().Enabled() ? name : nullptr), _objects(objects) {
+		if (_name != nullptr) {
+			_begin = PerfCounterGroup::ForThread().Read();
+		}
+	}
+	~PerfRegion() {
+		if (_name == nullptr) {
+			return;
+		}
+		PerfSample end = PerfCounterGroup::ForThread().Read();
+		for (int i = 0; i < PERF_COUNTER_COUNT; ++i) {
+			end.value[i] -= _begin.value[i];
+		}
+		PerfCounters::Instance().Accumulate(_name, _objects, end);
+	}
+	PerfRegion(const PerfRegion&) = delete;
+	PerfRegion& operator=(const PerfRegion&) = delete;
+};
@@ -0,0 +1,177 @@
+#pragma once
+
+///////////////////////////////////////////////////////////////////////////////
+// Zone Profiler.
+//
+// Scoped zones record a begin/end timestamp pair into a ring buffer owned by
+// the calling thread. Only the owning thread ever writes to its ring so the
+// hot path is a couple of stores and a release; no locks are taken except
+// once per thread when its ring is first registered.
+//
+// Rings are exported on demand to the Chrome trace-event JSON format, which
+// loads directly into chrome://tracing and ui.perfetto.dev.
+///////////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Raw timestamp in ticks. On x86 this is the TSC which is cheap enough to
+// take twice per zone; elsewhere we fall back to the steady clock.
+inline uint64_t ReadTimestamp() {
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+struct ProfileEvent {
+	const char* name;
+	uint64_t begin;
+	uint64_t end;
+};
+
+// Single producer ring. When full the oldest zones are overwritten; a
+// timeline of the recent past is more useful than a stalled producer.
+class ProfileRing {
+public:
+	static const uint32_t Capacity = 1 << 16;
+protected:
+	std::unique_ptr<ProfileEvent[]> _events;
+	std::atomic<uint64_t> _head;
+	uint32_t _threadId;
+public:
+	ProfileRing(uint32_t threadId) : _events(new ProfileEvent[Capacity]), _head(0), _threadId(threadId) {}
+	void Push(const char* name, uint64_t begin, uint64_t end) {
+		uint64_t head = _head.load(std::memory_order_relaxed);
+		ProfileEvent& event = _events[head & (Capacity - 1)];
+		event.name = name;
+		event.begin = begin;
+		event.end = end;
+		_head.store(head + 1, std::memory_order_release);
+	}
+	// Copy out the events currently held. Slots the producer may have lapped
+	// while we were copying are dropped rather than reported torn.
+	void Snapshot(std::vector<ProfileEvent>& out) const {
+		uint64_t head = _head.load(std::memory_order_acquire);
+		uint64_t first = head > Capacity ? head - Capacity : 0;
+		size_t start = out.size();
+		for (uint64_t i = first; i < head; ++i) {
+			out.push_back(_events[i & (Capacity - 1)]);
+		}
+		uint64_t after = _head.load(std::memory_order_acquire);
+		uint64_t safe = after > Capacity ? after - Capacity : 0;
+		if (safe > first) {
+			size_t lapped = (size_t)std::min<uint64_t>(safe - first, head - first);
+			out.erase(out.begin() + start, out.begin() + start + lapped);
+		}
+	}
+	uint32_t ThreadId() const {
+		return _threadId;
+	}
+};
+
+class Profiler {
+protected:
+	std::atomic<bool> _enabled;
+	std::mutex _mutex;
+	std::vector<std::unique_ptr<ProfileRing>> _rings;
+	uint64_t _originTicks;
+	std::chrono::steady_clock::time_point _originTime;
+	Profiler() : _enabled(false), _originTicks(ReadTimestamp()), _originTime(std::chrono::steady_clock::now()) {}
+	// Ticks per microsecond, measured against the steady clock over the
+	// lifetime of the profiler so far.
+	double TicksPerMicrosecond() const {
+		uint64_t ticks = ReadTimestamp() - _originTicks;
+		double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - _originTime).count();
+		return us > 0.0 && ticks > 0 ? ticks / us : 1000.0;
+	}
+	static void WriteJsonString(std::ostream& os, const char* text) {
+		os << '"';
+		for (const char* c = text; *c != 0; ++c) {
+			if (*c == '"' || *c == '\\') {
+				os << '\\';
+			}
+			os << *c;
+		}
+		os << '"';
+	}
+public:
+	static Profiler& Instance() {
+		static Profiler profiler;
+		return profiler;
+	}
+	void Enable(bool enabled = true) {
+		_enabled.store(enabled, std::memory_order_relaxed);
+	}
+	bool Enabled() const {
+		return _enabled.load(std::memory_order_relaxed);
+	}
+	// Rings are owned by the profiler rather than the thread so zones from
+	// threads that have already exited still make it into the export.
+	ProfileRing& ThreadRing() {
+		thread_local ProfileRing* ring = nullptr;
+		if (ring == nullptr) {
+			std::lock_guard<std::mutex> lock(_mutex);
+			_rings.push_back(std::make_unique<ProfileRing>((uint32_t)_rings.size() + 1));
+			ring = _rings.back().get();
+		}
+		return *ring;
+	}
+	void WriteChromeTrace(std::ostream& os) {
+		double scale = 1.0 / TicksPerMicrosecond();
+		std::lock_guard<std::mutex> lock(_mutex);
+		os << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+		bool first = true;
+		std::vector<ProfileEvent> events;
+		for (auto& ring : _rings) {
+			events.clear();
+			ring->Snapshot(events);
+			for (auto& event : events) {
+				os << (first ? "\n" : ",\n");
+				first = false;
+				os << "{\"name\":";
+				WriteJsonString(os, event.name);
+				os << ",\"ph\":\"X\",\"pid\":1,\"tid\":" << ring->ThreadId();
+				os << ",\"ts\":" << (int64_t)(event.begin - _originTicks) * scale;
+				os << ",\"dur\":" << (event.end - event.begin) * scale << "}";
+			}
+		}
+		os << "\n]}" << std::endl;
+	}
+};
+
+// RAII marker. The name must outlive the profiler (string literals are the
+// expected use) since only the pointer is recorded.
+class ProfileZone {
+protected:
+	const char* _name;
+	uint64_t _begin;
+public:
+	ProfileZone(const char* name) : _name(Profiler::Instance().Enabled() ? name : nullptr), _begin(_name != nullptr ? ReadTimestamp() : 0) {}
+	~ProfileZone() {
+		if (_name != nullptr) {
+			uint64_t end = ReadTimestamp();
+			Profiler::Instance().ThreadRing().Push(_name, _begin, end);
+		}
+	}
+	ProfileZone(const ProfileZone&) = delete;
+	ProfileZone& operator=(const ProfileZone&) = delete;
+};
+
+#define PROFILE_CONCAT_INNER(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_INNER(a, b)
+#define PROFILE_ZONE(name) ProfileZone PROFILE_CONCAT(_profileZone, __LINE__)(name)
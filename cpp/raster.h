@@ -0,0 +1,357 @@
+#pragma once
+
+///////////////////////////////////////////////////////////////////////////////
+// Rasterization.
+//
+// A CPU rasterizer for tessellated meshes with the same two programmable
+// stages as the GL and Metal paths (python/module_shader_gl41.py,
+// apple/Shader.swift). Shaders are plain functors passed as template
+// parameters, so they are inlined into the raster loop; there is no virtual
+// call per vertex or per pixel.
+//
+// A vertex shader takes one mesh vertex, writes Varyings floats for the
+// fragment stage and returns the clip space position:
+//
+//     static constexpr int Varyings = N;
+//     Vec4 operator()(const Vec3& position, const Vec3& normal, float s, float t, float* varyings) const;
+//
+// A fragment shader turns interpolated varyings into a color. It is a
+// template over its number type so the same source runs on one pixel (float)
+// or on a 2x2 quad of pixels in SIMD lanes (Float4), which is how the
+// rasterizer calls it:
+//
+//     template <class T> void operator()(const T* varyings, T* rgb) const;
+//
+// Conventions follow the GL path: clip space z in [-w, w], counter-clockwise
+// front faces, and pixel centers at half-integers.
+///////////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <climits>
+#include <vector>
+
+#include "image.h"
+#include "simd.h"
+#include "tessellate.h"
+#include "texture.h"
+
+struct Framebuffer {
+	int width, height;
+	Image color;
+	// Window space depth in [0, 1], smaller is nearer.
+	std::vector<float> depth;
+	Framebuffer(int width, int height) : width(width), height(height), color(width, height), depth((size_t)width * height, 1.0f) {}
+	float& Depth(int x, int y) {
+		return depth[(size_t)y * width + x];
+	}
+	void Clear(const Vec3& background, float clearDepth = 1.0f) {
+		for (size_t i = 0; i < depth.size(); ++i) {
+			color.rgb[i * 3 + 0] = background.x;
+			color.rgb[i * 3 + 1] = background.y;
+			color.rgb[i * 3 + 2] = background.z;
+		}
+		std::fill(depth.begin(), depth.end(), clearDepth);
+	}
+};
+
+struct RasterStats {
+	size_t triangles = 0;
+	size_t culled = 0;
+	size_t clipped = 0;
+	size_t quads = 0;
+	size_t fragments = 0;
+	RasterStats& operator+=(const RasterStats& b) {
+		triangles += b.triangles;
+		culled += b.culled;
+		clipped += b.clipped;
+		quads += b.quads;
+		fragments += b.fragments;
+		return *this;
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Standard Shaders.
+//
+// StandardVertexShader feeds all of the standard fragment shaders: world
+// space normal in varyings 0-2, st0 in 3-4 and world position in 5-7.
+///////////////////////////////////////////////////////////////////////////////
+
+struct StandardVertexShader {
+	static constexpr int Varyings = 8;
+	Mat4 model;
+	Mat4 viewProjection;
+	// Normals go through the model matrix as directions, which is only right
+	// without non-uniform scale.
+	Vec4 operator()(const Vec3& position, const Vec3& normal, float s, float t, float* varyings) const {
+		Vec4 world = Transform(Vec4(position, 1.0f), model);
+		Vec3 n = TransformDirection(normal, model);
+		varyings[0] = n.x;
+		varyings[1] = n.y;
+		varyings[2] = n.z;
+		varyings[3] = s;
+		varyings[4] = t;
+		varyings[5] = world.x;
+		varyings[6] = world.y;
+		varyings[7] = world.z;
+		return Transform(world, viewProjection);
+	}
+};
+
+// One color, no lighting.
+struct FlatShader {
+	Vec3 color = Vec3(1, 1, 1);
+	template <class T> void operator()(const T*, T* rgb) const {
+		rgb[0] = T(color.x);
+		rgb[1] = T(color.y);
+		rgb[2] = T(color.z);
+	}
+};
+
+// Diffuse lighting from one directional light plus a constant ambient term.
+struct LambertShader {
+	Vec3 albedo = Vec3(0.8f, 0.8f, 0.8f);
+	// Towards the light, normalized.
+	Vec3 light = Vec3(0.0f, 1.0f, 0.0f);
+	float ambient = 0.15f;
+	template <class T> void operator()(const T* varyings, T* rgb) const {
+		T nx = varyings[0], ny = varyings[1], nz = varyings[2];
+		// Interpolated normals are shorter than unit between vertices.
+		T length = Sqrt(nx * nx + ny * ny + nz * nz);
+		T lambert = Max((nx * T(light.x) + ny * T(light.y) + nz * T(light.z)) / Max(length, T(1e-6f)), T(0.0f));
+		T shade = T(ambient) + T(1.0f - ambient) * lambert;
+		rgb[0] = T(albedo.x) * shade;
+		rgb[1] = T(albedo.y) * shade;
+		rgb[2] = T(albedo.z) * shade;
+	}
+};
+
+// Texture coordinates as red and green, wrapped to [0, 1).
+struct UVDebugShader {
+	template <class T> void operator()(const T* varyings, T* rgb) const {
+		rgb[0] = varyings[3] - Floor(varyings[3]);
+		rgb[1] = varyings[4] - Floor(varyings[4]);
+		rgb[2] = T(0.0f);
+	}
+};
+
+// st0 (scaled by repeat) through a texture, lit like LambertShader. Quads
+// sample trilinearly at their own LOD.
+struct TextureShader {
+	const Texture* texture = nullptr;
+	float repeat = 1.0f;
+	Vec3 light = Vec3(0.0f, 1.0f, 0.0f);
+	float ambient = 0.15f;
+	template <class T> void operator()(const T* varyings, T* rgb) const {
+		T rgba[4];
+		texture->Sample(varyings[3] * T(repeat), varyings[4] * T(repeat), rgba);
+		T nx = varyings[0], ny = varyings[1], nz = varyings[2];
+		T length = Sqrt(nx * nx + ny * ny + nz * nz);
+		T lambert = Max((nx * T(light.x) + ny * T(light.y) + nz * T(light.z)) / Max(length, T(1e-6f)), T(0.0f));
+		T shade = T(ambient) + T(1.0f - ambient) * lambert;
+		rgb[0] = rgba[0] * shade;
+		rgb[1] = rgba[1] * shade;
+		rgb[2] = rgba[2] * shade;
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Triangle Setup and Traversal.
+//
+// Triangles are walked over their screen bounding box in 2x2 quads, one
+// pixel per SIMD lane. Edge functions and depth are affine in screen space;
+// varyings are interpolated perspective correct through 1/w.
+///////////////////////////////////////////////////////////////////////////////
+
+// A vertex after the vertex stage: clip position then the varyings.
+template <int Varyings> struct ShadedVertex {
+	Vec4 clip;
+	float varyings[Varyings];
+};
+
+// Screen space triangle ready for traversal.
+template <int Varyings> struct TriangleSetup {
+	// Edge function i is a[i] * x + b[i] * y + c[i], the barycentric weight
+	// of vertex i scaled by the area.
+	float a[3], b[3], c[3];
+	bool topLeft[3];
+	float inverseArea;
+	// Depth and 1/w per vertex, and varyings pre-divided by w.
+	float z[3], inverseW[3];
+	float varyings[3][Varyings];
+	int minX, minY, maxX, maxY;
+};
+
+// Everything after projection. sx, sy are window coordinates, z window depth
+// and inverseW 1 / clip w per vertex. Returns false for back faces and
+// triangles that don't touch the window.
+template <int Varyings> bool SetupScreenTriangle(const ShadedVertex<Varyings>* v[3], const float* sx, const float* sy, const float* z, const float* inverseW, int width, int height, TriangleSetup<Varyings>& setup) {
+	// With y pointing down the screen, counter-clockwise front faces come
+	// out with a negative area here.
+	float area = (sx[1] - sx[0]) * (sy[2] - sy[0]) - (sy[1] - sy[0]) * (sx[2] - sx[0]);
+	if (!(area < 0.0f)) {
+		return false;
+	}
+	float minX = std::min(sx[0], std::min(sx[1], sx[2]));
+	float maxX = std::max(sx[0], std::max(sx[1], sx[2]));
+	float minY = std::min(sy[0], std::min(sy[1], sy[2]));
+	float maxY = std::max(sy[0], std::max(sy[1], sy[2]));
+	// Clamp before converting; vertices near w = 0 land far off screen.
+	setup.minX = (int)std::max(0.0f, floorf(minX));
+	setup.minY = (int)std::max(0.0f, floorf(minY));
+	setup.maxX = (int)std::min((float)(width - 1), ceilf(maxX));
+	setup.maxY = (int)std::min((float)(height - 1), ceilf(maxY));
+	if (setup.minX > setup.maxX || setup.minY > setup.maxY) {
+		return false;
+	}
+	for (int i = 0; i < 3; ++i) {
+		setup.z[i] = z[i];
+		setup.inverseW[i] = inverseW[i];
+		for (int k = 0; k < Varyings; ++k) {
+			setup.varyings[i][k] = v[i]->varyings[k] * inverseW[i];
+		}
+	}
+	// Edge i is opposite vertex i.
+	for (int i = 0; i < 3; ++i) {
+		int j = (i + 1) % 3, k = (i + 2) % 3;
+		float dx = sx[j] - sx[k], dy = sy[j] - sy[k];
+		setup.a[i] = dy;
+		setup.b[i] = -dx;
+		setup.c[i] = dx * sy[k] - dy * sx[k];
+		// Pixels exactly on an edge belong to the triangle below or to the
+		// right of it, so shared edges are drawn once. Inside lies along
+		// (-dy, dx) since the area is negative.
+		setup.topLeft[i] = (dy == 0.0f && dx > 0.0f) || dy < 0.0f;
+	}
+	setup.inverseArea = 1.0f / area;
+	return true;
+}
+
+// Project and set up one triangle. Without a clipper, anything crossing the
+// near plane is dropped whole; the binned front end clips instead.
+template <int Varyings> bool SetupTriangle(const ShadedVertex<Varyings>* v[3], int width, int height, TriangleSetup<Varyings>& setup) {
+	float sx[3], sy[3], z[3], inverseW[3];
+	for (int i = 0; i < 3; ++i) {
+		const Vec4& clip = v[i]->clip;
+		if (clip.w <= 1e-6f || clip.z < -clip.w) {
+			return false;
+		}
+		inverseW[i] = 1.0f / clip.w;
+		sx[i] = (clip.x * inverseW[i] * 0.5f + 0.5f) * width;
+		sy[i] = (0.5f - clip.y * inverseW[i] * 0.5f) * height;
+		z[i] = clip.z * inverseW[i] * 0.5f + 0.5f;
+	}
+	return SetupScreenTriangle(v, sx, sy, z, inverseW, width, height, setup);
+}
+
+// Walks the quads of a triangle that pass the edge and depth tests, writing
+// depth and handing the survivors' perspective correct varyings to emit:
+//
+//     void emit(int x, int y, int mask, const Float4* varyings);
+//
+// (x, y) is the quad's top-left pixel and bit i of mask is set for lanes that
+// passed. The target provides width, height and Depth(x, y), which is all
+// that differs between a framebuffer and a G-buffer. Only pixels inside
+// [minX, maxX] x [minY, maxY] are touched, which lets tiles share a
+// triangle. Rectangles should start on even coordinates so quads don't
+// straddle them.
+template <int Varyings, class Target, class Emit> void TraverseTriangle(Target& target, const TriangleSetup<Varyings>& setup, RasterStats& stats, int minX, int minY, int maxX, int maxY, const Emit& emit) {
+	const Float4 laneX(0.5f, 1.5f, 0.5f, 1.5f);
+	const Float4 laneY(0.5f, 0.5f, 1.5f, 1.5f);
+	Float4 a[3], b[3], c[3];
+	for (int i = 0; i < 3; ++i) {
+		a[i] = Float4(setup.a[i] * setup.inverseArea);
+		b[i] = Float4(setup.b[i] * setup.inverseArea);
+		c[i] = Float4(setup.c[i] * setup.inverseArea);
+	}
+	minX = std::max(minX, setup.minX);
+	minY = std::max(minY, setup.minY);
+	maxX = std::min(maxX, setup.maxX);
+	maxY = std::min(maxY, setup.maxY);
+	int startX = minX & ~1;
+	for (int y = minY & ~1; y <= maxY; y += 2) {
+		Float4 py = Float4((float)y) + laneY;
+		Float4 rowValid = py < Float4((float)target.height);
+		for (int x = startX; x <= maxX; x += 2) {
+			Float4 px = Float4((float)x) + laneX;
+			Float4 inside = rowValid & (px < Float4((float)target.width));
+			Float4 weight[3];
+			for (int i = 0; i < 3; ++i) {
+				weight[i] = a[i] * px + b[i] * py + c[i];
+				inside = inside & (setup.topLeft[i] ? weight[i] >= Float4(0.0f) : weight[i] > Float4(0.0f));
+			}
+			int mask = MoveMask(inside);
+			++stats.quads;
+			if (mask == 0) {
+				continue;
+			}
+			Float4 z = weight[0] * Float4(setup.z[0]) + weight[1] * Float4(setup.z[1]) + weight[2] * Float4(setup.z[2]);
+			float zLanes[4];
+			z.Store(zLanes);
+			for (int lane = 0; lane < 4; ++lane) {
+				if (mask & (1 << lane)) {
+					float& depth = target.Depth(x + (lane & 1), y + (lane >> 1));
+					if (zLanes[lane] < depth) {
+						depth = zLanes[lane];
+						++stats.fragments;
+					} else {
+						mask &= ~(1 << lane);
+					}
+				}
+			}
+			if (mask == 0) {
+				continue;
+			}
+			Float4 w = Float4(1.0f) / (weight[0] * Float4(setup.inverseW[0]) + weight[1] * Float4(setup.inverseW[1]) + weight[2] * Float4(setup.inverseW[2]));
+			Float4 varyings[Varyings];
+			for (int k = 0; k < Varyings; ++k) {
+				varyings[k] = (weight[0] * Float4(setup.varyings[0][k]) + weight[1] * Float4(setup.varyings[1][k]) + weight[2] * Float4(setup.varyings[2][k])) * w;
+			}
+			emit(x, y, mask, varyings);
+		}
+	}
+}
+
+// Shade and store the quads that survive traversal.
+template <int Varyings, class FS> void RasterTriangle(Framebuffer& target, const TriangleSetup<Varyings>& setup, const FS& fragment, RasterStats& stats, int minX = 0, int minY = 0, int maxX = INT_MAX, int maxY = INT_MAX) {
+	TraverseTriangle(target, setup, stats, minX, minY, maxX, maxY, [&](int x, int y, int mask, const Float4* varyings) {
+		Float4 rgb[3];
+		fragment(varyings, rgb);
+		float r[4], g[4], b[4];
+		rgb[0].Store(r);
+		rgb[1].Store(g);
+		rgb[2].Store(b);
+		for (int lane = 0; lane < 4; ++lane) {
+			if (mask & (1 << lane)) {
+				float* pixel = target.color.Pixel(x + (lane & 1), y + (lane >> 1));
+				pixel[0] = r[lane];
+				pixel[1] = g[lane];
+				pixel[2] = b[lane];
+			}
+		}
+	});
+}
+
+// Run the vertex stage over the whole mesh, then set up and rasterize each
+// triangle against the depth buffer. Target is a Framebuffer, or anything
+// else with a RasterTriangle overload taking FS.
+template <class Target, class VS, class FS> RasterStats DrawMesh(Target& target, const TriangleMesh& mesh, const VS& vertex, const FS& fragment) {
+	PROFILE_ZONE("DrawMesh");
+	constexpr int Varyings = VS::Varyings;
+	RasterStats stats;
+	std::vector<ShadedVertex<Varyings>> shaded(mesh.positions.size());
+	for (size_t i = 0; i < shaded.size(); ++i) {
+		shaded[i].clip = vertex(mesh.positions[i], mesh.normals[i], mesh.st0[i * 2], mesh.st0[i * 2 + 1], shaded[i].varyings);
+	}
+	TriangleSetup<Varyings> setup;
+	for (size_t i = 0; i + 2 < mesh.indices.size(); i += 3) {
+		++stats.triangles;
+		const ShadedVertex<Varyings>* v[3] = { &shaded[mesh.indices[i]], &shaded[mesh.indices[i + 1]], &shaded[mesh.indices[i + 2]] };
+		if (!SetupTriangle(v, target.width, target.height, setup)) {
+			++stats.culled;
+			continue;
+		}
+		RasterTriangle(target, setup, fragment, stats);
+	}
+	return stats;
+}
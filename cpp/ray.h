@@ -0,0 +1,283 @@
+#pragma once
+
+///////////////////////////////////////////////////////////////////////////////
+// Rays.
+//
+// Ray/primitive intersection for analytic objects. Geometric objects can't be
+// rasterized without tessellating them, but a raytracer can use them as-is.
+///////////////////////////////////////////////////////////////////////////////
+
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+
+#include "linalg.h"
+
+struct Ray {
+	Vec3 origin;
+	Vec3 direction;
+	Ray() {}
+	Ray(const Vec3& origin, const Vec3& direction) : origin(origin), direction(direction) {}
+	Vec3 At(float t) const {
+		return origin + direction * t;
+	}
+};
+
+struct Hit {
+	float t = FLT_MAX;
+	Vec3 normal;
+	// Surface parameterization at the hit, where the primitive has one.
+	float u = 0.0f, v = 0.0f;
+	uint32_t slot = UINT32_MAX;
+};
+
+// Objects a ray can hit directly. Implementations only report hits closer
+// than hit.t and update hit in place, so a caller can test many objects in
+// any order and end up with the closest.
+class IIntersectable {
+public:
+	virtual ~IIntersectable() {}
+	virtual bool Intersect(const Ray& ray, Hit& hit) const = 0;
+};
+
+inline bool IntersectSphere(const Vec3& center, float radius, const Ray& ray, Hit& hit) {
+	Vec3 oc = ray.origin - center;
+	float a = Dot(ray.direction, ray.direction);
+	float b = Dot(oc, ray.direction);
+	float c = Dot(oc, oc) - radius * radius;
+	float discriminant = b * b - a * c;
+	if (discriminant < 0.0f) {
+		return false;
+	}
+	float root = sqrtf(discriminant);
+	float t = (-b - root) / a;
+	if (t <= 1e-4f) {
+		t = (-b + root) / a;
+	}
+	if (t <= 1e-4f || t >= hit.t) {
+		return false;
+	}
+	hit.t = t;
+	hit.normal = (ray.At(t) - center) * (1.0f / radius);
+	return true;
+}
+
+// Slab test. Returns the entry and exit distances; the box is hit when
+// tNear <= tFar and tFar > 0.
+inline bool IntersectSlabs(const Vec3& min, const Vec3& max, const Ray& ray, const Vec3& inverseDirection, float tLimit, float& tNear, float& tFar) {
+	tNear = 0.0f;
+	tFar = tLimit;
+	for (int axis = 0; axis < 3; ++axis) {
+		float t0 = (min[axis] - ray.origin[axis]) * inverseDirection[axis];
+		float t1 = (max[axis] - ray.origin[axis]) * inverseDirection[axis];
+		if (t0 > t1) {
+			std::swap(t0, t1);
+		}
+		tNear = t0 > tNear ? t0 : tNear;
+		tFar = t1 < tFar ? t1 : tFar;
+		if (tNear > tFar) {
+			return false;
+		}
+	}
+	return true;
+}
+
+inline Vec3 InverseDirection(const Vec3& d) {
+	return Vec3(1.0f / d.x, 1.0f / d.y, 1.0f / d.z);
+}
+
+inline bool IntersectBox(const Bounds& box, const Ray& ray, Hit& hit) {
+	Vec3 inverse = InverseDirection(ray.direction);
+	float tNear, tFar;
+	if (!IntersectSlabs(box.min, box.max, ray, inverse, hit.t, tNear, tFar)) {
+		return false;
+	}
+	// Inside the box we hit the far side.
+	float t = tNear > 1e-4f ? tNear : tFar;
+	if (t <= 1e-4f || t >= hit.t) {
+		return false;
+	}
+	Vec3 p = ray.At(t) - box.Center();
+	Vec3 half = box.Extent() * 0.5f;
+	// The face whose slab we're closest to leaving is the one we hit.
+	int axis = 0;
+	float best = -1.0f;
+	for (int i = 0; i < 3; ++i) {
+		float d = half[i] > 0.0f ? fabsf(p[i]) / half[i] : 0.0f;
+		if (d > best) {
+			best = d;
+			axis = i;
+		}
+	}
+	Vec3 normal;
+	(axis == 0 ? normal.x : axis == 1 ? normal.y : normal.z) = p[axis] < 0.0f ? -1.0f : 1.0f;
+	hit.t = t;
+	hit.normal = normal;
+	return true;
+}
+
+// Real roots of a x^2 + b x + c, a cubic and a quartic with leading
+// coefficient 1 (after Schwarze, "Cubic and Quartic Roots", Graphics Gems,
+// 1990). Doubles throughout; the quartic coefficients for a torus lose too
+// much in float. Roots are unordered and near-repeated roots may be
+// reported twice.
+inline int SolveQuadratic(double a, double b, double c, double* roots) {
+	if (fabs(a) < 1e-30) {
+		if (fabs(b) < 1e-30) {
+			return 0;
+		}
+		roots[0] = -c / b;
+		return 1;
+	}
+	double discriminant = b * b - 4.0 * a * c;
+	if (discriminant < 0.0) {
+		return 0;
+	}
+	// Avoids cancellation between -b and the root.
+	double q = -0.5 * (b + (b < 0.0 ? -sqrt(discriminant) : sqrt(discriminant)));
+	if (q == 0.0) {
+		roots[0] = 0.0;
+		return 1;
+	}
+	roots[0] = q / a;
+	roots[1] = c / q;
+	return 2;
+}
+
+// x^3 + a x^2 + b x + c
+inline int SolveCubic(double a, double b, double c, double* roots) {
+	double sq = a * a;
+	double p = (1.0 / 3.0) * (-(1.0 / 3.0) * sq + b);
+	double q = 0.5 * ((2.0 / 27.0) * a * sq - (1.0 / 3.0) * a * b + c);
+	double cp = p * p * p;
+	double d = q * q + cp;
+	int count;
+	if (fabs(d) < 1e-18) {
+		if (fabs(q) < 1e-18) {
+			roots[0] = 0.0;
+			count = 1;
+		} else {
+			double u = cbrt(-q);
+			roots[0] = 2.0 * u;
+			roots[1] = -u;
+			count = 2;
+		}
+	} else if (d < 0.0) {
+		double phi = (1.0 / 3.0) * acos(-q / sqrt(-cp));
+		double t = 2.0 * sqrt(-p);
+		roots[0] = t * cos(phi);
+		roots[1] = -t * cos(phi + 3.14159265358979323846 / 3.0);
+		roots[2] = -t * cos(phi - 3.14159265358979323846 / 3.0);
+		count = 3;
+	} else {
+		double root = sqrt(d);
+		roots[0] = cbrt(root - q) - cbrt(root + q);
+		count = 1;
+	}
+	for (int i = 0; i < count; ++i) {
+		roots[i] -= (1.0 / 3.0) * a;
+	}
+	return count;
+}
+
+// x^4 + a x^3 + b x^2 + c x + d
+inline int SolveQuartic(double a, double b, double c, double d, double* roots) {
+	// Depress to y^4 + p y^2 + q y + r with x = y - a / 4.
+	double sq = a * a;
+	double p = -3.0 / 8.0 * sq + b;
+	double q = 1.0 / 8.0 * sq * a - 1.0 / 2.0 * a * b + c;
+	double r = -3.0 / 256.0 * sq * sq + 1.0 / 16.0 * sq * b - 1.0 / 4.0 * a * c + d;
+	int count = 0;
+	if (fabs(r) < 1e-18) {
+		count = SolveCubic(0.0, p, q, roots);
+		roots[count++] = 0.0;
+	} else {
+		// Any real root of the resolvent cubic splits the quartic into two
+		// quadratics.
+		double cubic[3];
+		SolveCubic(-0.5 * p, -r, 0.5 * r * p - 1.0 / 8.0 * q * q, cubic);
+		double z = cubic[0];
+		double u = z * z - r;
+		double v = 2.0 * z - p;
+		if (fabs(u) < 1e-18) {
+			u = 0.0;
+		} else if (u > 0.0) {
+			u = sqrt(u);
+		} else {
+			return 0;
+		}
+		if (fabs(v) < 1e-18) {
+			v = 0.0;
+		} else if (v > 0.0) {
+			v = sqrt(v);
+		} else {
+			return 0;
+		}
+		count = SolveQuadratic(1.0, q < 0.0 ? -v : v, z - u, roots);
+		count += SolveQuadratic(1.0, q < 0.0 ? v : -v, z + u, roots + count);
+	}
+	for (int i = 0; i < count; ++i) {
+		double x = roots[i] - 0.25 * a;
+		// One Newton step recovers most of what the closed form loses.
+		double f = (((x + a) * x + b) * x + c) * x + d;
+		double df = ((4.0 * x + 3.0 * a) * x + 2.0 * b) * x + c;
+		if (df != 0.0) {
+			x -= f / df;
+		}
+		roots[i] = x;
+	}
+	return count;
+}
+
+// Torus around the Y axis, as torusPos in python/module_parametric.py: a
+// ring of radius major in the XZ plane swept by a circle of radius minor.
+// u runs around the ring and v around the tube, both in [0, 1).
+inline bool IntersectTorus(const Vec3& center, float major, float minor, const Ray& ray, Hit& hit) {
+	// Solve from where the ray enters the bounds; the quartic coefficients
+	// scale with the distance to the origin and so does the error.
+	Vec3 extent(major + minor, minor, major + minor);
+	float tNear, tFar;
+	if (!IntersectSlabs(center - extent, center + extent, ray, InverseDirection(ray.direction), hit.t, tNear, tFar)) {
+		return false;
+	}
+	double t0 = tNear;
+	double ox = ray.origin.x + ray.direction.x * t0 - center.x;
+	double oy = ray.origin.y + ray.direction.y * t0 - center.y;
+	double oz = ray.origin.z + ray.direction.z * t0 - center.z;
+	double dx = ray.direction.x, dy = ray.direction.y, dz = ray.direction.z;
+	double R2 = (double)major * major;
+	double a = dx * dx + dy * dy + dz * dz;
+	double b = 2.0 * (ox * dx + oy * dy + oz * dz);
+	double k = ox * ox + oy * oy + oz * oz + R2 - (double)minor * minor;
+	double c4 = a * a;
+	double c3 = 2.0 * a * b;
+	double c2 = b * b + 2.0 * a * k - 4.0 * R2 * (dx * dx + dz * dz);
+	double c1 = 2.0 * b * k - 8.0 * R2 * (ox * dx + oz * dz);
+	double c0 = k * k - 4.0 * R2 * (ox * ox + oz * oz);
+	double roots[4];
+	int count = SolveQuartic(c3 / c4, c2 / c4, c1 / c4, c0 / c4, roots);
+	double best = (double)hit.t;
+	bool found = false;
+	for (int i = 0; i < count; ++i) {
+		double t = roots[i] + t0;
+		if (t > 1e-4 && t < best) {
+			best = t;
+			found = true;
+		}
+	}
+	if (!found) {
+		return false;
+	}
+	hit.t = (float)best;
+	Vec3 p = ray.At(hit.t) - center;
+	float ring = sqrtf(p.x * p.x + p.z * p.z);
+	Vec3 spine = ring > 0.0f ? Vec3(p.x, 0.0f, p.z) * (major / ring) : Vec3();
+	hit.normal = Normalize(p - spine);
+	const float twoPi = 6.28318531f;
+	float u = atan2f(p.z, p.x) / twoPi;
+	// Matches TessellateTorus, where v runs down the outside of the tube.
+	float v = -atan2f(p.y, ring - major) / twoPi;
+	hit.u = u < 0.0f ? u + 1.0f : u;
+	hit.v = v < 0.0f ? v + 1.0f : v;
+	return true;
+}
@@ -0,0 +1,240 @@
+#pragma once
+
+///////////////////////////////////////////////////////////////////////////////
+// Progressive Path Tracing.
+//
+// A diffuse path tracer over the BVH. Each pass adds samples into a float
+// accumulation buffer and the current estimate is the running mean, so the
+// image converges for as long as nothing changes. Accumulation is thrown away
+// only when the camera moves or the world is edited; otherwise every pass is
+// progress.
+//
+// Random numbers are seeded from (pixel, pass), so a given pass renders the
+// same image no matter how rows are split across threads.
+///////////////////////////////////////////////////////////////////////////////
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "bvh.h"
+#include "image.h"
+#include "threadpool.h"
+#include "tilestream.h"
+
+struct Camera {
+	Vec3 position = Vec3(0, 0, -10);
+	Vec3 target;
+	Vec3 up = Vec3(0, 1, 0);
+	float fovY = 45.0f;
+	bool operator==(const Camera& rhs) const {
+		return position == rhs.position && target == rhs.target && up == rhs.up && fovY == rhs.fovY;
+	}
+	bool operator!=(const Camera& rhs) const {
+		return !(*this == rhs);
+	}
+};
+
+// PCG32 (O'Neill, 2014). Small state, good enough statistics for sampling.
+class Random {
+protected:
+	uint64_t _state;
+public:
+	Random(uint64_t seed) : _state(0) {
+		Next();
+		_state += seed;
+		Next();
+	}
+	uint32_t Next() {
+		uint64_t old = _state;
+		_state = old * 6364136223846793005ull + 1442695040888963407ull;
+		uint32_t shifted = (uint32_t)(((old >> 18u) ^ old) >> 27u);
+		uint32_t rotate = (uint32_t)(old >> 59u);
+		return (shifted >> rotate) | (shifted << ((-rotate) & 31));
+	}
+	// Uniform in [0, 1).
+	float Float() {
+		return (Next() >> 8) * (1.0f / 16777216.0f);
+	}
+};
+
+inline uint64_t HashSeed(uint64_t a, uint64_t b) {
+	uint64_t h = a * 0x9e3779b97f4a7c15ull ^ (b + 0x632be59bd9b4e019ull);
+	h ^= h >> 31;
+	h *= 0xbf58476d1ce4e5b9ull;
+	h ^= h >> 27;
+	return h;
+}
+
+// The camera and light transport shared by the renderers below. Holds no
+// image, so any number of renderers can trace through one.
+class PathTracer {
+public:
+	static constexpr int MaxBounces = 4;
+protected:
+	const Bvh* _bvh;
+	Camera _camera;
+	// Camera basis, derived once per camera change.
+	Vec3 _forward, _right, _upward;
+	float _tanHalfFov;
+
+	// Until objects carry materials, each slot gets a stable pastel.
+	static Vec3 Albedo(uint32_t slot) {
+		uint64_t h = HashSeed(slot, 0);
+		return Vec3(0.3f + 0.5f * ((h & 0xff) / 255.0f), 0.3f + 0.5f * (((h >> 8) & 0xff) / 255.0f), 0.3f + 0.5f * (((h >> 16) & 0xff) / 255.0f));
+	}
+	// The sky is the only light.
+	static Vec3 Sky(const Vec3& direction) {
+		float t = 0.5f * (direction.y + 1.0f);
+		return Vec3(1, 1, 1) * (1.0f - t) + Vec3(0.5f, 0.7f, 1.0f) * t;
+	}
+	// Cosine weighted direction about the normal, which makes the Lambert
+	// pdf cancel against the BRDF and leaves throughput *= albedo.
+	static Vec3 SampleHemisphere(const Vec3& normal, Random& random) {
+		float r1 = 2.0f * 3.14159265f * random.Float();
+		float r2 = random.Float();
+		float r = sqrtf(r2);
+		Vec3 tangent = Normalize(Cross(fabsf(normal.x) > 0.1f ? Vec3(0, 1, 0) : Vec3(1, 0, 0), normal));
+		Vec3 bitangent = Cross(normal, tangent);
+		return Normalize(tangent * (cosf(r1) * r) + bitangent * (sinf(r1) * r) + normal * sqrtf(1.0f - r2));
+	}
+	Vec3 Radiance(Ray ray, Random& random) const {
+		Vec3 throughput(1, 1, 1);
+		for (int bounce = 0; bounce <= MaxBounces; ++bounce) {
+			Hit hit;
+			if (!_bvh->Intersect(ray, hit)) {
+				return Mul(throughput, Sky(Normalize(ray.direction)));
+			}
+			throughput = Mul(throughput, Albedo(hit.slot));
+			// Russian roulette once the path has had a chance to pick up light.
+			if (bounce >= 2) {
+				float survive = std::max(throughput.x, std::max(throughput.y, throughput.z));
+				if (random.Float() >= survive) {
+					break;
+				}
+				throughput = throughput * (1.0f / survive);
+			}
+			Vec3 normal = Dot(hit.normal, ray.direction) < 0.0f ? hit.normal : hit.normal * -1.0f;
+			ray = Ray(ray.At(hit.t) + normal * 1e-3f, SampleHemisphere(normal, random));
+		}
+		// Absorbed before reaching the sky.
+		return Vec3();
+	}
+public:
+	PathTracer(const Bvh& bvh) : _bvh(&bvh) {
+		SetCamera(_camera);
+	}
+	const Camera& GetCamera() const {
+		return _camera;
+	}
+	void SetCamera(const Camera& camera) {
+		_camera = camera;
+		_forward = Normalize(_camera.target - _camera.position);
+		// Same handedness as MatLookAt, so both renderers agree.
+		_right = Normalize(Cross(_forward, _camera.up));
+		_upward = Cross(_right, _forward);
+		_tanHalfFov = tanf(_camera.fovY * 0.5f * 3.14159265f / 180.0f);
+	}
+	// Sum of samples jittered paths through pixel (x, y) of a width x height
+	// image.
+	Vec3 TracePixel(int x, int y, int width, int height, int samples, Random& random) const {
+		Vec3 sum;
+		for (int s = 0; s < samples; ++s) {
+			float px = (2.0f * (x + random.Float()) / width - 1.0f) * _tanHalfFov * width / height;
+			float py = (1.0f - 2.0f * (y + random.Float()) / height) * _tanHalfFov;
+			Ray ray(_camera.position, Normalize(_forward + _right * px + _upward * py));
+			sum = sum + Radiance(ray, random);
+		}
+		return sum;
+	}
+};
+
+class ProgressiveRenderer {
+protected:
+	PathTracer _tracer;
+	int _width, _height;
+	std::vector<float> _accumulated;
+	uint32_t _samples;
+	uint32_t _passes;
+
+	void RenderRows(size_t first, size_t last, int samplesPerPixel) {
+		for (size_t y = first; y < last; ++y) {
+			for (int x = 0; x < _width; ++x) {
+				uint64_t pixel = (uint64_t)y * _width + x;
+				Random random(HashSeed(pixel, _passes));
+				Vec3 sum = _tracer.TracePixel(x, (int)y, _width, _height, samplesPerPixel, random);
+				float* accumulated = &_accumulated[pixel * 3];
+				accumulated[0] += sum.x;
+				accumulated[1] += sum.y;
+				accumulated[2] += sum.z;
+			}
+		}
+	}
+public:
+	ProgressiveRenderer(const Bvh& bvh, int width, int height) : _tracer(bvh), _width(width), _height(height), _accumulated((size_t)width * height * 3, 0.0f), _samples(0), _passes(0) {}
+	// Throws away the accumulated samples only if the camera actually moved.
+	void SetCamera(const Camera& camera) {
+		if (camera != _tracer.GetCamera()) {
+			_tracer.SetCamera(camera);
+			Reset();
+		}
+	}
+	// Call after editing the world and refitting or rebuilding the BVH.
+	void WorldChanged() {
+		Reset();
+	}
+	void Reset() {
+		std::fill(_accumulated.begin(), _accumulated.end(), 0.0f);
+		_samples = 0;
+	}
+	// Add samplesPerPixel samples to every pixel.
+	void RenderPass(int samplesPerPixel = 1) {
+		PROFILE_ZONE("ProgressiveRenderer::RenderPass");
+		ThreadPool::Shared().ParallelFor(0, _height, [this, samplesPerPixel](size_t first, size_t last) {
+			RenderRows(first, last, samplesPerPixel);
+		});
+		_samples += samplesPerPixel;
+		++_passes;
+	}
+	uint32_t SamplesPerPixel() const {
+		return _samples;
+	}
+	// The current mean of everything accumulated.
+	void Estimate(Image& image) const {
+		image = Image(_width, _height);
+		float scale = _samples > 0 ? 1.0f / _samples : 0.0f;
+		for (size_t i = 0; i < _accumulated.size(); ++i) {
+			image.rgb[i] = _accumulated[i] * scale;
+		}
+	}
+};
+
+// Offline rendering without a frame buffer: every tile is traced to
+// completion and handed to out, so the first tile is out after one tile's
+// work and only one tile per worker is ever held. Seeds match the first
+// ProgressiveRenderer pass, so the assembled image is the same as one pass
+// of samplesPerPixel.
+inline void RenderTiles(const PathTracer& tracer, TileStreamOut& out, int samplesPerPixel, int tileSize = 32) {
+	PROFILE_ZONE("RenderTiles");
+	int width = out.Width(), height = out.Height();
+	int tilesX = (width + tileSize - 1) / tileSize, tilesY = (height + tileSize - 1) / tileSize;
+	ThreadPool::Shared().ParallelFor(0, (size_t)tilesX * tilesY, [&](size_t first, size_t last) {
+		std::vector<float> rgb((size_t)tileSize * tileSize * 3);
+		for (size_t tile = first; tile < last; ++tile) {
+			int x0 = (int)(tile % tilesX) * tileSize, y0 = (int)(tile / tilesX) * tileSize;
+			int w = std::min(tileSize, width - x0), h = std::min(tileSize, height - y0);
+			for (int y = 0; y < h; ++y) {
+				for (int x = 0; x < w; ++x) {
+					uint64_t pixel = (uint64_t)(y0 + y) * width + x0 + x;
+					Random random(HashSeed(pixel, 0));
+					Vec3 sum = tracer.TracePixel(x0 + x, y0 + y, width, height, samplesPerPixel, random) * (1.0f / samplesPerPixel);
+					float* p = &rgb[((size_t)y * w + x) * 3];
+					p[0] = sum.x;
+					p[1] = sum.y;
+					p[2] = sum.z;
+				}
+			}
+			out.WriteTile(x0, y0, w, h, rgb.data());
+		}
+	});
+}
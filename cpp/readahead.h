@@ -0,0 +1,163 @@
+#pragma once
+
+///////////////////////////////////////////////////////////////////////////////
+// Read Ahead.
+//
+// A Load loop over a file stream parses a few bytes, blocks in the kernel
+// for the next few, parses those, and so on: the disk idles while we parse
+// and we idle while it reads. ReadAheadStreamIn wraps any IStreamIn and has a
+// background thread keep a ring of blocks filled from it, so by the time the
+// loader asks for bytes they are normally already in memory and ReadBytes is
+// a memcpy.
+//
+// IStreamIn can't report how much it has left, and a short read throws
+// without saying how many bytes it got, so the decorator is told the size of
+// what it wraps and never asks for more. FileSize gets it for a file.
+//
+// The inner stream belongs to the background thread from construction until
+// the decorator is destroyed; don't read from it directly in between. An
+// exception from the inner stream is held and rethrown by the ReadBytes that
+// reaches the block it failed on.
+///////////////////////////////////////////////////////////////////////////////
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include "geometric.h"
+
+inline uint64_t FileSize(const char* path) {
+	struct stat info;
+	if (stat(path, &info) != 0) {
+		throw StreamException("Cannot stat file");
+	}
+	return (uint64_t)info.st_size;
+}
+
+class ReadAheadStreamIn : public IStreamIn {
+public:
+	struct Stats {
+		size_t blocks = 0;
+		// ReadBytes calls that found the next block not yet loaded, and how
+		// long they waited for it.
+		size_t stalls = 0;
+		double stallMs = 0.0;
+	};
+protected:
+	IStreamIn& _inner;
+	uint64_t _size;
+	size_t _blockSize;
+	// The ring. Block n lives in slot n % slots and holds bytes from
+	// n * blockSize.
+	std::vector<std::unique_ptr<uint8_t[]>> _slots;
+	std::mutex _mutex;
+	std::condition_variable _wake;
+	// Blocks loaded by the thread and blocks released by the reader. Both
+	// only grow; loaded - released slots are full.
+	uint64_t _loaded;
+	uint64_t _released;
+	std::exception_ptr _error;
+	bool _stopping;
+	// Reader side, touched only by the thread calling ReadBytes.
+	uint64_t _position;
+	Stats _stats;
+	std::thread _thread;
+
+	uint64_t Blocks() const {
+		return (_size + _blockSize - 1) / _blockSize;
+	}
+	size_t BlockBytes(uint64_t block) const {
+		return (size_t)std::min<uint64_t>(_blockSize, _size - block * _blockSize);
+	}
+	void Worker() {
+		for (uint64_t block = 0; block < Blocks(); ++block) {
+			{
+				std::unique_lock<std::mutex> lock(_mutex);
+				_wake.wait(lock, [this, block]() { return _stopping || block - _released < _slots.size(); });
+				if (_stopping) {
+					return;
+				}
+			}
+			// The slot is ours until _loaded moves past it.
+			try {
+				_inner.ReadBytes(_slots[block % _slots.size()].get(), (int)BlockBytes(block));
+			} catch (...) {
+				std::lock_guard<std::mutex> lock(_mutex);
+				_error = std::current_exception();
+				_wake.notify_all();
+				return;
+			}
+			std::lock_guard<std::mutex> lock(_mutex);
+			_loaded = block + 1;
+			_wake.notify_all();
+		}
+	}
+public:
+	// Reads size bytes of inner in blockSize pieces, keeping up to window
+	// blocks ahead of the reader.
+	ReadAheadStreamIn(IStreamIn& inner, uint64_t size, size_t window = 8, size_t blockSize = 256 << 10)
+		: _inner(inner), _size(size), _blockSize(std::max<size_t>(1, blockSize)), _loaded(0), _released(0), _stopping(false), _position(0) {
+		for (size_t i = 0; i < std::max<size_t>(1, window); ++i) {
+			_slots.emplace_back(new uint8_t[_blockSize]);
+		}
+		_thread = std::thread([this]() { Worker(); });
+	}
+	ReadAheadStreamIn(const ReadAheadStreamIn&) = delete;
+	ReadAheadStreamIn& operator=(const ReadAheadStreamIn&) = delete;
+	// Waits for the block in progress, if any, then stops.
+	virtual ~ReadAheadStreamIn() {
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_stopping = true;
+		}
+		_wake.notify_all();
+		_thread.join();
+	}
+	virtual void ReadBytes(void* buffer, int count) override {
+		if (count < 0 || _size - _position < (uint64_t)count) {
+			throw StreamException("Read past end of read ahead stream");
+		}
+		uint8_t* target = (uint8_t*)buffer;
+		size_t remaining = (size_t)count;
+		while (remaining > 0) {
+			uint64_t block = _position / _blockSize;
+			size_t offset = (size_t)(_position % _blockSize);
+			{
+				std::unique_lock<std::mutex> lock(_mutex);
+				if (_loaded <= block && !_error) {
+					auto begin = std::chrono::steady_clock::now();
+					_wake.wait(lock, [this, block]() { return _loaded > block || _error; });
+					++_stats.stalls;
+					_stats.stallMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+				}
+				if (_loaded <= block) {
+					std::rethrow_exception(_error);
+				}
+			}
+			size_t chunk = std::min(remaining, BlockBytes(block) - offset);
+			memcpy(target, _slots[block % _slots.size()].get() + offset, chunk);
+			_position += chunk;
+			target += chunk;
+			remaining -= chunk;
+			if (_position % _blockSize == 0 || _position == _size) {
+				std::lock_guard<std::mutex> lock(_mutex);
+				_released = block + 1;
+				++_stats.blocks;
+				_wake.notify_all();
+			}
+		}
+	}
+	bool AtEnd() const {
+		return _position == _size;
+	}
+	Stats GetStats() const {
+		return _stats;
+	}
+};
@@ -0,0 +1,176 @@
+#include "bench.h"
+#include "binnedraster.h"
+#include "bvh.h"
+#include "geometric.h"
+#include "raster.h"
+#include "raytrace.h"
+#include "scenes.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Scene Benchmark.
+//
+// Runs every scene in the suite through the same pipeline and times each
+// stage on its own:
+//
+//   generate    build the world from the generator
+//   bvh         Bvh::Build over the world
+//   trace       one path traced pass, 1 sample per pixel
+//   tessellate  every tessellatable object into one mesh
+//   raster      that mesh through the binned rasterizer, lambert shaded
+//   save        SaveEverything into memory
+//   load        LoadObject over what save wrote
+//
+// A stage with nothing to work on is skipped rather than timed: a world with
+// nothing serializable has no save or load rows, and one with nothing
+// tessellatable has no tessellate or raster rows.
+//
+// Each stage runs --repeat times and reports the median. Results are named
+// <scene>/<stage> and written in the bench JSON format, so --baseline
+// compares two runs with the same Mann-Whitney test as bench does.
+//
+// scenebench [--scene <name>] [--repeat <count>] [--out <results.json>]
+//            [--baseline <file>]
+///////////////////////////////////////////////////////////////////////////////
+
+#include <iomanip>
+#include <iostream>
+
+class StageTimer {
+protected:
+	std::string _scene;
+	int _repeat;
+	std::vector<BenchmarkResult>& _results;
+public:
+	StageTimer(const std::string& scene, int repeat, std::vector<BenchmarkResult>& results) : _scene(scene), _repeat(repeat), _results(results) {}
+	// Runs fn repeat times, keeping one sample per run.
+	void Run(const char* stage, std::function<void()> fn) {
+		BenchmarkResult result;
+		result.name = _scene + "/" + stage;
+		result.iterations = 1;
+		for (int i = 0; i < _repeat; ++i) {
+			auto begin = std::chrono::steady_clock::now();
+			fn();
+			result.samples.push_back(std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin).count());
+		}
+		Benchmarks::Summarize(result);
+		_results.push_back(result);
+	}
+};
+
+int main(int argc, const char** argv) {
+	const char* only = nullptr;
+	const char* outPath = nullptr;
+	const char* baselinePath = nullptr;
+	int repeat = 5;
+	for (int i = 1; i + 1 < argc; i += 2) {
+		if (strcmp(argv[i], "--scene") == 0) {
+			only = argv[i + 1];
+		} else if (strcmp(argv[i], "--repeat") == 0) {
+			repeat = std::max(1, atoi(argv[i + 1]));
+		} else if (strcmp(argv[i], "--out") == 0) {
+			outPath = argv[i + 1];
+		} else if (strcmp(argv[i], "--baseline") == 0) {
+			baselinePath = argv[i + 1];
+		}
+	}
+	const int traceWidth = 160, traceHeight = 100;
+	const int rasterWidth = 640, rasterHeight = 400;
+	NullBuffer null;
+	std::streambuf* console = std::cout.rdbuf();
+	std::ostream log(console);
+	std::vector<BenchmarkResult> results;
+	log << std::fixed << std::setprecision(2);
+	for (const SceneEntry& entry : SceneSuite()) {
+		if (only != nullptr && strcmp(only, entry.name) != 0) {
+			continue;
+		}
+		std::cout.rdbuf(&null);
+		size_t first = results.size();
+		StageTimer timer(entry.name, repeat, results);
+		Scene scene;
+		timer.Run("generate", [&]() {
+			scene = entry.create();
+		});
+		bool tessellatable = false, serializable = false;
+		for (auto& object : *scene.world) {
+			tessellatable = tessellatable || dynamic_cast<ITessellatable*>(object.get()) != nullptr;
+			serializable = serializable || dynamic_cast<ISerializable*>(object.get()) != nullptr;
+		}
+		Bvh bvh;
+		timer.Run("bvh", [&]() {
+			bvh.Build(scene.world);
+		});
+		timer.Run("trace", [&]() {
+			ProgressiveRenderer renderer(bvh, traceWidth, traceHeight);
+			renderer.SetCamera(scene.camera);
+			renderer.RenderPass(1);
+		});
+		TriangleMesh mesh;
+		RasterStats stats;
+		if (tessellatable) {
+			timer.Run("tessellate", [&]() {
+				mesh = TriangleMesh();
+				for (auto& object : *scene.world) {
+					ITessellatable* tessellatable = dynamic_cast<ITessellatable*>(object.get());
+					if (tessellatable != nullptr) {
+						tessellatable->Tessellate(mesh);
+					}
+				}
+			});
+			StandardVertexShader vertex;
+			vertex.viewProjection = MatLookAt(scene.camera.position, scene.camera.target, scene.camera.up)
+				* MatProjection(scene.camera.fovY, (float)rasterWidth / rasterHeight, 0.1f, 1000.0f);
+			LambertShader fragment;
+			fragment.light = Normalize(Vec3(0.4f, 1.0f, -0.6f));
+			Framebuffer target(rasterWidth, rasterHeight);
+			BinnedRasterizer<StandardVertexShader::Varyings> rasterizer;
+			timer.Run("raster", [&]() {
+				target.Clear(Vec3(0.5f, 0.7f, 1.0f));
+				stats = rasterizer.Draw(target, mesh, vertex, fragment);
+			});
+		}
+		MemoryStream saved;
+		size_t loaded = 0;
+		if (serializable) {
+			timer.Run("save", [&]() {
+				saved = MemoryStream();
+				SaveEverything(scene.world, saved);
+			});
+			timer.Run("load", [&]() {
+				MemoryStreamIn in(saved.data(), saved.size());
+				loaded = 0;
+				while (!in.AtEnd()) {
+					LoadObject(in);
+					++loaded;
+				}
+			});
+		}
+		std::cout.rdbuf(console);
+		log << "** " << entry.name << ": " << scene.world->size() << " objects, " << bvh.GetStats().nodes << " BVH nodes, "
+			<< mesh.indices.size() / 3 << " triangles, " << stats.fragments << " fragments, " << saved.size() << " bytes saved, "
+			<< loaded << " loaded" << std::endl;
+		for (size_t i = first; i < results.size(); ++i) {
+			log << "  " << std::left << std::setw(36) << results[i].name << std::right << std::setw(10) << results[i].median / 1e6 << "ms"
+				<< "  (mad " << results[i].mad / 1e6 << "ms)" << std::endl;
+		}
+	}
+	if (outPath != nullptr) {
+		std::ofstream out(outPath);
+		WriteBenchmarkJson(out, results);
+		std::cout << "Results written to " << outPath << std::endl;
+	}
+	if (baselinePath != nullptr) {
+		std::ifstream in(baselinePath);
+		if (!in) {
+			std::cout << "Cannot open baseline " << baselinePath << std::endl;
+			return 1;
+		}
+		try {
+			CompareBenchmarks(std::cout, results, ReadBenchmarkJson(in));
+		} catch (const std::runtime_error& e) {
+			std::cout << e.what() << std::endl;
+			return 1;
+		}
+	}
+	return 0;
+}
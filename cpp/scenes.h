@@ -0,0 +1,162 @@
+#pragma once
+
+///////////////////////////////////////////////////////////////////////////////
+// Benchmark Scenes.
+//
+// A fixed suite of worlds for measuring renderers and world code against each
+// other and across changes. Each generator is a pure function of its
+// arguments: positions come from a seeded PCG32 stream, never from the clock
+// or the address of anything, so two runs of the same build see the same
+// world down to the bit, and two builds see the same world as long as the
+// generators don't change.
+//
+// The scenes pull in different directions:
+//
+//   many-spheres     thousands of small objects: BVH build and traversal,
+//                    per-object overhead, sub-pixel triangles.
+//   huge-meshes      a few parametric surfaces tessellated to millions of
+//                    triangles each: tessellation, big meshes through the
+//                    rasterizer, Newton intersection, and the Mesh records
+//                    that stand for them when saved.
+//   deep-hierarchy   a sphereflake, each sphere carrying smaller ones on its
+//                    surface; the world is flat, so the depth is in the
+//                    nesting of the bounds, which gives a deep BVH with
+//                    overlapping siblings.
+//   dense-occluders  rows of wall panels one behind the other: depth
+//                    complexity for the rasterizer, occlusion for rays.
+///////////////////////////////////////////////////////////////////////////////
+
+#include <cmath>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "geometric.h"
+#include "parametric.h"
+#include "raytrace.h"
+
+struct Scene {
+	std::string name;
+	SharedWorld world;
+	Camera camera;
+};
+
+inline Scene ManySpheresScene(int count = 4000, uint64_t seed = 1) {
+	Scene scene;
+	scene.name = "many-spheres";
+	scene.world = std::make_shared<World>();
+	Random random(seed);
+	scene.world->push_back(SharedGeomFactory().CreateBox(120.0f, 1.0f, 120.0f, Vec3(0.0f, -0.5f, 0.0f)));
+	for (int i = 0; i < count; ++i) {
+		Vec3 center((random.Float() - 0.5f) * 100.0f, 0.5f + random.Float() * 20.0f, (random.Float() - 0.5f) * 100.0f);
+		scene.world->push_back(SharedGeomFactory().CreateSphere(0.2f + random.Float() * 0.4f, center));
+	}
+	scene.camera.position = Vec3(0.0f, 40.0f, -90.0f);
+	scene.camera.target = Vec3(0.0f, 5.0f, 0.0f);
+	return scene;
+}
+
+// Each surface is tessellated at steps times its patch count a side; the
+// defaults give 4.7M triangles a surface.
+inline Scene HugeMeshesScene(int patches = 64, int steps = 24) {
+	Scene scene;
+	scene.name = "huge-meshes";
+	scene.world = std::make_shared<World>();
+	// Rolling terrain. v runs towards -z so the normal faces up.
+	scene.world->push_back(std::make_shared<ParametricSurface>([](float u, float v) {
+		float x = (u - 0.5f) * 60.0f, z = (0.5f - v) * 60.0f;
+		return Vec3(x, 0.8f * sinf(x * 0.4f) * cosf(z * 0.3f) - 1.0f, z);
+	}, Vec3(), patches, patches, steps));
+	// A lumpy ball, wound like spherePos.
+	scene.world->push_back(std::make_shared<ParametricSurface>([](float u, float v) {
+		float au = 6.28318531f * u, av = 3.14159265f * v;
+		float r = 5.0f * (1.0f + 0.08f * sinf(7.0f * au) * sinf(5.0f * av));
+		return Vec3(r * sinf(av) * cosf(au), r * cosf(av), r * sinf(av) * sinf(au));
+	}, Vec3(-8.0f, 5.0f, 4.0f), patches, patches, steps));
+	// A torus whose tube swells and thins, wound like TessellateTorus.
+	scene.world->push_back(std::make_shared<ParametricSurface>([](float u, float v) {
+		float au = 6.28318531f * u, av = -6.28318531f * v;
+		float minor = 1.5f * (1.0f + 0.3f * sinf(6.0f * au));
+		return Vec3((7.0f + minor * cosf(av)) * cosf(au), minor * sinf(av), (7.0f + minor * cosf(av)) * sinf(au));
+	}, Vec3(9.0f, 2.5f, 6.0f), patches, patches, steps));
+	// A surface function can't be saved, so each surface is paired with the
+	// Mesh record of its tessellation, which is what goes to disk.
+	int grid = patches * steps;
+	size_t surfaces = scene.world->size();
+	for (size_t i = 0; i < surfaces; ++i) {
+		Bounds bounds = dynamic_cast<IBounded*>((*scene.world)[i].get())->GetBounds();
+		scene.world->push_back(std::make_shared<Mesh>((grid + 1) * (grid + 1), 2 * grid * grid, bounds));
+	}
+	scene.camera.position = Vec3(0.0f, 18.0f, -32.0f);
+	scene.camera.target = Vec3(0.0f, 2.0f, 4.0f);
+	return scene;
+}
+
+inline void AddSphereflake(World& world, const Vec3& center, float radius, const Vec3& up, int depth) {
+	world.push_back(SharedGeomFactory().CreateSphere(radius, center));
+	if (depth == 0) {
+		return;
+	}
+	// Six children around the equator and three above, relative to up.
+	Vec3 side = Normalize(Cross(up, fabsf(up.y) < 0.9f ? Vec3(0, 1, 0) : Vec3(1, 0, 0)));
+	Vec3 other = Cross(up, side);
+	float childRadius = radius / 3.0f;
+	for (int i = 0; i < 9; ++i) {
+		float angle = 6.28318531f * (i < 6 ? i / 6.0f : (i - 6) / 3.0f + 1.0f / 12.0f);
+		float lift = i < 6 ? 0.0f : 0.8f;
+		Vec3 direction = Normalize(side * cosf(angle) + other * sinf(angle) + up * lift);
+		AddSphereflake(world, center + direction * (radius + childRadius), childRadius, direction, depth - 1);
+	}
+}
+
+inline Scene DeepHierarchyScene(int depth = 4) {
+	Scene scene;
+	scene.name = "deep-hierarchy";
+	scene.world = std::make_shared<World>();
+	scene.world->push_back(SharedGeomFactory().CreateBox(40.0f, 1.0f, 40.0f, Vec3(0.0f, -0.5f, 0.0f)));
+	AddSphereflake(*scene.world, Vec3(0.0f, 4.0f, 0.0f), 3.0f, Vec3(0.0f, 1.0f, 0.0f), depth);
+	scene.camera.position = Vec3(0.0f, 9.0f, -14.0f);
+	scene.camera.target = Vec3(0.0f, 4.0f, 0.0f);
+	return scene;
+}
+
+// Layers of panels with gaps, each layer shifted so the gaps don't line up,
+// and a row of spheres behind them all.
+inline Scene DenseOccludersScene(int layers = 16, uint64_t seed = 2) {
+	Scene scene;
+	scene.name = "dense-occluders";
+	scene.world = std::make_shared<World>();
+	Random random(seed);
+	for (int layer = 0; layer < layers; ++layer) {
+		float z = layer * 1.5f;
+		float shift = random.Float() * 2.0f;
+		for (int row = 0; row < 6; ++row) {
+			for (int column = 0; column < 12; ++column) {
+				Vec3 center(column * 2.2f - 12.0f + shift, row * 2.2f + 1.0f, z);
+				scene.world->push_back(SharedGeomFactory().CreateBox(1.8f, 1.8f, 0.2f, center));
+			}
+		}
+	}
+	for (int i = 0; i < 8; ++i) {
+		scene.world->push_back(SharedGeomFactory().CreateSphere(2.0f, Vec3(i * 4.0f - 14.0f, 6.0f, layers * 1.5f + 4.0f)));
+	}
+	scene.camera.position = Vec3(0.0f, 7.0f, -16.0f);
+	scene.camera.target = Vec3(0.0f, 6.0f, 0.0f);
+	return scene;
+}
+
+struct SceneEntry {
+	const char* name;
+	std::function<Scene()> create;
+};
+
+// The suite with default sizes, in a fixed order.
+inline const std::vector<SceneEntry>& SceneSuite() {
+	static const std::vector<SceneEntry> suite = {
+		{ "many-spheres", []() { return ManySpheresScene(); } },
+		{ "huge-meshes", []() { return HugeMeshesScene(); } },
+		{ "deep-hierarchy", []() { return DeepHierarchyScene(); } },
+		{ "dense-occluders", []() { return DenseOccludersScene(); } },
+	};
+	return suite;
+}
@@ -0,0 +1,148 @@
+#pragma once
+
+///////////////////////////////////////////////////////////////////////////////
+// SIMD Lanes.
+//
+// Four floats processed together. Code written against Float4 reads like
+// scalar code, and code templated on its number type runs unchanged on float
+// or Float4, which is how shaders get to run one pixel or a 2x2 quad at a
+// time from one source. Comparisons return lane masks (all bits set or
+// clear) held in a Float4, for Select and MoveMask.
+//
+// SSE2 when the compiler has it, otherwise plain arrays that the optimizer
+// can still vectorize.
+///////////////////////////////////////////////////////////////////////////////
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define SIMD_SSE2 1
+#else
+#define SIMD_SSE2 0
+#endif
+
+struct Float4 {
+#if SIMD_SSE2
+	__m128 v;
+	Float4() : v(_mm_setzero_ps()) {}
+	Float4(__m128 v) : v(v) {}
+	Float4(float s) : v(_mm_set1_ps(s)) {}
+	Float4(float a, float b, float c, float d) : v(_mm_setr_ps(a, b, c, d)) {}
+	static Float4 Load(const float* p) { return _mm_loadu_ps(p); }
+	void Store(float* p) const { _mm_storeu_ps(p, v); }
+	float operator[](int i) const { float lanes[4]; Store(lanes); return lanes[i]; }
+	Float4 operator+(const Float4& b) const { return _mm_add_ps(v, b.v); }
+	Float4 operator-(const Float4& b) const { return _mm_sub_ps(v, b.v); }
+	Float4 operator*(const Float4& b) const { return _mm_mul_ps(v, b.v); }
+	Float4 operator/(const Float4& b) const { return _mm_div_ps(v, b.v); }
+	Float4 operator-() const { return _mm_sub_ps(_mm_setzero_ps(), v); }
+	Float4 operator<(const Float4& b) const { return _mm_cmplt_ps(v, b.v); }
+	Float4 operator<=(const Float4& b) const { return _mm_cmple_ps(v, b.v); }
+	Float4 operator>(const Float4& b) const { return _mm_cmpgt_ps(v, b.v); }
+	Float4 operator>=(const Float4& b) const { return _mm_cmpge_ps(v, b.v); }
+	Float4 operator&(const Float4& b) const { return _mm_and_ps(v, b.v); }
+	Float4 operator|(const Float4& b) const { return _mm_or_ps(v, b.v); }
+#else
+	float v[4];
+	Float4() : v{ 0.0f, 0.0f, 0.0f, 0.0f } {}
+	Float4(float s) : v{ s, s, s, s } {}
+	Float4(float a, float b, float c, float d) : v{ a, b, c, d } {}
+	static Float4 Load(const float* p) { return Float4(p[0], p[1], p[2], p[3]); }
+	void Store(float* p) const { memcpy(p, v, sizeof(v)); }
+	float operator[](int i) const { return v[i]; }
+	template <class F> Float4 Map(const Float4& b, F f) const {
+		return Float4(f(v[0], b.v[0]), f(v[1], b.v[1]), f(v[2], b.v[2]), f(v[3], b.v[3]));
+	}
+	static float MaskOf(bool b) { uint32_t bits = b ? ~0u : 0u; float f; memcpy(&f, &bits, 4); return f; }
+	static uint32_t Bits(float f) { uint32_t bits; memcpy(&bits, &f, 4); return bits; }
+	static float FromBits(uint32_t bits) { float f; memcpy(&f, &bits, 4); return f; }
+	Float4 operator+(const Float4& b) const { return Map(b, [](float x, float y) { return x + y; }); }
+	Float4 operator-(const Float4& b) const { return Map(b, [](float x, float y) { return x - y; }); }
+	Float4 operator*(const Float4& b) const { return Map(b, [](float x, float y) { return x * y; }); }
+	Float4 operator/(const Float4& b) const { return Map(b, [](float x, float y) { return x / y; }); }
+	Float4 operator-() const { return Float4(-v[0], -v[1], -v[2], -v[3]); }
+	Float4 operator<(const Float4& b) const { return Map(b, [](float x, float y) { return MaskOf(x < y); }); }
+	Float4 operator<=(const Float4& b) const { return Map(b, [](float x, float y) { return MaskOf(x <= y); }); }
+	Float4 operator>(const Float4& b) const { return Map(b, [](float x, float y) { return MaskOf(x > y); }); }
+	Float4 operator>=(const Float4& b) const { return Map(b, [](float x, float y) { return MaskOf(x >= y); }); }
+	Float4 operator&(const Float4& b) const { return Map(b, [](float x, float y) { return FromBits(Bits(x) & Bits(y)); }); }
+	Float4 operator|(const Float4& b) const { return Map(b, [](float x, float y) { return FromBits(Bits(x) | Bits(y)); }); }
+#endif
+	Float4& operator+=(const Float4& b) { return *this = *this + b; }
+	Float4& operator-=(const Float4& b) { return *this = *this - b; }
+	Float4& operator*=(const Float4& b) { return *this = *this * b; }
+};
+
+// Lane i of the mask becomes bit i of the result.
+inline int MoveMask(const Float4& mask) {
+#if SIMD_SSE2
+	return _mm_movemask_ps(mask.v);
+#else
+	int bits = 0;
+	for (int i = 0; i < 4; ++i) {
+		bits |= (Float4::Bits(mask.v[i]) >> 31) << i;
+	}
+	return bits;
+#endif
+}
+
+// Rows to columns: afterwards a holds lane 0 of all four inputs, and so on.
+inline void Transpose(Float4& a, Float4& b, Float4& c, Float4& d) {
+#if SIMD_SSE2
+	_MM_TRANSPOSE4_PS(a.v, b.v, c.v, d.v);
+#else
+	Float4 rows[4] = { a, b, c, d };
+	a = Float4(rows[0].v[0], rows[1].v[0], rows[2].v[0], rows[3].v[0]);
+	b = Float4(rows[0].v[1], rows[1].v[1], rows[2].v[1], rows[3].v[1]);
+	c = Float4(rows[0].v[2], rows[1].v[2], rows[2].v[2], rows[3].v[2]);
+	d = Float4(rows[0].v[3], rows[1].v[3], rows[2].v[3], rows[3].v[3]);
+#endif
+}
+
+// mask ? a : b, per lane.
+inline Float4 Select(const Float4& mask, const Float4& a, const Float4& b) {
+#if SIMD_SSE2
+	return _mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v));
+#else
+	int m = MoveMask(mask);
+	return Float4(m & 1 ? a.v[0] : b.v[0], m & 2 ? a.v[1] : b.v[1], m & 4 ? a.v[2] : b.v[2], m & 8 ? a.v[3] : b.v[3]);
+#endif
+}
+
+// The inverse of MoveMask: lane i is set where bit i is.
+inline Float4 LaneMask(int bits) {
+	return Float4((float)(bits & 1), (float)(bits & 2), (float)(bits & 4), (float)(bits & 8)) > Float4(0.0f);
+}
+
+inline float Select(bool mask, float a, float b) {
+	return mask ? a : b;
+}
+
+// Math that shaders use, overloaded so the same template compiles for float
+// and Float4.
+inline float Min(float a, float b) { return a < b ? a : b; }
+inline float Max(float a, float b) { return a > b ? a : b; }
+inline float Sqrt(float a) { return sqrtf(a); }
+inline float Floor(float a) { return floorf(a); }
+inline float Clamp(float a, float lo, float hi) { return Min(Max(a, lo), hi); }
+
+#if SIMD_SSE2
+inline Float4 Min(const Float4& a, const Float4& b) { return _mm_min_ps(a.v, b.v); }
+inline Float4 Max(const Float4& a, const Float4& b) { return _mm_max_ps(a.v, b.v); }
+inline Float4 Sqrt(const Float4& a) { return _mm_sqrt_ps(a.v); }
+// SSE2 has no round instruction: truncate, then step down where that
+// rounded a negative value up.
+inline Float4 Floor(const Float4& a) {
+	Float4 truncated = _mm_cvtepi32_ps(_mm_cvttps_epi32(a.v));
+	return truncated - (Float4(_mm_cmpgt_ps(truncated.v, a.v)) & Float4(1.0f));
+}
+#else
+inline Float4 Min(const Float4& a, const Float4& b) { return a.Map(b, [](float x, float y) { return x < y ? x : y; }); }
+inline Float4 Max(const Float4& a, const Float4& b) { return a.Map(b, [](float x, float y) { return x > y ? x : y; }); }
+inline Float4 Sqrt(const Float4& a) { return Float4(sqrtf(a.v[0]), sqrtf(a.v[1]), sqrtf(a.v[2]), sqrtf(a.v[3])); }
+inline Float4 Floor(const Float4& a) { return Float4(floorf(a.v[0]), floorf(a.v[1]), floorf(a.v[2]), floorf(a.v[3])); }
+#endif
+inline Float4 Clamp(const Float4& a, const Float4& lo, const Float4& hi) { return Min(Max(a, lo), hi); }
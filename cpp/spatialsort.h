@@ -0,0 +1,211 @@
+#pragma once
+
+///////////////////////////////////////////////////////////////////////////////
+// Spatial Ordering.
+//
+// World keeps objects in insertion order, which has nothing to do with where
+// they are. Anything that walks space (culling, ray traversal, BVH builds)
+// then hops around memory. Sorting the world along a space filling curve
+// puts neighbours next to each other in the World array, and relocating the
+// objects in that order puts them next to each other on the heap as well.
+//
+// Reordering moves slots around, so code that remembers "object 17" needs a
+// handle that survives; WorldOrder keeps the handle <-> slot tables.
+///////////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <numeric>
+
+#include "geometric.h"
+
+enum class SpatialCurve {
+	Morton,
+	Hilbert,
+};
+
+// Spread the low 10 bits of v so there are two zero bits between each.
+inline uint32_t SpreadBits3(uint32_t v) {
+	v &= 0x3ff;
+	v = (v | (v << 16)) & 0x030000ff;
+	v = (v | (v << 8)) & 0x0300f00f;
+	v = (v | (v << 4)) & 0x030c30c3;
+	v = (v | (v << 2)) & 0x09249249;
+	return v;
+}
+
+inline uint32_t MortonCode3(uint32_t x, uint32_t y, uint32_t z) {
+	return SpreadBits3(x) | (SpreadBits3(y) << 1) | (SpreadBits3(z) << 2);
+}
+
+// Skilling's transpose algorithm ("Programming the Hilbert curve", 2004),
+// 10 bits per axis. Better locality than Morton at a few more operations.
+inline uint32_t HilbertCode3(uint32_t x, uint32_t y, uint32_t z) {
+	uint32_t a[3] = { x & 0x3ff, y & 0x3ff, z & 0x3ff };
+	const uint32_t top = 1u << 9;
+	for (uint32_t q = top; q > 1; q >>= 1) {
+		uint32_t p = q - 1;
+		for (int i = 0; i < 3; ++i) {
+			if (a[i] & q) {
+				a[0] ^= p;
+			} else {
+				uint32_t t = (a[0] ^ a[i]) & p;
+				a[0] ^= t;
+				a[i] ^= t;
+			}
+		}
+	}
+	a[1] ^= a[0];
+	a[2] ^= a[1];
+	uint32_t t = 0;
+	for (uint32_t q = top; q > 1; q >>= 1) {
+		if (a[2] & q) {
+			t ^= q - 1;
+		}
+	}
+	for (int i = 0; i < 3; ++i) {
+		a[i] ^= t;
+	}
+	// Interleave the transposed form with x as the most significant axis.
+	return (SpreadBits3(a[0]) << 2) | (SpreadBits3(a[1]) << 1) | SpreadBits3(a[2]);
+}
+
+// Quantize a point inside the given bounds to the 10 bit grid and encode it.
+inline uint32_t SpatialCode(SpatialCurve curve, const Vec3& p, const Bounds& bounds) {
+	Vec3 extent = bounds.Extent();
+	auto quantize = [](float v, float lo, float size) {
+		float t = size > 0.0f ? (v - lo) / size : 0.0f;
+		return (uint32_t)std::min(1023.0f, std::max(0.0f, t * 1024.0f));
+	};
+	uint32_t x = quantize(p.x, bounds.min.x, extent.x);
+	uint32_t y = quantize(p.y, bounds.min.y, extent.y);
+	uint32_t z = quantize(p.z, bounds.min.z, extent.z);
+	return curve == SpatialCurve::Morton ? MortonCode3(x, y, z) : HilbertCode3(x, y, z);
+}
+
+using ObjectHandle = uint32_t;
+
+class WorldOrder {
+protected:
+	std::vector<uint32_t> _slotOf;
+	std::vector<ObjectHandle> _handleOf;
+	std::vector<uint32_t> _codes;
+	size_t _cursor;
+
+	// Objects without bounds sort after everything else.
+	void ComputeCodes(SharedWorld& world, SpatialCurve curve) {
+		Bounds bounds;
+		for (auto& object : *world) {
+			IBounded* bounded = dynamic_cast<IBounded*>(object.get());
+			if (bounded != nullptr) {
+				bounds.Grow(bounded->GetBounds().Center());
+			}
+		}
+		_codes.resize(world->size());
+		for (size_t i = 0; i < world->size(); ++i) {
+			IBounded* bounded = dynamic_cast<IBounded*>((*world)[i].get());
+			_codes[i] = bounded != nullptr ? SpatialCode(curve, bounded->GetBounds().Center(), bounds) : UINT32_MAX;
+		}
+	}
+	void SwapSlots(SharedWorld& world, size_t a, size_t b) {
+		std::swap((*world)[a], (*world)[b]);
+		std::swap(_codes[a], _codes[b]);
+		std::swap(_handleOf[a], _handleOf[b]);
+		_slotOf[_handleOf[a]] = (uint32_t)a;
+		_slotOf[_handleOf[b]] = (uint32_t)b;
+	}
+public:
+	WorldOrder() : _cursor(0) {}
+	// Hand out handles for objects appended since the last call. Handles are
+	// assigned in slot order the first time an object is seen.
+	void Sync(SharedWorld& world) {
+		while (_handleOf.size() < world->size()) {
+			ObjectHandle handle = (ObjectHandle)_slotOf.size();
+			_slotOf.push_back((uint32_t)_handleOf.size());
+			_handleOf.push_back(handle);
+		}
+	}
+	uint32_t SlotOf(ObjectHandle handle) const {
+		return _slotOf[handle];
+	}
+	ObjectHandle HandleOf(uint32_t slot) const {
+		return _handleOf[slot];
+	}
+	SharedObject& Get(SharedWorld& world, ObjectHandle handle) const {
+		return (*world)[_slotOf[handle]];
+	}
+	// Full sort of the world along the curve.
+	void Reorder(SharedWorld& world, SpatialCurve curve = SpatialCurve::Hilbert) {
+		PROFILE_ZONE("WorldOrder::Reorder");
+		Sync(world);
+		ComputeCodes(world, curve);
+		std::vector<uint32_t> order(world->size());
+		std::iota(order.begin(), order.end(), 0);
+		std::stable_sort(order.begin(), order.end(), [this](uint32_t a, uint32_t b) {
+			return _codes[a] < _codes[b];
+		});
+		World sortedWorld(world->size());
+		std::vector<ObjectHandle> sortedHandles(world->size());
+		std::vector<uint32_t> sortedCodes(world->size());
+		for (size_t slot = 0; slot < order.size(); ++slot) {
+			sortedWorld[slot] = std::move((*world)[order[slot]]);
+			sortedHandles[slot] = _handleOf[order[slot]];
+			sortedCodes[slot] = _codes[order[slot]];
+			_slotOf[sortedHandles[slot]] = (uint32_t)slot;
+		}
+		world->swap(sortedWorld);
+		_handleOf.swap(sortedHandles);
+		_codes.swap(sortedCodes);
+		_cursor = 0;
+	}
+	// Incremental variant for worlds where things move a little each frame.
+	// Recomputes codes and runs odd-even transposition passes, resuming where
+	// the previous call stopped, until maxSwaps swaps have been made or a full
+	// pass found nothing out of order. Returns the number of swaps made.
+	size_t Refine(SharedWorld& world, size_t maxSwaps, SpatialCurve curve = SpatialCurve::Hilbert) {
+		PROFILE_ZONE("WorldOrder::Refine");
+		Sync(world);
+		ComputeCodes(world, curve);
+		size_t swaps = 0;
+		size_t n = world->size();
+		size_t clean = 0;
+		while (swaps < maxSwaps && clean < 2 * n && n > 1) {
+			if (_cursor + 1 >= n) {
+				// Alternate the parity of the pass start.
+				_cursor = (_cursor + 1) % 2;
+			}
+			if (_codes[_cursor] > _codes[_cursor + 1]) {
+				SwapSlots(world, _cursor, _cursor + 1);
+				++swaps;
+				clean = 0;
+			} else {
+				clean += 2;
+			}
+			_cursor += 2;
+		}
+		return swaps;
+	}
+	// Reallocate every serializable object in slot order so that heap order
+	// matches slot order. Objects are cloned through Save/LoadObject, which
+	// means anyone holding the old shared pointers keeps the old copy.
+	void Relocate(SharedWorld& world) {
+		PROFILE_ZONE("WorldOrder::Relocate");
+		MemoryStream buffer;
+		for (auto& object : *world) {
+			ISerializable* serial = dynamic_cast<ISerializable*>(object.get());
+			if (serial != nullptr) {
+				serial->Save(buffer);
+			}
+		}
+		// Build the copies while the originals are still alive so the
+		// allocator hands out fresh, ascending memory rather than recycling
+		// the old blocks in whatever order they are freed.
+		MemoryStreamIn stream(buffer.data(), buffer.size());
+		World relocated(*world);
+		for (auto& object : relocated) {
+			if (dynamic_cast<ISerializable*>(object.get()) != nullptr) {
+				object = LoadObject(stream);
+			}
+		}
+		world->swap(relocated);
+	}
+};
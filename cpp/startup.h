@@ -0,0 +1,134 @@
+#pragma once
+
+///////////////////////////////////////////////////////////////////////////////
+// Startup Timeline.
+//
+// Records how long it takes to get from process entry to the first useful
+// result. The first marks are taken for us: process creation (from /proc on
+// Linux), the first static initializer in this program and main() once the
+// caller marks it. Everything after that is up to the program, and lazily
+// initialized subsystems (see Lazy below) mark their own first-use cost.
+///////////////////////////////////////////////////////////////////////////////
+
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#if defined(__linux__)
+#include <time.h>
+#include <unistd.h>
+#endif
+
+class StartupTimeline {
+protected:
+	using Clock = std::chrono::steady_clock;
+	struct Mark {
+		std::string name;
+		Clock::time_point time;
+		double duration;
+	};
+	std::mutex _mutex;
+	Clock::time_point _origin;
+	double _processAge;
+	std::vector<Mark> _marks;
+
+	// Seconds since the kernel created this process, or a negative value if
+	// we cannot tell. Resolution is one scheduler tick.
+	static double ProcessAge() {
+#if defined(__linux__)
+		std::ifstream stat("/proc/self/stat");
+		std::string field;
+		// The command name may contain spaces; skip to the closing paren.
+		std::getline(stat, field, ')');
+		// starttime is field 22; we are positioned before field 3.
+		for (int i = 3; i <= 22 && stat >> field; ++i) {
+		}
+		timespec now;
+		if (!stat || clock_gettime(CLOCK_BOOTTIME, &now) != 0) {
+			return -1.0;
+		}
+		double started = std::stod(field) / sysconf(_SC_CLK_TCK);
+		return now.tv_sec + now.tv_nsec * 1e-9 - started;
+#else
+		return -1.0;
+#endif
+	}
+	StartupTimeline() : _origin(Clock::now()), _processAge(ProcessAge()) {
+		_marks.push_back({ "static-init", _origin, 0.0 });
+	}
+public:
+	static StartupTimeline& Instance() {
+		static StartupTimeline timeline;
+		return timeline;
+	}
+	// Duration is optional and used for things like lazy initializers that
+	// want to report what they cost as well as when they ran.
+	void Mark(const std::string& name, double duration = 0.0) {
+		std::lock_guard<std::mutex> lock(_mutex);
+		_marks.push_back({ name, Clock::now(), duration });
+	}
+	void Report(std::ostream& os) {
+		std::lock_guard<std::mutex> lock(_mutex);
+		os << "[Startup timeline]" << std::endl;
+		if (_processAge >= 0.0) {
+			os << "  process-start: -" << _processAge * 1e3 << "ms" << std::endl;
+		}
+		for (auto& mark : _marks) {
+			os << "  " << mark.name << ": +" << std::chrono::duration<double, std::milli>(mark.time - _origin).count() << "ms";
+			if (mark.duration > 0.0) {
+				os << " (took " << mark.duration * 1e3 << "ms)";
+			}
+			os << std::endl;
+		}
+	}
+};
+
+// Take the static-init mark as early as we can. init_priority only orders
+// within the toolchains that support it; elsewhere this is simply one of the
+// static initializers.
+#if defined(__GNUC__) && !defined(__APPLE__)
+__attribute__((init_priority(101)))
+#endif
+inline struct StartupTimelineAnchor {
+	StartupTimelineAnchor() {
+		StartupTimeline::Instance();
+	}
+} startupTimelineAnchor;
+
+#define STARTUP_MARK(name) StartupTimeline::Instance().Mark(name)
+
+///////////////////////////////////////////////////////////////////////////////
+// Lazy Initialization.
+//
+// Heavy subsystems are built on first use instead of at startup so that a
+// process only pays for what its first request needs. Construction is thread
+// safe and the first-use cost lands in the startup timeline.
+///////////////////////////////////////////////////////////////////////////////
+
+template <class T> class Lazy {
+protected:
+	const char* _name;
+	std::function<std::unique_ptr<T>()> _create;
+	std::once_flag _once;
+	std::unique_ptr<T> _value;
+public:
+	Lazy(const char* name, std::function<std::unique_ptr<T>()> create) : _name(name), _create(std::move(create)) {}
+	Lazy(const char* name) : Lazy(name, []() { return std::make_unique<T>(); }) {}
+	T& Get() {
+		std::call_once(_once, [this]() {
+			auto begin = std::chrono::steady_clock::now();
+			_value = _create();
+			double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+			StartupTimeline::Instance().Mark(std::string("lazy ") + _name, seconds);
+		});
+		return *_value;
+	}
+	T* operator->() {
+		return &Get();
+	}
+};
@@ -0,0 +1,178 @@
+#pragma once
+
+///////////////////////////////////////////////////////////////////////////////
+// Tee Stream.
+//
+// Saving a world to a file, a replica and an audit log used to mean running
+// the serializer once for each, encoding every object three times over.
+// TeeStreamOut is a single IStreamOut that hands every write on to any number
+// of sinks, so one SaveEverything pass feeds them all.
+//
+// A plain sink is written in line, in the order sinks were added, and an
+// exception from it comes straight back out of WriteBytes. A slow sink (a
+// network replica, say) would hold every other sink back to its pace, so a
+// sink can instead be added buffered: writes to it are copied into a buffer
+// that its own thread drains. The writer only waits for it once the buffer
+// is full. Buffered sinks see the same bytes in the same order, but not the
+// same calls: whatever has queued up goes down in one WriteBytes. Their
+// errors are held until Finish.
+///////////////////////////////////////////////////////////////////////////////
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "geometric.h"
+
+// One buffered sink: a byte queue and the thread that empties it into the
+// stream.
+class BufferedSink {
+protected:
+	IStreamOut& _stream;
+	size_t _capacity;
+	std::mutex _mutex;
+	std::condition_variable _wake;
+	std::vector<uint8_t> _pending;
+	bool _writing;
+	bool _stopping;
+	std::exception_ptr _error;
+	std::thread _thread;
+
+	void Worker() {
+		std::vector<uint8_t> writing;
+		std::unique_lock<std::mutex> lock(_mutex);
+		for (;;) {
+			_wake.wait(lock, [this]() { return _stopping || !_pending.empty(); });
+			if (_pending.empty()) {
+				return;
+			}
+			writing.swap(_pending);
+			_writing = true;
+			lock.unlock();
+			// After a failure the rest is dropped; Finish reports it.
+			if (!_error) {
+				try {
+					_stream.WriteBytes(writing.data(), (int)writing.size());
+				} catch (...) {
+					lock.lock();
+					_error = std::current_exception();
+					lock.unlock();
+				}
+			}
+			writing.clear();
+			lock.lock();
+			_writing = false;
+			_wake.notify_all();
+		}
+	}
+public:
+	BufferedSink(IStreamOut& stream, size_t capacity) : _stream(stream), _capacity(capacity), _writing(false), _stopping(false) {
+		_thread = std::thread([this]() { Worker(); });
+	}
+	BufferedSink(const BufferedSink&) = delete;
+	BufferedSink& operator=(const BufferedSink&) = delete;
+	// Drains what is queued before stopping.
+	~BufferedSink() {
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_stopping = true;
+		}
+		_wake.notify_all();
+		_thread.join();
+	}
+	// Blocks while the buffer is over capacity. A write bigger than the
+	// whole buffer waits for it to empty, then goes in on its own.
+	void Push(const void* buffer, int count) {
+		std::unique_lock<std::mutex> lock(_mutex);
+		_wake.wait(lock, [this, count]() { return _pending.empty() || _pending.size() + count <= _capacity; });
+		_pending.insert(_pending.end(), (const uint8_t*)buffer, (const uint8_t*)buffer + count);
+		_wake.notify_all();
+	}
+	// Waits until everything pushed has been written, then rethrows the
+	// sink's error, if it had one.
+	void Flush() {
+		std::unique_lock<std::mutex> lock(_mutex);
+		_wake.wait(lock, [this]() { return _pending.empty() && !_writing; });
+		if (_error) {
+			std::exception_ptr error = _error;
+			_error = nullptr;
+			std::rethrow_exception(error);
+		}
+	}
+};
+
+class TeeStreamOut : public IStreamOut {
+public:
+	static constexpr size_t DefaultCapacity = 4 << 20;
+protected:
+	struct Sink {
+		IStreamOut* stream;
+		std::unique_ptr<BufferedSink> buffered;
+	};
+	std::vector<Sink> _sinks;
+public:
+	TeeStreamOut() {}
+	TeeStreamOut(std::initializer_list<IStreamOut*> sinks) {
+		for (IStreamOut* sink : sinks) {
+			Add(*sink);
+		}
+	}
+	TeeStreamOut(const TeeStreamOut&) = delete;
+	TeeStreamOut& operator=(const TeeStreamOut&) = delete;
+	// Buffered sinks are drained on destruction, but only Finish reports
+	// their errors.
+	virtual ~TeeStreamOut() {
+		for (Sink& sink : _sinks) {
+			if (sink.buffered) {
+				try {
+					sink.buffered->Flush();
+				} catch (...) {
+				}
+			}
+		}
+	}
+	// Sinks must outlive the tee.
+	TeeStreamOut& Add(IStreamOut& stream) {
+		_sinks.push_back({ &stream, nullptr });
+		return *this;
+	}
+	TeeStreamOut& AddBuffered(IStreamOut& stream, size_t capacity = DefaultCapacity) {
+		_sinks.push_back({ &stream, std::make_unique<BufferedSink>(stream, capacity) });
+		return *this;
+	}
+	virtual void WriteBytes(const void* buffer, int count) override {
+		for (Sink& sink : _sinks) {
+			if (sink.buffered) {
+				sink.buffered->Push(buffer, count);
+			} else {
+				sink.stream->WriteBytes(buffer, count);
+			}
+		}
+	}
+	// Waits for every buffered sink to catch up. Throws the first error any
+	// of them hit, after all of them have been flushed.
+	void Finish() {
+		std::exception_ptr first;
+		for (Sink& sink : _sinks) {
+			if (sink.buffered) {
+				try {
+					sink.buffered->Flush();
+				} catch (...) {
+					if (!first) {
+						first = std::current_exception();
+					}
+				}
+			}
+		}
+		if (first) {
+			std::rethrow_exception(first);
+		}
+	}
+	size_t Sinks() const {
+		return _sinks.size();
+	}
+};
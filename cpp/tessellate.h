@@ -0,0 +1,158 @@
+#pragma once
+
+///////////////////////////////////////////////////////////////////////////////
+// Tessellation.
+//
+// Turns analytic primitives into indexed triangle lists. The layout follows
+// python/module_parametric.py: a (u + 1) x (v + 1) grid of vertices with a
+// duplicated seam, positions, normals and one UV channel (st0). Triangles
+// wind counter-clockwise when viewed from outside.
+///////////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "linalg.h"
+#include "startup.h"
+
+struct TriangleMesh {
+	std::vector<Vec3> positions;
+	std::vector<Vec3> normals;
+	std::vector<float> st0;
+	std::vector<uint32_t> indices;
+	size_t Bytes() const {
+		return sizeof(*this)
+			+ positions.capacity() * sizeof(Vec3)
+			+ normals.capacity() * sizeof(Vec3)
+			+ st0.capacity() * sizeof(float)
+			+ indices.capacity() * sizeof(uint32_t);
+	}
+	size_t Triangles() const {
+		return indices.size() / 3;
+	}
+};
+
+// Sine/cosine of pi * i / steps for i in [0, 2 * steps]: longitude uses the
+// even entries and latitude the first half. Every sphere shares one table
+// so it is built once, on the first sphere anyone asks for.
+struct TessellationTable {
+	int steps;
+	std::vector<float> cosines, sines;
+	TessellationTable(int steps) : steps(steps) {
+		for (int i = 0; i <= 2 * steps; ++i) {
+			float angle = 3.14159265f * i / steps;
+			cosines.push_back(cosf(angle));
+			sines.push_back(sinf(angle));
+		}
+	}
+	int Vertices() const {
+		return (steps + 1) * (steps + 1);
+	}
+	int Triangles() const {
+		return steps * steps * 2;
+	}
+};
+
+inline const TessellationTable& SphereTessellation() {
+	static Lazy<TessellationTable> table("SphereTessellation", []() {
+		return std::make_unique<TessellationTable>(36);
+	});
+	return table.Get();
+}
+
+// Same index order as createParametricIndices.
+inline void AppendGridIndices(TriangleMesh& mesh, uint32_t base, int usteps, int vsteps) {
+	uint32_t us = usteps + 1;
+	for (int v = 0; v < vsteps; ++v) {
+		for (int u = 0; u < usteps; ++u) {
+			uint32_t i00 = base + (u + 0) + (v + 0) * us;
+			uint32_t i10 = base + (u + 1) + (v + 0) * us;
+			uint32_t i11 = base + (u + 1) + (v + 1) * us;
+			uint32_t i01 = base + (u + 0) + (v + 1) * us;
+			mesh.indices.insert(mesh.indices.end(), { i00, i10, i11, i11, i01, i00 });
+		}
+	}
+}
+
+// Generic parametric surface; fn maps (u, v) in [0, 1]^2 to a position and
+// normal.
+inline void TessellateParametric(TriangleMesh& mesh, int usteps, int vsteps, std::function<void(float, float, Vec3&, Vec3&)> fn) {
+	uint32_t base = (uint32_t)mesh.positions.size();
+	for (int v = 0; v <= vsteps; ++v) {
+		for (int u = 0; u <= usteps; ++u) {
+			float s = (float)u / usteps, t = (float)v / vsteps;
+			Vec3 p, n;
+			fn(s, t, p, n);
+			mesh.positions.push_back(p);
+			mesh.normals.push_back(n);
+			mesh.st0.push_back(s);
+			mesh.st0.push_back(t);
+		}
+	}
+	AppendGridIndices(mesh, base, usteps, vsteps);
+}
+
+inline void TessellateSphere(TriangleMesh& mesh, float radius, const Vec3& center) {
+	const TessellationTable& table = SphereTessellation();
+	int steps = table.steps;
+	uint32_t base = (uint32_t)mesh.positions.size();
+	// Exact reserves would defeat geometric growth when many spheres are
+	// appended to one mesh, so capacity at least doubles.
+	size_t vertices = mesh.positions.size() + table.Vertices();
+	if (vertices > mesh.positions.capacity()) {
+		mesh.positions.reserve(std::max(vertices, mesh.positions.capacity() * 2));
+		mesh.normals.reserve(std::max(vertices, mesh.normals.capacity() * 2));
+	}
+	for (int v = 0; v <= steps; ++v) {
+		float sv = table.sines[v], cv = table.cosines[v];
+		for (int u = 0; u <= steps; ++u) {
+			Vec3 n(sv * table.cosines[2 * u], cv, sv * table.sines[2 * u]);
+			mesh.positions.push_back(center + n * radius);
+			mesh.normals.push_back(n);
+			mesh.st0.push_back((float)u / steps);
+			mesh.st0.push_back((float)v / steps);
+		}
+	}
+	AppendGridIndices(mesh, base, steps, steps);
+}
+
+inline void TessellateBox(TriangleMesh& mesh, float x, float y, float z, const Vec3& center) {
+	Vec3 half(x * 0.5f, y * 0.5f, z * 0.5f);
+	// Each face: normal, then the two in-plane axes spanning it.
+	static const Vec3 faces[6][3] = {
+		{ Vec3(1, 0, 0), Vec3(0, 0, -1), Vec3(0, 1, 0) },
+		{ Vec3(-1, 0, 0), Vec3(0, 0, 1), Vec3(0, 1, 0) },
+		{ Vec3(0, 1, 0), Vec3(1, 0, 0), Vec3(0, 0, -1) },
+		{ Vec3(0, -1, 0), Vec3(1, 0, 0), Vec3(0, 0, 1) },
+		{ Vec3(0, 0, 1), Vec3(1, 0, 0), Vec3(0, 1, 0) },
+		{ Vec3(0, 0, -1), Vec3(-1, 0, 0), Vec3(0, 1, 0) },
+	};
+	for (auto& face : faces) {
+		TessellateParametric(mesh, 1, 1, [&](float s, float t, Vec3& p, Vec3& n) {
+			Vec3 local = face[0] + face[1] * (2.0f * s - 1.0f) + face[2] * (2.0f * t - 1.0f);
+			p = center + Vec3(local.x * half.x, local.y * half.y, local.z * half.z);
+			n = face[0];
+		});
+	}
+}
+
+// torusPos from python/module_parametric.py, with its analytic normal. v
+// runs the other way around the tube so triangles wind counter-clockwise
+// from outside like the sphere's.
+inline void TessellateTorus(TriangleMesh& mesh, float major, float minor, const Vec3& center, int usteps = 48, int vsteps = 24) {
+	TessellateParametric(mesh, usteps, vsteps, [&](float s, float t, Vec3& p, Vec3& n) {
+		float au = 6.28318531f * s, av = -6.28318531f * t;
+		n = Vec3(cosf(av) * cosf(au), sinf(av), cosf(av) * sinf(au));
+		p = center + Vec3((major + minor * cosf(av)) * cosf(au), minor * sinf(av), (major + minor * cosf(av)) * sinf(au));
+	});
+}
+
+// Objects that can regenerate triangles from their own compact parameters.
+class ITessellatable {
+public:
+	virtual ~ITessellatable() {}
+	virtual void Tessellate(TriangleMesh& mesh) const = 0;
+};
@@ -0,0 +1,249 @@
+#pragma once
+
+///////////////////////////////////////////////////////////////////////////////
+// Textures.
+//
+// Mipmapped RGBA float textures for the st0 channel of the tessellated
+// meshes. Every level is stored in 4x4 texel tiles rather than rows, so the
+// 2x2 footprint of a bilinear fetch almost always falls in one 256 byte tile
+// instead of straddling two rows a texture width apart.
+//
+// Sampling works on four UVs at once. Wrapping, texel addresses and filter
+// weights are computed across the four lanes in float, so no coordinate is
+// converted to an integer until it is known to lie inside the level; each
+// lane then does its four texel loads, 16 bytes each, blended in all four
+// channels at once. Trilinear sampling takes one
+// LOD for all four lanes, which is what a 2x2 pixel quad has.
+///////////////////////////////////////////////////////////////////////////////
+
+#include <cmath>
+#include <vector>
+
+#include "image.h"
+#include "simd.h"
+
+enum class TextureWrap {
+	Repeat,
+	Clamp,
+};
+
+class Texture {
+public:
+	static constexpr int TileSize = 4;
+	struct Level {
+		int width, height;
+		int tilesX;
+		size_t offset;
+	};
+protected:
+	struct alignas(16) Texel {
+		float rgba[4];
+	};
+	std::vector<Level> _levels;
+	std::vector<Texel> _texels;
+	TextureWrap _wrap;
+
+	size_t Address(const Level& level, int x, int y) const {
+		int tile = (y / TileSize) * level.tilesX + x / TileSize;
+		return level.offset + (size_t)tile * TileSize * TileSize + (y % TileSize) * TileSize + x % TileSize;
+	}
+	int WrapCoordinate(int i, int size) const {
+		if (_wrap == TextureWrap::Clamp) {
+			return i < 0 ? 0 : i >= size ? size - 1 : i;
+		}
+		i %= size;
+		return i < 0 ? i + size : i;
+	}
+	// WrapCoordinate across lanes of whole numbers. The final clamp catches
+	// NaNs and coordinates too large for the repeat to be exact, so the
+	// result is always a texel of the level.
+	Float4 WrapCoordinates(Float4 i, int size) const {
+		if (_wrap == TextureWrap::Repeat) {
+			i = i - Float4((float)size) * Floor(i / Float4((float)size));
+		}
+		return Min(Max(i, Float4(0.0f)), Float4((float)(size - 1)));
+	}
+	void AddLevel(int width, int height) {
+		Level level;
+		level.width = width;
+		level.height = height;
+		level.tilesX = (width + TileSize - 1) / TileSize;
+		level.offset = _texels.size();
+		int tilesY = (height + TileSize - 1) / TileSize;
+		_texels.resize(_texels.size() + (size_t)level.tilesX * tilesY * TileSize * TileSize);
+		_levels.push_back(level);
+	}
+	// 2x2 box filter from the level above; odd edges repeat their last texel.
+	void BuildMips() {
+		while (_levels.back().width > 1 || _levels.back().height > 1) {
+			Level source = _levels.back();
+			AddLevel(std::max(1, source.width / 2), std::max(1, source.height / 2));
+			const Level& level = _levels.back();
+			for (int y = 0; y < level.height; ++y) {
+				for (int x = 0; x < level.width; ++x) {
+					int x0 = std::min(2 * x, source.width - 1), x1 = std::min(2 * x + 1, source.width - 1);
+					int y0 = std::min(2 * y, source.height - 1), y1 = std::min(2 * y + 1, source.height - 1);
+					Float4 sum = Float4::Load(_texels[Address(source, x0, y0)].rgba)
+						+ Float4::Load(_texels[Address(source, x1, y0)].rgba)
+						+ Float4::Load(_texels[Address(source, x0, y1)].rgba)
+						+ Float4::Load(_texels[Address(source, x1, y1)].rgba);
+					(sum * Float4(0.25f)).Store(_texels[Address(level, x, y)].rgba);
+				}
+			}
+		}
+	}
+	// Bilinear in one level, four UVs; result is one RGBA per lane.
+	void BilinearTexels(int levelIndex, const Float4& u, const Float4& v, Float4* texels) const {
+		const Level& level = _levels[levelIndex];
+		Float4 fx = u * Float4((float)level.width) - Float4(0.5f);
+		Float4 fy = v * Float4((float)level.height) - Float4(0.5f);
+		Float4 x0 = Floor(fx), y0 = Floor(fy);
+		Float4 tx = fx - x0, ty = fy - y0;
+		Float4 one(1.0f);
+		float w00[4], w10[4], w01[4], w11[4];
+		((one - tx) * (one - ty)).Store(w00);
+		(tx * (one - ty)).Store(w10);
+		((one - tx) * ty).Store(w01);
+		(tx * ty).Store(w11);
+		// Address splits into a column part from x and a row part from y.
+		// Both are whole numbers below the level's texel count, exact in
+		// float for any level up to 4096x4096.
+		const Float4 quarter(0.25f), four((float)TileSize), tileTexels((float)(TileSize * TileSize));
+		const Float4 rowTexels((float)(level.tilesX * TileSize * TileSize));
+		auto column = [&](const Float4& x) {
+			Float4 tile = Floor(x * quarter);
+			return tile * tileTexels + (x - tile * four);
+		};
+		auto row = [&](const Float4& y) {
+			Float4 tile = Floor(y * quarter);
+			return tile * rowTexels + (y - tile * four) * four;
+		};
+		float xa[4], xb[4], ya[4], yb[4];
+		column(WrapCoordinates(x0, level.width)).Store(xa);
+		column(WrapCoordinates(x0 + one, level.width)).Store(xb);
+		row(WrapCoordinates(y0, level.height)).Store(ya);
+		row(WrapCoordinates(y0 + one, level.height)).Store(yb);
+		const Texel* base = &_texels[level.offset];
+		for (int lane = 0; lane < 4; ++lane) {
+			texels[lane] = Float4::Load(base[(size_t)ya[lane] + (size_t)xa[lane]].rgba) * Float4(w00[lane])
+				+ Float4::Load(base[(size_t)ya[lane] + (size_t)xb[lane]].rgba) * Float4(w10[lane])
+				+ Float4::Load(base[(size_t)yb[lane] + (size_t)xa[lane]].rgba) * Float4(w01[lane])
+				+ Float4::Load(base[(size_t)yb[lane] + (size_t)xb[lane]].rgba) * Float4(w11[lane]);
+		}
+	}
+	void TrilinearTexels(const Float4& u, const Float4& v, float lod, Float4* texels) const {
+		lod = std::max(0.0f, std::min(lod, (float)(_levels.size() - 1)));
+		int level = (int)lod;
+		float blend = lod - level;
+		BilinearTexels(level, u, v, texels);
+		if (blend > 0.0f && level + 1 < (int)_levels.size()) {
+			Float4 coarse[4];
+			BilinearTexels(level + 1, u, v, coarse);
+			for (int lane = 0; lane < 4; ++lane) {
+				texels[lane] = texels[lane] + (coarse[lane] - texels[lane]) * Float4(blend);
+			}
+		}
+	}
+public:
+	// rgba holds width * height texels in rows.
+	Texture(int width, int height, const float* rgba, TextureWrap wrap = TextureWrap::Repeat) : _wrap(wrap) {
+		AddLevel(width, height);
+		for (int y = 0; y < height; ++y) {
+			for (int x = 0; x < width; ++x) {
+				Texel& texel = _texels[Address(_levels[0], x, y)];
+				for (int c = 0; c < 4; ++c) {
+					texel.rgba[c] = rgba[((size_t)y * width + x) * 4 + c];
+				}
+			}
+		}
+		BuildMips();
+	}
+	static Texture FromImage(const Image& image, TextureWrap wrap = TextureWrap::Repeat) {
+		std::vector<float> rgba((size_t)image.width * image.height * 4, 1.0f);
+		for (size_t i = 0; i < (size_t)image.width * image.height; ++i) {
+			rgba[i * 4 + 0] = image.rgb[i * 3 + 0];
+			rgba[i * 4 + 1] = image.rgb[i * 3 + 1];
+			rgba[i * 4 + 2] = image.rgb[i * 3 + 2];
+		}
+		return Texture(image.width, image.height, rgba.data(), wrap);
+	}
+	// Two colors in cells x cells squares.
+	static Texture Checker(int size, int cells, const Vec3& a, const Vec3& b) {
+		Image image(size, size);
+		for (int y = 0; y < size; ++y) {
+			for (int x = 0; x < size; ++x) {
+				const Vec3& c = ((x * cells / size) + (y * cells / size)) % 2 == 0 ? a : b;
+				float* pixel = image.Pixel(x, y);
+				pixel[0] = c.x;
+				pixel[1] = c.y;
+				pixel[2] = c.z;
+			}
+		}
+		return FromImage(image);
+	}
+	int Levels() const {
+		return (int)_levels.size();
+	}
+	const Level& GetLevel(int level) const {
+		return _levels[level];
+	}
+	size_t Bytes() const {
+		return _texels.size() * sizeof(Texel);
+	}
+	// Texel lookup without filtering, after wrapping.
+	Float4 Fetch(int level, int x, int y) const {
+		const Level& l = _levels[level];
+		return Float4::Load(_texels[Address(l, WrapCoordinate(x, l.width), WrapCoordinate(y, l.height))].rgba);
+	}
+	// LOD for a 2x2 quad laid out as the rasterizer's lanes: (x, y),
+	// (x + 1, y), (x, y + 1), (x + 1, y + 1).
+	float QuadLod(const Float4& u, const Float4& v) const {
+		float dudx = (u[1] - u[0]) * _levels[0].width, dvdx = (v[1] - v[0]) * _levels[0].height;
+		float dudy = (u[2] - u[0]) * _levels[0].width, dvdy = (v[2] - v[0]) * _levels[0].height;
+		float rho = std::max(dudx * dudx + dvdx * dvdx, dudy * dudy + dvdy * dvdy);
+		return rho > 0.0f ? 0.5f * log2f(rho) : 0.0f;
+	}
+	void SampleBilinear(int level, const Float4& u, const Float4& v, Float4* rgba) const {
+		// One RGBA per lane in, one lane per pixel for each channel out.
+		BilinearTexels(level, u, v, rgba);
+		Transpose(rgba[0], rgba[1], rgba[2], rgba[3]);
+	}
+	void SampleTrilinear(const Float4& u, const Float4& v, float lod, Float4* rgba) const {
+		TrilinearTexels(u, v, lod, rgba);
+		Transpose(rgba[0], rgba[1], rgba[2], rgba[3]);
+	}
+	// Shader entry points. A quad picks its own LOD; a single pixel has no
+	// neighbours to difference against and reads the top level.
+	void Sample(const Float4& u, const Float4& v, Float4* rgba) const {
+		SampleTrilinear(u, v, QuadLod(u, v), rgba);
+	}
+	void Sample(float u, float v, float* rgba) const {
+		Float4 texels[4];
+		BilinearTexels(0, Float4(u), Float4(v), texels);
+		texels[0].Store(rgba);
+	}
+	// count UVs from u and v, interleaved RGBA into rgba. A tail shorter
+	// than four lanes repeats the last UV and drops the extra results.
+	void SampleBatch(const float* u, const float* v, size_t count, float lod, float* rgba) const {
+		size_t i = 0;
+		Float4 texels[4];
+		for (; i + 4 <= count; i += 4) {
+			TrilinearTexels(Float4::Load(u + i), Float4::Load(v + i), lod, texels);
+			for (int lane = 0; lane < 4; ++lane) {
+				texels[lane].Store(rgba + (i + lane) * 4);
+			}
+		}
+		if (i < count) {
+			float tu[4], tv[4];
+			for (int lane = 0; lane < 4; ++lane) {
+				size_t j = std::min(i + lane, count - 1);
+				tu[lane] = u[j];
+				tv[lane] = v[j];
+			}
+			TrilinearTexels(Float4::Load(tu), Float4::Load(tv), lod, texels);
+			for (size_t lane = 0; i + lane < count; ++lane) {
+				texels[lane].Store(rgba + (i + lane) * 4);
+			}
+		}
+	}
+};
@@ -0,0 +1,133 @@
+#pragma once
+
+///////////////////////////////////////////////////////////////////////////////
+// Thread Pool.
+//
+// A plain fixed size pool with one shared queue. Nothing here is clever; the
+// point is to have a single place that owns worker threads so subsystems
+// don't each spin up their own. The shared pool is created lazily, so a
+// process that never goes wide never starts a thread.
+///////////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "startup.h"
+
+class ThreadPool {
+protected:
+	std::mutex _mutex;
+	std::condition_variable _wake;
+	std::deque<std::function<void()>> _queue;
+	std::vector<std::thread> _threads;
+	bool _stopping;
+
+	// The pool whose worker is the calling thread, if any.
+	static ThreadPool*& Current() {
+		thread_local ThreadPool* pool = nullptr;
+		return pool;
+	}
+	void Worker() {
+		Current() = this;
+		for (;;) {
+			std::function<void()> task;
+			{
+				std::unique_lock<std::mutex> lock(_mutex);
+				_wake.wait(lock, [this]() { return _stopping || !_queue.empty(); });
+				if (_queue.empty()) {
+					return;
+				}
+				task = std::move(_queue.front());
+				_queue.pop_front();
+			}
+			task();
+		}
+	}
+public:
+	ThreadPool(unsigned threads = std::max(1u, std::thread::hardware_concurrency())) : _stopping(false) {
+		for (unsigned i = 0; i < threads; ++i) {
+			_threads.emplace_back([this]() { Worker(); });
+		}
+	}
+	~ThreadPool() {
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_stopping = true;
+		}
+		_wake.notify_all();
+		for (auto& thread : _threads) {
+			thread.join();
+		}
+	}
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+	static ThreadPool& Shared() {
+		static Lazy<ThreadPool> pool("ThreadPool");
+		return pool.Get();
+	}
+	unsigned Size() const {
+		return (unsigned)_threads.size();
+	}
+	template <class F> auto Submit(F fn) -> std::future<decltype(fn())> {
+		auto task = std::make_shared<std::packaged_task<decltype(fn())()>>(std::move(fn));
+		std::future<decltype(fn())> result = task->get_future();
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_queue.push_back([task]() { (*task)(); });
+		}
+		_wake.notify_one();
+		return result;
+	}
+	// Split [begin, end) into roughly equal chunks, one per worker, and run
+	// fn(first, last) on each. The calling thread takes the last chunk. Every
+	// chunk has finished before this returns or throws; if several threw, one
+	// of their exceptions is rethrown. Called from one of this pool's own tasks it runs the
+	// whole range in line, since waiting on chunks queued behind the caller
+	// could deadlock the pool.
+	void ParallelFor(size_t begin, size_t end, std::function<void(size_t, size_t)> fn) {
+		size_t count = end > begin ? end - begin : 0;
+		size_t chunks = Current() == this ? 1 : std::min<size_t>(count, Size() + 1);
+		if (chunks <= 1) {
+			if (count > 0) {
+				fn(begin, end);
+			}
+			return;
+		}
+		size_t step = (count + chunks - 1) / chunks;
+		std::vector<std::future<void>> pending;
+		std::exception_ptr error;
+		for (size_t first = begin; first < end; first += step) {
+			size_t last = std::min(end, first + step);
+			if (last == end) {
+				try {
+					fn(first, last);
+				} catch (...) {
+					error = std::current_exception();
+				}
+			} else {
+				pending.push_back(Submit([&fn, first, last]() { fn(first, last); }));
+			}
+		}
+		// The queued chunks hold a reference to fn, so all of them are
+		// waited for even after a failure.
+		for (auto& p : pending) {
+			try {
+				p.get();
+			} catch (...) {
+				if (!error) {
+					error = std::current_exception();
+				}
+			}
+		}
+		if (error) {
+			std::rethrow_exception(error);
+		}
+	}
+};
@@ -0,0 +1,140 @@
+#pragma once
+
+///////////////////////////////////////////////////////////////////////////////
+// Tile Streams.
+//
+// A renderer that works in screen tiles has each tile finished long before
+// the frame is, so there is no reason to hold the frame until the end just to
+// write it out. TileStreamOut sends each tile through an IStreamOut as soon
+// as it is handed one, tagged with where it goes, and a TileAssembler on the
+// other end puts the image back together as tiles arrive, in whatever order
+// they were finished.
+//
+// The stream is a "Tiles" tag, the image width and height as int32, then one
+// record per tile: x, y, width and height as int32 followed by width * height
+// RGB floats in rows. A record with zero width and height ends the stream.
+///////////////////////////////////////////////////////////////////////////////
+
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+#include "geometric.h"
+#include "image.h"
+
+struct TileHeader {
+	int32_t x, y, width, height;
+};
+
+// Tiles may be written from any thread; a record's writes are made under a
+// lock so records never interleave.
+class TileStreamOut {
+protected:
+	IStreamOut& _stream;
+	std::mutex _mutex;
+	int _width, _height;
+	size_t _tiles;
+	bool _finished;
+public:
+	TileStreamOut(IStreamOut& stream, int width, int height) : _stream(stream), _width(width), _height(height), _tiles(0), _finished(false) {
+		int32_t size[2] = { width, height };
+		uint8_t header[5 + sizeof(size)];
+		memcpy(header, "Tiles", 5);
+		memcpy(header + 5, size, sizeof(size));
+		_stream.WriteBytes(header, sizeof(header));
+	}
+	TileStreamOut(const TileStreamOut&) = delete;
+	TileStreamOut& operator=(const TileStreamOut&) = delete;
+	// rgb holds width * height pixels in rows of width * 3 floats.
+	void WriteTile(int x, int y, int width, int height, const float* rgb) {
+		TileHeader header = { x, y, width, height };
+		std::lock_guard<std::mutex> lock(_mutex);
+		_stream.WriteBytes(&header, sizeof(header));
+		_stream.WriteBytes(rgb, (int)((size_t)width * height * 3 * sizeof(float)));
+		++_tiles;
+	}
+	// Writes the end record. Not done by a destructor, since a failing
+	// stream throws.
+	void Finish() {
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (!_finished) {
+			TileHeader end = { 0, 0, 0, 0 };
+			_stream.WriteBytes(&end, sizeof(end));
+			_finished = true;
+		}
+	}
+	int Width() const {
+		return _width;
+	}
+	int Height() const {
+		return _height;
+	}
+	size_t Tiles() const {
+		return _tiles;
+	}
+};
+
+// The consumer side. Reads the stream header on construction, then one tile
+// per ReadTile into an image of the full size.
+class TileAssembler {
+protected:
+	IStreamIn& _stream;
+	Image _image;
+	std::vector<float> _tile;
+	size_t _pixels;
+	bool _ended;
+public:
+	TileAssembler(IStreamIn& stream) : _stream(stream), _pixels(0), _ended(false) {
+		char tag[5];
+		_stream.ReadBytes(tag, sizeof(tag));
+		if (memcmp(tag, "Tiles", 5) != 0) {
+			throw StreamException("Not a tile stream");
+		}
+		int32_t size[2];
+		_stream.ReadBytes(size, sizeof(size));
+		if (size[0] <= 0 || size[1] <= 0) {
+			throw StreamException("Bad tile stream size");
+		}
+		_image = Image(size[0], size[1]);
+	}
+	// False once the end record has been read. header, if given, receives
+	// where the tile went.
+	bool ReadTile(TileHeader* header = nullptr) {
+		if (_ended) {
+			return false;
+		}
+		TileHeader tile;
+		_stream.ReadBytes(&tile, sizeof(tile));
+		if (tile.width == 0 && tile.height == 0) {
+			_ended = true;
+			return false;
+		}
+		if (tile.x < 0 || tile.y < 0 || tile.width <= 0 || tile.height <= 0 || tile.width > _image.width - tile.x || tile.height > _image.height - tile.y) {
+			throw StreamException("Tile outside image");
+		}
+		_tile.resize((size_t)tile.width * tile.height * 3);
+		_stream.ReadBytes(_tile.data(), (int)(_tile.size() * sizeof(float)));
+		for (int row = 0; row < tile.height; ++row) {
+			memcpy(_image.Pixel(tile.x, tile.y + row), &_tile[(size_t)row * tile.width * 3], tile.width * 3 * sizeof(float));
+		}
+		_pixels += (size_t)tile.width * tile.height;
+		if (header != nullptr) {
+			*header = tile;
+		}
+		return true;
+	}
+	// Reads tiles until the end record.
+	void ReadAll() {
+		while (ReadTile()) {
+		}
+	}
+	// Every pixel has been written at least once, assuming tiles don't
+	// overlap.
+	bool Complete() const {
+		return _pixels >= (size_t)_image.width * _image.height;
+	}
+	const Image& GetImage() const {
+		return _image;
+	}
+};